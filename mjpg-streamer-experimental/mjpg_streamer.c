@@ -306,6 +306,7 @@ int main(int argc, char *argv[])
         global.in[i].context   = NULL;
         global.in[i].buf       = NULL;
         global.in[i].size      = 0;
+        global.in[i].insert_size = 0;
         global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
         global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
         if(!global.in[i].handle) {
@@ -64,6 +64,7 @@ enum _cmd_group {
     IN_CMD_RESOLUTION =     2,
     IN_CMD_JPEG_QUALITY =   3,
     IN_CMD_PWC =            4,
+    IN_CMD_FORMAT =         5,
 };
 
 typedef struct _control control;
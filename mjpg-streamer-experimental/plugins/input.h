@@ -20,6 +20,7 @@
 #                                                                              #
 *******************************************************************************/
 
+#include <string.h>
 #include <syslog.h>
 #include "../mjpg_streamer.h"
 #define INPUT_PLUGIN_PREFIX " i: "
@@ -76,6 +77,23 @@ struct _input {
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /*
+     * optional JSON object describing the current frame, e.g. detected
+     * objects. Owned by the plugin and changed together with buf, NULL if
+     * the plugin has nothing to report.
+     */
+    char *metadata;
+
+    /*
+     * optional bytes the consumers insert at offset insert_at of buf while
+     * they copy the frame, e.g. the Huffman tables some MJPEG cameras leave
+     * out, so the plugin does not have to copy the frame to add them.
+     * Changed together with buf, insert_size is 0 if there is nothing.
+     */
+    const unsigned char *insert;
+    int insert_size;
+    int insert_at;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
@@ -87,3 +105,48 @@ struct _input {
     int (*run)(int);
     int (*cmd)(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str);
 };
+
+/******************************************************************************
+Description.: Size of the current frame of an input including the inserted
+              bytes, call with in->db locked
+Input Value.: in: the input
+Return Value: size in bytes
+******************************************************************************/
+static inline int input_frame_size(const input *in)
+{
+    return in->size + in->insert_size;
+}
+
+/******************************************************************************
+Description.: Copy the current frame of an input and insert the bytes the
+              plugin asked for, call with in->db locked
+Input Value.: * in.: the input
+              * out: receives input_frame_size(in) bytes
+Return Value: size of the copy
+******************************************************************************/
+static inline int input_copy_frame(const input *in, unsigned char *out)
+{
+    if(in->insert_size <= 0) {
+        memcpy(out, in->buf, in->size);
+        return in->size;
+    }
+
+    memcpy(out, in->buf, in->insert_at);
+    memcpy(out + in->insert_at, in->insert, in->insert_size);
+    memcpy(out + in->insert_at + in->insert_size, in->buf + in->insert_at, in->size - in->insert_at);
+    return in->size + in->insert_size;
+}
+
+/******************************************************************************
+Description.: Tell if the current frame of an input is a JPEG, plugins that
+              publish other codecs name them in the metadata, call with
+              in->db locked
+Input Value.: in: the input
+Return Value: 1 for JPEG frames, 0 otherwise
+******************************************************************************/
+static inline int input_frame_jpeg(const input *in)
+{
+    const char *codec = (in->metadata != NULL) ? strstr(in->metadata, "\"codec\": \"") : NULL;
+
+    return codec == NULL || strncmp(codec + strlen("\"codec\": \""), "jpeg\"", 5) == 0;
+}
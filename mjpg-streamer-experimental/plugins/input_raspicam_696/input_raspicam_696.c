@@ -681,6 +681,33 @@ static void splitter_buffer_callback(MMAL_PORT_T *port,
 }
 
 
+/******************************************************************************
+  Describe the bounding boxes of the detected blobs as JSON, the output
+  plugins send it along with the frame
+ ******************************************************************************/
+static char bbox_metadata[16 + MAX_BBOXES * 4 * 7];
+
+static char *format_bbox_metadata(Splitter_Callback_Data* p) {
+    int i, len;
+
+    if (!p->tcp_params.detect_yuv) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->bbox_mutex);
+    len = sprintf(bbox_metadata, "{\"blobs\": [");
+    for (i = 0; i + 3 < p->bbox_element_count; i += 4) {
+        len += sprintf(bbox_metadata + len, "%s[%u,%u,%u,%u]",
+                       i ? "," : "",
+                       p->bbox_element[i], p->bbox_element[i + 1],
+                       p->bbox_element[i + 2], p->bbox_element[i + 3]);
+    }
+    pthread_mutex_unlock(&p->bbox_mutex);
+    sprintf(bbox_metadata + len, "]}");
+
+    return bbox_metadata;
+}
+
 /******************************************************************************
   Callback from mmal JPEG encoder
  ******************************************************************************/
@@ -787,6 +814,10 @@ static void encoder_buffer_callback(MMAL_PORT_T *port,
                 pglobal->in[plugin_number].timestamp = timestamp;
             }
 
+            //Set frame metadata
+            pglobal->in[plugin_number].metadata =
+                          format_bbox_metadata(pData->splitter_data_ptr);
+
             //mark frame complete
             complete = 1;
 
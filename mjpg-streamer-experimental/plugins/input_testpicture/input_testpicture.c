@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
@@ -37,10 +38,15 @@
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
+#ifndef NO_LIBJPEG
+#include <jpeglib.h>
+#endif
+
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 
 #include "testpictures.h"
+#include "probe.h"
 
 #define INPUT_PLUGIN_NAME "TESTPICTURE input plugin"
 
@@ -55,6 +61,8 @@ void worker_cleanup(void *);
 void help(void);
 
 static int delay = 1000;
+static int latency = 0;
+static int quality = 80;
 
 /* details of converted JPG pictures */
 struct pic {
@@ -112,6 +120,10 @@ int input_init(input_parameter *param, int plugin_no)
             {"delay", required_argument, 0, 0},
             {"r", required_argument, 0, 0},
             {"resolution", required_argument, 0, 0},
+            {"l", no_argument, 0, 0},
+            {"latency", no_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -154,6 +166,20 @@ int input_init(input_parameter *param, int plugin_no)
             }
             break;
 
+            /* l, latency */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            latency = 1;
+            break;
+
+            /* q, quality */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            quality = MIN(MAX(atoi(optarg), 1), 100);
+            break;
+
         default:
             DBG("default case\n");
             help();
@@ -161,10 +187,20 @@ int input_init(input_parameter *param, int plugin_no)
         }
     }
 
+#ifdef NO_LIBJPEG
+    if(latency) {
+        IPRINT("the latency probe needs libjpeg, this plugin was built without it\n");
+        return 1;
+    }
+#endif
+
     pglobal = param->global;
 
     IPRINT("delay.............: %i\n", delay);
     IPRINT("resolution........: %s\n", pics->resolution);
+    if(latency) {
+        IPRINT("latency probe.....: quality %i\n", quality);
+    }
 
     return 0;
 }
@@ -217,31 +253,140 @@ void help(void)
     " ---------------------------------------------------------------\n" \
     " The following parameters can be passed to this plugin:\n\n" \
     " [-d | --delay ]........: delay to pause between frames\n" \
-    " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n"
+    " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n" \
+    " [-l | --latency ]......: render the time and a sequence number into\n" \
+    "                          each frame for tools/latency_probe\n" \
+    " [-q | --quality ]......: JPEG quality of the latency probe (default 80)\n"
     " ---------------------------------------------------------------\n");
 }
 
+#ifndef NO_LIBJPEG
+/******************************************************************************
+Description.: render and compress a frame of the latency probe: a gray
+              background with a bar moving from left to right and the probe
+              pattern in the top rows
+Input Value.: * width, height: size of the frame
+              * stamp: sequence number and time to draw into the frame
+              * jpeg.: receives the compressed frame, to be freed by the caller
+              * size.: receives the size of the compressed frame
+Return Value: 0 if OK, -1 on error
+******************************************************************************/
+static int render_probe(int width, int height, const probe_stamp *stamp, unsigned char **jpeg, unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *luma, *row;
+    int bar = (stamp->seq * 8) % width, x, y;
+
+    luma = malloc(width);
+    row = malloc(width * 3);
+    if(luma == NULL || row == NULL) {
+        free(luma);
+        free(row);
+        return -1;
+    }
+
+    *jpeg = NULL;
+    *size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, jpeg, size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    for(y = 0; y < height; y++) {
+        if(!probe_render_row(luma, width, height, y, stamp)) {
+            memset(luma, 64 + 128 * y / height, width);
+            for(x = bar; x < MIN(bar + width / 16, width); x++)
+                luma[x] = PROBE_WHITE;
+        }
+        for(x = 0; x < width; x++) {
+            row[x * 3] = luma[x];
+            row[x * 3 + 1] = 128;
+            row[x * 3 + 2] = 128;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    free(luma);
+    free(row);
+
+    return 0;
+}
+#endif
+
 /******************************************************************************
 Description.: copy a picture from testpictures.h and signal this to all output
               plugins, afterwards switch to the next frame of the animation.
+              With the latency probe each frame is rendered and compressed
+              instead, its timestamp is the time before rendering started, so
+              the measured latency includes the encoder.
 Input Value.: arg is not used
 Return Value: NULL
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
     int i = 0;
+#ifndef NO_LIBJPEG
+    int width = 0, height = 0;
+    probe_stamp stamp = { 0, 0 };
+    struct timeval now;
+    unsigned char *jpeg;
+    unsigned long size;
+
+    sscanf(pics->resolution, "%dx%d", &width, &height);
+#endif
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
     while(!pglobal->stop) {
 
+#ifndef NO_LIBJPEG
+        if(latency) {
+            gettimeofday(&now, NULL);
+            stamp.usec = (unsigned long long)now.tv_sec * 1000000 + now.tv_usec;
+
+            if(render_probe(width, height, &stamp, &jpeg, &size) == 0) {
+                if(size <= 256 * 1024) {
+                    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+
+                    pglobal->in[plugin_number].size = size;
+                    memcpy(pglobal->in[plugin_number].buf, jpeg, size);
+                    pglobal->in[plugin_number].timestamp = now;
+
+                    /* signal fresh_frame */
+                    pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+                    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+                }
+                free(jpeg);
+            }
+            stamp.seq++;
+
+            usleep(1000 * delay);
+            continue;
+        }
+#endif
+
         /* copy JPG picture to global buffer */
         pthread_mutex_lock(&pglobal->in[plugin_number].db);
 
         i = (i + 1) % LENGTH_OF(pics->sequence);
         pglobal->in[plugin_number].size = pics->sequence[i].size;
         memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
+        gettimeofday(&pglobal->in[plugin_number].timestamp, NULL);
 
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
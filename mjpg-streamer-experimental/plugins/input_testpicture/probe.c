@@ -0,0 +1,152 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <string.h>
+
+#include "probe.h"
+
+#define PROBE_BYTES 15
+
+/******************************************************************************
+Description.: CRC-16-CCITT, polynomial 0x1021 and initial value 0xFFFF
+Input Value.: * data: the bytes
+              * size: number of bytes
+Return Value: the CRC
+******************************************************************************/
+static unsigned short crc16(const unsigned char *data, int size)
+{
+    unsigned short crc = 0xFFFF;
+    int i;
+
+    while(size-- > 0) {
+        crc ^= *data++ << 8;
+        for(i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+/******************************************************************************
+Description.: Serialize a stamp to the bytes of the pattern
+Input Value.: * stamp: the stamp
+              * bytes: receives PROBE_BYTES bytes
+Return Value: -
+******************************************************************************/
+static void pack(const probe_stamp *stamp, unsigned char *bytes)
+{
+    unsigned short crc;
+    int i;
+
+    bytes[0] = PROBE_SYNC;
+    for(i = 0; i < 4; i++)
+        bytes[1 + i] = stamp->seq >> (24 - 8 * i);
+    for(i = 0; i < 8; i++)
+        bytes[5 + i] = stamp->usec >> (56 - 8 * i);
+
+    crc = crc16(bytes, 13);
+    bytes[13] = crc >> 8;
+    bytes[14] = crc & 0xFF;
+}
+
+/******************************************************************************
+Description.: Size of the squares of the pattern
+Input Value.: width and height of the image
+Return Value: edge length in pixels, 0 if the image is too small
+******************************************************************************/
+int probe_block_size(int width, int height)
+{
+    int size = width / PROBE_COLUMNS;
+
+    return (size >= 2 && size * PROBE_ROWS <= height) ? size : 0;
+}
+
+/******************************************************************************
+Description.: Draw a row of the pattern
+Input Value.: * luma.: row of width luma values, only the pattern is changed
+              * width, height: size of the image
+              * y....: number of the row
+              * stamp: time and sequence number to draw
+Return Value: 1 if the row belongs to the pattern, 0 otherwise
+******************************************************************************/
+int probe_render_row(unsigned char *luma, int width, int height, int y, const probe_stamp *stamp)
+{
+    unsigned char bytes[PROBE_BYTES];
+    int size = probe_block_size(width, height), bit, x;
+
+    if(size == 0 || y >= size * PROBE_ROWS)
+        return 0;
+
+    pack(stamp, bytes);
+
+    for(x = 0; x < PROBE_COLUMNS; x++) {
+        bit = (y / size) * PROBE_COLUMNS + x;
+        memset(luma + x * size, (bit < PROBE_BYTES * 8 && (bytes[bit / 8] & (0x80 >> (bit % 8)))) ? PROBE_WHITE : PROBE_BLACK, size);
+    }
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: Read the pattern of a decoded frame. Each square is sampled in
+              its center half, which is not touched by compression artifacts
+              at its edges.
+Input Value.: * luma.: the luma plane of the image
+              * width, height: size of the image
+              * stride: bytes per row of luma
+              * stamp: receives the time and sequence number
+Return Value: 0 if OK, -1 if the frame carries no valid pattern
+******************************************************************************/
+int probe_read(const unsigned char *luma, int width, int height, int stride, probe_stamp *stamp)
+{
+    unsigned char bytes[PROBE_BYTES];
+    int size = probe_block_size(width, height), bit, x, y, x0, y0, sum, count;
+
+    if(size == 0)
+        return -1;
+
+    memset(bytes, 0, sizeof(bytes));
+    for(bit = 0; bit < PROBE_BYTES * 8; bit++) {
+        x0 = (bit % PROBE_COLUMNS) * size;
+        y0 = (bit / PROBE_COLUMNS) * size;
+        sum = count = 0;
+        for(y = y0 + size / 4; y < y0 + size - size / 4; y++) {
+            for(x = x0 + size / 4; x < x0 + size - size / 4; x++) {
+                sum += luma[y * stride + x];
+                count++;
+            }
+        }
+        if(sum > count * (PROBE_BLACK + PROBE_WHITE) / 2)
+            bytes[bit / 8] |= 0x80 >> (bit % 8);
+    }
+
+    if(bytes[0] != PROBE_SYNC || crc16(bytes, 13) != ((bytes[13] << 8) | bytes[14]))
+        return -1;
+
+    stamp->seq = 0;
+    for(x = 0; x < 4; x++)
+        stamp->seq = (stamp->seq << 8) | bytes[1 + x];
+    stamp->usec = 0;
+    for(x = 0; x < 8; x++)
+        stamp->usec = (stamp->usec << 8) | bytes[5 + x];
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+ * The latency probe draws the capture time and a sequence number as a
+ * pattern of black and white squares into the top of each frame. A bit is a
+ * square of width/PROBE_COLUMNS pixels, so the pattern scales with the
+ * image and survives scaled streams and JPEG compression.
+ *
+ * bits 0..7     sync byte PROBE_SYNC
+ * bits 8..39    sequence number
+ * bits 40..103  capture time in microseconds since the epoch
+ * bits 104..119 CRC-16-CCITT of the bytes above
+ */
+#define PROBE_COLUMNS 32
+#define PROBE_ROWS 4
+#define PROBE_SYNC 0xA5
+
+/* luma of the squares */
+#define PROBE_BLACK 16
+#define PROBE_WHITE 235
+
+typedef struct {
+    unsigned int seq;
+    unsigned long long usec;
+} probe_stamp;
+
+int probe_block_size(int width, int height);
+int probe_render_row(unsigned char *luma, int width, int height, int y, const probe_stamp *stamp);
+int probe_read(const unsigned char *luma, int width, int height, int stride, probe_stamp *stamp);
+
+#endif
@@ -0,0 +1,258 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include "v4l2uvc.h"
+#include "capture.h"
+
+/* the plugin is loaded once, all cameras with --shared_capture meet here */
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_idle = PTHREAD_COND_INITIALIZER; /* a camera is not busy anymore */
+static context *cameras[MAX_INPUT_PLUGINS];
+static int ncameras;
+static int epoll_fd = -1;
+static pthread_t capture_thread;
+static int running;
+
+/* ms a camera that could not take a frame is left alone */
+#define CAPTURE_RETRY 5
+#define CAPTURE_WAKEUP 100
+
+/******************************************************************************
+Description.: Read the monotonic clock
+Input Value.: -
+Return Value: the time in ms
+******************************************************************************/
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/******************************************************************************
+Description.: Register the devices that stream with epoll and remove those
+              that stopped or were opened again, called with the mutex held.
+              Cameras that were busy stay out until their retry time.
+Input Value.: -
+Return Value: ms until the next camera is due again, at most CAPTURE_WAKEUP
+******************************************************************************/
+static int sync_devices(void)
+{
+    struct epoll_event ev;
+    long now = now_ms();
+    int i, fd, timeout = CAPTURE_WAKEUP;
+
+    for(i = 0; i < ncameras; i++) {
+        struct vdIn *vd = cameras[i]->videoIn;
+
+        if(cameras[i]->capture_retry > now) {
+            if(cameras[i]->capture_retry - now < timeout)
+                timeout = cameras[i]->capture_retry - now;
+        } else
+            cameras[i]->capture_retry = 0;
+
+        fd = (vd->streamingState == STREAMING_ON && cameras[i]->capture_retry == 0) ? vd->fd : -1;
+        if(fd == cameras[i]->capture_fd)
+            continue;
+
+        /* fails if the old descriptor was closed, which removed it anyway */
+        if(cameras[i]->capture_fd >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cameras[i]->capture_fd, NULL);
+        cameras[i]->capture_fd = -1;
+
+        if(fd < 0)
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLPRI;
+        ev.data.ptr = cameras[i];
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl(ADD) failed");
+            continue;
+        }
+        cameras[i]->capture_fd = fd;
+    }
+
+    return timeout;
+}
+
+/******************************************************************************
+Description.: Check if the camera is still registered, it may have been
+              removed while the thread waited
+Input Value.: pcontext: the camera
+Return Value: 1 if registered, 0 otherwise
+******************************************************************************/
+static int registered(context *pcontext)
+{
+    int i;
+
+    for(i = 0; i < ncameras; i++)
+        if(cameras[i] == pcontext)
+            return 1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: The capture thread, dequeues a frame of each device epoll
+              reports as ready, so VIDIOC_DQBUF never waits. A camera that
+              changes its format or whose encoder is full is skipped for
+              CAPTURE_RETRY ms instead of holding up the others.
+Input Value.: unused
+Return Value: unused, always NULL
+******************************************************************************/
+static void *capture_worker(void *arg)
+{
+    struct epoll_event events[MAX_INPUT_PLUGINS];
+    context *pcontext;
+    int i, n, timeout, ret;
+
+    pthread_mutex_lock(&capture_mutex);
+    while(running && !cameras[0]->pglobal->stop) {
+        timeout = sync_devices();
+        pthread_mutex_unlock(&capture_mutex);
+
+        /* wake up now and then to notice stopped or reopened devices */
+        n = epoll_wait(epoll_fd, events, MAX_INPUT_PLUGINS, timeout);
+        if(n < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&capture_mutex);
+        for(i = 0; i < n && running; i++) {
+            pcontext = events[i].data.ptr;
+            if(!registered(pcontext) ||
+               pcontext->videoIn->streamingState != STREAMING_ON ||
+               pcontext->videoIn->fd != pcontext->capture_fd)
+                continue;
+
+            /* capture_remove() waits until the camera is not busy */
+            pcontext->capture_busy = 1;
+            pthread_mutex_unlock(&capture_mutex);
+
+            /* control events, the next frame may not be ready yet */
+            if(events[i].events & EPOLLPRI)
+                cam_events(pcontext);
+            ret = (events[i].events & EPOLLIN) ? cam_trygrab(pcontext) : 0;
+
+            pthread_mutex_lock(&capture_mutex);
+            pcontext->capture_busy = 0;
+            pthread_cond_broadcast(&capture_idle);
+            if(ret < 0) {
+                IPRINT("Error grabbing frames\n");
+                exit(EXIT_FAILURE);
+            }
+
+            /* the frame stays in the driver, epoll would report it right away */
+            if(ret > 0)
+                pcontext->capture_retry = now_ms() + CAPTURE_RETRY;
+        }
+    }
+    pthread_mutex_unlock(&capture_mutex);
+
+    DBG("leaving capture thread\n");
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Start the stream of a camera and hand it to the capture thread,
+              the thread is created for the first camera
+Input Value.: pcontext: the camera
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+int capture_add(context *pcontext)
+{
+    int ret = -1;
+
+    if(uvcStart(pcontext->videoIn) < 0)
+        return -1;
+
+    pthread_mutex_lock(&capture_mutex);
+    if(ncameras == MAX_INPUT_PLUGINS)
+        goto out;
+
+    if(epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        goto out;
+    }
+
+    pcontext->capture_fd = -1;
+    pcontext->capture_busy = 0;
+    pcontext->capture_retry = 0;
+    cameras[ncameras++] = pcontext;
+
+    if(!running) {
+        running = 1;
+        if(pthread_create(&capture_thread, NULL, capture_worker, NULL) != 0) {
+            running = 0;
+            ncameras--;
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&capture_mutex);
+    return ret;
+}
+
+/******************************************************************************
+Description.: Take a camera from the capture thread, the thread ends with
+              the last camera
+Input Value.: pcontext: the camera
+Return Value: -
+******************************************************************************/
+void capture_remove(context *pcontext)
+{
+    int i, last;
+
+    pthread_mutex_lock(&capture_mutex);
+    for(i = 0; i < ncameras; i++) {
+        if(cameras[i] != pcontext)
+            continue;
+        if(pcontext->capture_fd >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pcontext->capture_fd, NULL);
+        pcontext->capture_fd = -1;
+        cameras[i] = cameras[--ncameras];
+        break;
+    }
+
+    /* the thread may still grab a frame of it */
+    while(pcontext->capture_busy)
+        pthread_cond_wait(&capture_idle, &capture_mutex);
+
+    last = (ncameras == 0 && running);
+    if(last)
+        running = 0;
+    pthread_mutex_unlock(&capture_mutex);
+
+    if(last) {
+        pthread_join(capture_thread, NULL);
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
@@ -0,0 +1,33 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "v4l2uvc.h"
+
+/*
+ * Grabs the frames of several cameras on a single thread. The thread waits
+ * with epoll until one of the devices has a filled buffer and dequeues it,
+ * each camera is still published as its own input.
+ */
+int capture_add(context *pcontext);
+void capture_remove(context *pcontext);
+
+#endif
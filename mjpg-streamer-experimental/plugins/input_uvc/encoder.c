@@ -0,0 +1,335 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+#include "encoder.h"
+
+enum {
+    SLOT_FREE = 0,      /* can take the next raw frame */
+    SLOT_FILLING,       /* the camera thread copies a raw frame into it */
+    SLOT_RAW,           /* waits for an encoder thread */
+    SLOT_ENCODING,      /* an encoder thread compresses it */
+    SLOT_DONE,          /* compressed, waits for the frames submitted before */
+    SLOT_PUBLISHED      /* the output plugins read it */
+};
+
+typedef struct {
+    int state;
+    unsigned long long seq;
+    unsigned char *raw;
+    int raw_size, raw_capacity;
+    unsigned char *jpeg;
+    int jpeg_size, jpeg_capacity;
+    int width, height, format;
+    struct timeval timestamp;
+    char metadata[METADATA_SIZE];
+} slot;
+
+struct _encoder {
+    input *in;
+    int quality;
+    int threads;
+    pthread_t thread[ENCODER_MAX_THREADS];
+
+    /* one slot per thread, one being filled and one published */
+    int nslots;
+    slot slots[ENCODER_MAX_THREADS + 2];
+    slot *published;
+    unsigned long long next_seq;
+    unsigned long long next_publish;
+    int stop;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        /* a raw frame was submitted or stop is set */
+    pthread_cond_t space;       /* a slot became free */
+};
+
+/******************************************************************************
+Description.: Cleanup handler, releases the mutex when the camera thread is
+              cancelled while waiting for a slot
+Input Value.: arg: the mutex
+Return Value: -
+******************************************************************************/
+static void unlock_mutex(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+/******************************************************************************
+Description.: Publish the compressed frames that are next in order, called
+              while holding the mutex of the encoder
+Input Value.: enc: the encoder
+Return Value: -
+******************************************************************************/
+static void publish_done(encoder *enc)
+{
+    input *in = enc->in;
+    slot *s;
+    int i;
+
+    for(;;) {
+        s = NULL;
+        for(i = 0; i < enc->nslots; i++) {
+            if(enc->slots[i].state == SLOT_DONE && enc->slots[i].seq == enc->next_publish) {
+                s = &enc->slots[i];
+                break;
+            }
+        }
+        if(s == NULL)
+            return;
+
+        /* a frame that could not be compressed is skipped */
+        if(s->jpeg_size <= 0) {
+            s->state = SLOT_FREE;
+            enc->next_publish++;
+            pthread_cond_signal(&enc->space);
+            continue;
+        }
+
+        pthread_mutex_lock(&in->db);
+        in->buf = s->jpeg;
+        in->size = s->jpeg_size;
+        in->insert_size = 0;
+        in->timestamp = s->timestamp;
+        in->metadata = s->metadata;
+        pthread_cond_broadcast(&in->db_update);
+        pthread_mutex_unlock(&in->db);
+
+        /* the consumers copied the previous frame while holding the lock */
+        if(enc->published != NULL)
+            enc->published->state = SLOT_FREE;
+        s->state = SLOT_PUBLISHED;
+        enc->published = s;
+        enc->next_publish++;
+        pthread_cond_signal(&enc->space);
+    }
+}
+
+/******************************************************************************
+Description.: Compress the oldest raw frame until the encoder is stopped, each
+              thread keeps its own compressor
+Input Value.: arg: the encoder
+Return Value: NULL
+******************************************************************************/
+static void *encoder_thread(void *arg)
+{
+    encoder *enc = arg;
+    jpeg_context *ctx = jpeg_context_new();
+    slot *s;
+    int i, size;
+
+    if(ctx == NULL)
+        fprintf(stderr, "not enough memory for the JPEG compressor\n");
+
+    pthread_mutex_lock(&enc->mutex);
+    while(!enc->stop) {
+        s = NULL;
+        for(i = 0; i < enc->nslots; i++) {
+            if(enc->slots[i].state == SLOT_RAW && (s == NULL || enc->slots[i].seq < s->seq))
+                s = &enc->slots[i];
+        }
+        if(s == NULL) {
+            pthread_cond_wait(&enc->work, &enc->mutex);
+            continue;
+        }
+
+        s->state = SLOT_ENCODING;
+        pthread_mutex_unlock(&enc->mutex);
+
+        /* the slot is not published, so the compressor may enlarge its buffer */
+        size = -1;
+        if(ctx != NULL)
+            size = compress_image_to_jpeg(ctx, s->raw, s->width, s->height, s->format,
+                                          &s->jpeg, &s->jpeg_capacity, enc->quality);
+
+        pthread_mutex_lock(&enc->mutex);
+        s->jpeg_size = size;
+        s->state = SLOT_DONE;
+        publish_done(enc);
+    }
+    pthread_mutex_unlock(&enc->mutex);
+
+    jpeg_context_free(ctx);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Start the encoder threads
+Input Value.: * in.....: the input the compressed frames are published on
+              * threads: number of encoder threads, at most ENCODER_MAX_THREADS
+              * quality: JPEG quality
+Return Value: the encoder or NULL on errors
+******************************************************************************/
+encoder *encoder_new(input *in, int threads, int quality)
+{
+    encoder *enc;
+
+    if(threads < 1 || threads > ENCODER_MAX_THREADS)
+        return NULL;
+
+    enc = calloc(1, sizeof(encoder));
+    if(enc == NULL)
+        return NULL;
+
+    enc->in = in;
+    enc->quality = quality;
+    enc->nslots = threads + 2;
+    pthread_mutex_init(&enc->mutex, NULL);
+    pthread_cond_init(&enc->work, NULL);
+    pthread_cond_init(&enc->space, NULL);
+
+    for(enc->threads = 0; enc->threads < threads; enc->threads++) {
+        if(pthread_create(&enc->thread[enc->threads], NULL, encoder_thread, enc) != 0) {
+            encoder_free(enc);
+            return NULL;
+        }
+    }
+
+    return enc;
+}
+
+/******************************************************************************
+Description.: Tell if a frame can be submitted without waiting. Slots are
+              only taken by the thread that submits the frames, so a free
+              slot stays free until it submits.
+Input Value.: enc: the encoder
+Return Value: 1 if a slot is free, 0 otherwise
+******************************************************************************/
+int encoder_ready(encoder *enc)
+{
+    int i, ready = 0;
+
+    pthread_mutex_lock(&enc->mutex);
+    for(i = 0; i < enc->nslots && !ready; i++)
+        ready = (enc->slots[i].state == SLOT_FREE);
+    pthread_mutex_unlock(&enc->mutex);
+
+    return ready;
+}
+
+/******************************************************************************
+Description.: Hand a raw frame to the encoder threads, waits while all slots
+              are in use. The frame is copied, so the caller can give the
+              buffer back to the driver right away.
+Input Value.: * enc......: the encoder
+              * frame....: the raw frame and its size in bytes
+              * width, height, format: geometry and V4L2 pixel format
+              * timestamp: capture time of the frame
+              * metadata.: JSON published with the frame
+Return Value: 0 if OK, -1 if there is not enough memory
+******************************************************************************/
+int encoder_submit(encoder *enc, const unsigned char *frame, int size, int width, int height, int format, const struct timeval *timestamp, const char *metadata)
+{
+    slot *s = NULL;
+    int i;
+
+    pthread_mutex_lock(&enc->mutex);
+    pthread_cleanup_push(unlock_mutex, &enc->mutex);
+    while(s == NULL) {
+        for(i = 0; i < enc->nslots; i++) {
+            if(enc->slots[i].state == SLOT_FREE) {
+                s = &enc->slots[i];
+                break;
+            }
+        }
+        if(s == NULL)
+            pthread_cond_wait(&enc->space, &enc->mutex);
+    }
+    s->state = SLOT_FILLING;
+    pthread_cleanup_pop(1);
+
+    /* a free slot is read by nobody, its buffers can grow */
+    if(s->raw_capacity < size) {
+        free(s->raw);
+        s->raw_capacity = 0;
+        if((s->raw = malloc(size)) == NULL)
+            goto nomem;
+        s->raw_capacity = size;
+    }
+    /* the compressor enlarges it if a frame does not fit */
+    if(s->jpeg == NULL) {
+        if((s->jpeg = malloc(width * height)) == NULL)
+            goto nomem;
+        s->jpeg_capacity = width * height;
+    }
+
+    memcpy(s->raw, frame, size);
+    s->raw_size = size;
+    s->width = width;
+    s->height = height;
+    s->format = format;
+    s->timestamp = *timestamp;
+    snprintf(s->metadata, sizeof(s->metadata), "%s", metadata);
+
+    pthread_mutex_lock(&enc->mutex);
+    s->seq = enc->next_seq++;
+    s->state = SLOT_RAW;
+    pthread_cond_signal(&enc->work);
+    pthread_mutex_unlock(&enc->mutex);
+    return 0;
+
+nomem:
+    pthread_mutex_lock(&enc->mutex);
+    s->state = SLOT_FREE;
+    pthread_mutex_unlock(&enc->mutex);
+    return -1;
+}
+
+/******************************************************************************
+Description.: Stop the encoder threads and free the encoder, the input
+              does not point to the published frame anymore afterwards
+Input Value.: enc: the encoder
+Return Value: -
+******************************************************************************/
+void encoder_free(encoder *enc)
+{
+    input *in = enc->in;
+    int i;
+
+    pthread_mutex_lock(&enc->mutex);
+    enc->stop = 1;
+    pthread_cond_broadcast(&enc->work);
+    pthread_mutex_unlock(&enc->mutex);
+
+    for(i = 0; i < enc->threads; i++)
+        pthread_join(enc->thread[i], NULL);
+
+    pthread_mutex_lock(&in->db);
+    if(enc->published != NULL && in->buf == enc->published->jpeg) {
+        in->buf = NULL;
+        in->size = 0;
+        in->metadata = NULL;
+    }
+    pthread_mutex_unlock(&in->db);
+
+    for(i = 0; i < enc->nslots; i++) {
+        free(enc->slots[i].raw);
+        free(enc->slots[i].jpeg);
+    }
+    pthread_cond_destroy(&enc->space);
+    pthread_cond_destroy(&enc->work);
+    pthread_mutex_destroy(&enc->mutex);
+    free(enc);
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <sys/time.h>
+
+#include "../../mjpg_streamer.h"
+
+#define ENCODER_MAX_THREADS 16
+
+/*
+ * Compresses raw frames on a pool of threads. The camera thread submits the
+ * frames, each encoder thread compresses one of them at a time and the
+ * frames are published in the order they were submitted. The lock of the
+ * input is only taken to swap in the next compressed frame.
+ */
+typedef struct _encoder encoder;
+
+encoder *encoder_new(input *in, int threads, int quality);
+int encoder_ready(encoder *enc);
+int encoder_submit(encoder *enc, const unsigned char *frame, int size, int width, int height, int format, const struct timeval *timestamp, const char *metadata);
+void encoder_free(encoder *enc);
+
+#endif
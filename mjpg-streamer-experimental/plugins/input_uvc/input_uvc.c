@@ -36,6 +36,7 @@
 #include <sys/stat.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <poll.h>
 #include <syslog.h>
 
 #include <linux/types.h>          /* for videodev2.h */
@@ -47,9 +48,11 @@
 #ifndef NO_LIBJPEG
     #include "jpeg_utils.h"
     #include "huffman.h"
+    #include "encoder.h"
 #endif
 
 #include "dynctrl.h"
+#include "capture.h"
 
 //#include "uvcvideo.h"
 
@@ -67,9 +70,6 @@ static const struct {
 
 /* private functions and variables to this plugin */
 static globals *pglobal;
-static unsigned int minimum_size = 0;
-static int dynctrls = 1;
-static unsigned int every = 1;
 
 static const struct {
   const char * k;
@@ -91,6 +91,7 @@ static const struct {
 };
 
 void *cam_thread(void *);
+static void cam_setup(input *in);
 void cam_cleanup(void *);
 void help(void);
 int input_cmd(int plugin, unsigned int control, unsigned int group, int value, char *value_string);
@@ -118,6 +119,17 @@ static context_settings * init_settings() {
     return settings;
 }
 
+/******************************************************************************
+Description.: Tell if the frames of a format are published as they come from
+              the camera or compressed to JPEG by the encoder threads
+Input Value.: format: the V4L2 pixel format
+Return Value: 1 for MJPEG and H.264, 0 otherwise
+******************************************************************************/
+static inline int compressed_format(int format)
+{
+    return format == V4L2_PIX_FMT_MJPEG || format == V4L2_PIX_FMT_H264;
+}
+
 
 /*** plugin interface functions ***/
 /******************************************************************************
@@ -133,6 +145,11 @@ int input_init(input_parameter *param, int id)
 {
     char *dev = "/dev/video0", *s;
     int width = 640, height = 480, fps = -1, format = V4L2_PIX_FMT_MJPEG, i;
+    /* the plugin is loaded once for all cameras, their options live here */
+    int dynctrls = 1, zerocopy = 0, latest = 0, buffers = NB_BUFFER;
+    #ifndef NO_LIBJPEG
+    int encoder_threads = 0;
+    #endif
     v4l2_std_id tvnorm = V4L2_STD_UNKNOWN;
     context *pctx;
     context_settings *settings;
@@ -144,11 +161,13 @@ int input_init(input_parameter *param, int id)
     }
     
     settings = pctx->init_settings = init_settings();
+    pctx->every = 1;
     pglobal = param->global;
     pglobal->in[id].context = pctx;
 
     /* initialize the mutes variable */
-    if(pthread_mutex_init(&pctx->controls_mutex, NULL) != 0) {
+    if(pthread_mutex_init(&pctx->controls_mutex, NULL) != 0 ||
+       pthread_mutex_init(&pctx->grab_mutex, NULL) != 0) {
         IPRINT("could not initialize mutex variable\n");
         exit(EXIT_FAILURE);
     }
@@ -205,6 +224,16 @@ int input_init(input_parameter *param, int id)
             {"gain", required_argument, 0, 0},
             {"cagc", required_argument, 0, 0},
             {"cb", required_argument, 0, 0},
+            {"zc", no_argument, 0, 0},
+            {"zero_copy", no_argument, 0, 0},
+            {"lf", no_argument, 0, 0},
+            {"latest_frame", no_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"buffers", required_argument, 0, 0},
+            {"et", required_argument, 0, 0},
+            {"encoder_threads", required_argument, 0, 0},
+            {"sc", no_argument, 0, 0},
+            {"shared_capture", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -278,7 +307,7 @@ int input_init(input_parameter *param, int id)
         case 14:
         case 15:
             DBG("case 14,15\n");
-            minimum_size = MAX(atoi(optarg), 0);
+            pctx->minimum_size = MAX(atoi(optarg), 0);
             break;
 
         /* n, no_dynctrl */
@@ -303,16 +332,22 @@ int input_init(input_parameter *param, int id)
         }*/
             break;
         /* fourcc */
-        #ifndef NO_LIBJPEG
         case 20:
             DBG("case 20\n");
-            if (strcmp(optarg, "RGBP") == 0) {
+            if (strcmp(optarg, "H264") == 0) {
+                format = V4L2_PIX_FMT_H264;
+        #ifndef NO_LIBJPEG
+            } else if (strcmp(optarg, "RGBP") == 0) {
                 format = V4L2_PIX_FMT_RGB565;
+            } else if (strcmp(optarg, "NV12") == 0) {
+                format = V4L2_PIX_FMT_NV12;
+            } else if (strcmp(optarg, "YU12") == 0 || strcmp(optarg, "I420") == 0) {
+                format = V4L2_PIX_FMT_YUV420;
+        #endif
             } else {
               fprintf(stderr," i: FOURCC codec '%s' not supported\n", optarg);
             }
             break;
-        #endif
         /* t, tvnorm */
         case 21:
         case 22:
@@ -329,7 +364,7 @@ int input_init(input_parameter *param, int id)
         /* e, every */
         case 24:
             DBG("case 24\n");
-            every = MAX(atoi(optarg), 1);
+            pctx->every = MAX(atoi(optarg), 1);
             break;
 
         /* options */
@@ -361,6 +396,51 @@ int input_init(input_parameter *param, int id)
             break;
         OPTION_INT_AUTO(38, cb)
             break;
+
+        /* zc, zero_copy */
+        case 39:
+        case 40:
+            DBG("case 39,40\n");
+            zerocopy = 1;
+            break;
+
+        /* lf, latest_frame */
+        case 41:
+        case 42:
+            DBG("case 41,42\n");
+            latest = 1;
+            break;
+
+        /* b, buffers */
+        case 43:
+        case 44:
+            DBG("case 43,44\n");
+            buffers = atoi(optarg);
+            if(buffers < 2 || buffers > NB_BUFFER_MAX - 1) {
+                fprintf(stderr, "buffers must be between 2 and %d\n", NB_BUFFER_MAX - 1);
+                return 1;
+            }
+            break;
+
+        /* et, encoder_threads */
+        #ifndef NO_LIBJPEG
+        case 45:
+        case 46:
+            DBG("case 45,46\n");
+            encoder_threads = atoi(optarg);
+            if(encoder_threads < 1 || encoder_threads > ENCODER_MAX_THREADS) {
+                fprintf(stderr, "encoder_threads must be between 1 and %d\n", ENCODER_MAX_THREADS);
+                return 1;
+            }
+            break;
+        #endif
+
+        /* sc, shared_capture */
+        case 47:
+        case 48:
+            DBG("case 47,48\n");
+            pctx->shared_capture = 1;
+            break;
     
         default:
             DBG("default case\n");
@@ -388,6 +468,9 @@ int input_init(input_parameter *param, int id)
         case V4L2_PIX_FMT_MJPEG:
             fmtString = "JPEG";
             break;
+        case V4L2_PIX_FMT_H264:
+            fmtString = "H264";
+            break;
         #ifndef NO_LIBJPG
             case V4L2_PIX_FMT_YUYV:
                 fmtString = "YUYV";
@@ -398,6 +481,12 @@ int input_init(input_parameter *param, int id)
             case V4L2_PIX_FMT_RGB565:
                 fmtString = "RGB565";
                 break;
+            case V4L2_PIX_FMT_NV12:
+                fmtString = "NV12";
+                break;
+            case V4L2_PIX_FMT_YUV420:
+                fmtString = "I420";
+                break;
         #endif
         default:
             fmtString = "Unknown format";
@@ -405,10 +494,33 @@ int input_init(input_parameter *param, int id)
 
     IPRINT("Format............: %s\n", fmtString);
     #ifndef NO_LIBJPEG
-        if(format != V4L2_PIX_FMT_MJPEG)
+        /* one encoder per core by default, also needed after switching the format */
+        if(encoder_threads == 0) {
+            encoder_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            if(encoder_threads < 1)
+                encoder_threads = 1;
+            else if(encoder_threads > ENCODER_MAX_THREADS)
+                encoder_threads = ENCODER_MAX_THREADS;
+        }
+        pctx->encoder_threads = encoder_threads;
+        if(!compressed_format(format)) {
             IPRINT("JPEG Quality......: %d\n", settings->quality);
+            IPRINT("Encoder threads...: %d\n", encoder_threads);
+        }
     #endif
 
+    /* only MJPEG and H.264 frames are published as they come from the camera */
+    pctx->videoIn->zerocopy = zerocopy;
+    if(zerocopy)
+        IPRINT("Zero copy.........: enabled\n");
+    pctx->videoIn->buffers = buffers;
+    pctx->videoIn->latest = latest;
+    IPRINT("V4L2 buffers......: %d\n", buffers);
+    if(latest)
+        IPRINT("Latest frame......: enabled\n");
+    if(pctx->shared_capture)
+        IPRINT("Shared capture....: enabled\n");
+
     if (tvnorm != V4L2_STD_UNKNOWN) {
         IPRINT("TV-Norm...........: %s\n", get_name_by_tvnorm(tvnorm));
     } else {
@@ -431,6 +543,10 @@ int input_init(input_parameter *param, int id)
         initDynCtrls(pctx->videoIn->fd);
     
     enumerateControls(pctx->videoIn, pctx->pglobal, id); // enumerate V4L2 controls after UVC extended mapping
+
+    /* the values of the controls are read from the cache the events keep up to date */
+    if(v4l2SubscribeControls(pctx->videoIn, id, pctx->pglobal) > 0)
+        IPRINT("Control events....: %d controls\n", pctx->videoIn->ctrl_events);
     
     return 0;
 }
@@ -445,6 +561,13 @@ int input_stop(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
+    if(pctx->shared_capture) {
+        DBG("will remove camera #%02d from the capture thread\n", id);
+        capture_remove(pctx);
+        cam_cleanup(in);
+        return 0;
+    }
+
     DBG("will cancel camera thread #%02d\n", id);
     pthread_cancel(pctx->threadID);
     return 0;
@@ -460,12 +583,24 @@ int input_run(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = malloc(pctx->videoIn->framesizeIn);
+    pctx->buffer = malloc(pctx->videoIn->framesizeIn);
+    pctx->buffer_size = pctx->videoIn->framesizeIn;
+    in->buf = pctx->buffer;
     if(in->buf == NULL) {
         fprintf(stderr, "could not allocate memory\n");
         exit(EXIT_FAILURE);
     }
 
+    if(pctx->shared_capture) {
+        DBG("adding camera #%02d to the capture thread\n", id);
+        cam_setup(in);
+        if(capture_add(pctx) < 0) {
+            IPRINT("Error starting the capture thread\n");
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(pctx->threadID), NULL, cam_thread, in);
@@ -509,7 +644,18 @@ void help(void)
     " [-u | --uyvy ] ........: Use UYVY format, default: MJPEG (uses more cpu power)\n" \
     " [-y | --yuv  ] ........: Use YUV format, default: MJPEG (uses more cpu power)\n" \
     " [-fourcc ] ............: Use FOURCC codec 'argopt', \n" \
-    "                          currently supported codecs are: RGBP \n" \
+    "                          currently supported codecs are: RGBP NV12\n" \
+    "                          YU12 (or I420) and H264, which is published\n" \
+    "                          as it comes from the camera\n" \
+    " [-zc | --zero_copy ]...: publish MJPEG and H264 frames from the buffers of the\n" \
+    "                          driver instead of copying them\n" \
+    " [-lf | --latest_frame ]: take the newest frame the driver has ready and\n" \
+    "                          give older ones back unread, lowers the latency\n" \
+    " [-b | --buffers ]......: number of V4L2 buffers (default 4)\n" \
+    " [-et | --encoder_threads ]: threads compressing YUV and RGB frames\n" \
+    "                          (default one per core)\n" \
+    " [-sc | --shared_capture ]: grab the frames on one thread shared by\n" \
+    "                          all cameras with this option\n" \
     " ---------------------------------------------------------------\n");
 
     fprintf(stderr, "\n"                                                \
@@ -533,27 +679,321 @@ void help(void)
 }
 
 /******************************************************************************
-Description.: this thread worker grabs a frame and copies it to the global buffer
-Input Value.: unused
-Return Value: unused, always NULL
+Description.: Decide if a dequeued frame is dropped, before it was copied
+Input Value.: pcontext: the context of the camera
+Return Value: 1 if the frame is dropped, 0 if it is published
 ******************************************************************************/
-void *cam_thread(void *arg)
+static int drop_frame(context *pcontext)
+{
+    struct vdIn *vd = pcontext->videoIn;
+
+    /* every H.264 frame is needed to decode the following ones */
+    if(vd->formatIn == V4L2_PIX_FMT_H264)
+        return 0;
+
+    if ( pcontext->every_count < pcontext->every - 1 ) {
+        DBG("dropping %d frame for every=%d\n", pcontext->every_count + 1, pcontext->every);
+        ++pcontext->every_count;
+        return 1;
+    } else {
+        pcontext->every_count = 0;
+    }
+
+    /*
+     * Workaround for broken, corrupted frames:
+     * Under low light conditions corrupted frames may get captured.
+     * The good thing is such frames are quite small compared to the regular pictures.
+     * For example a VGA (640x480) webcam picture is normally >= 8kByte large,
+     * corrupted frames are smaller.
+     */
+    if(vd->formatIn == V4L2_PIX_FMT_MJPEG && vd->buf.bytesused < pcontext->minimum_size) {
+        DBG("dropping too small frame, assuming it as broken\n");
+        return 1;
+    }
+
+    // use software frame dropping on low fps
+    if (vd->soft_framedrop == 1) {
+        unsigned long last = pglobal->in[pcontext->id].timestamp.tv_sec * 1000 +
+                            (pglobal->in[pcontext->id].timestamp.tv_usec/1000); // convert to ms
+        unsigned long current = vd->buf.timestamp.tv_sec * 1000 +
+                                vd->buf.timestamp.tv_usec/1000; // convert to ms
+
+        // if the requested time did not esplashed skip the frame
+        if ((current - last) < vd->frame_period_time) {
+            //DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+            return 1;
+        }
+        DBG("Lagg: %ld\n", (current - last) - vd->frame_period_time);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Describe the capture counters in the metadata of the frame
+Input Value.: * vd......: the device, vd->buf holds the frame
+              * metadata: receives the JSON object, METADATA_SIZE bytes
+Return Value: -
+******************************************************************************/
+static void format_metadata(struct vdIn *vd, char *metadata)
+{
+    int h264 = (vd->formatIn == V4L2_PIX_FMT_H264), keyframe = 1;
+
+    if(h264)
+        keyframe = (vd->buf.flags & V4L2_BUF_FLAG_KEYFRAME) ||
+                   h264_keyframe(vd->mem[vd->buf.index], vd->buf.bytesused);
+
+    snprintf(metadata, METADATA_SIZE,
+             "{\"sequence\": %u, \"drained\": %lu, \"dropped\": %lu, \"interval\": %ld, \"jitter\": %ld, "
+             "\"width\": %d, \"height\": %d, \"switches\": %lu, \"switch_time\": %ld, "
+             "\"codec\": \"%s\", \"keyframe\": %s}",
+             vd->buf.sequence, vd->drained, vd->dropped, vd->interval, vd->jitter,
+             vd->width, vd->height, vd->switches, vd->switch_time,
+             h264 ? "h264" : "jpeg", keyframe ? "true" : "false");
+}
+
+/******************************************************************************
+Description.: Make sure the buffer frames are copied to can hold size bytes,
+              call with in->db locked. The buffer only grows, so switching
+              between resolutions reuses it.
+Input Value.: * in..: the input of the camera
+              * size: bytes needed
+Return Value: 0 if OK, -1 if there is not enough memory
+******************************************************************************/
+static int reserve_buffer(input *in, int size)
+{
+    context *pcontext = (context*)in->context;
+    unsigned char *buffer;
+
+    if(size <= pcontext->buffer_size)
+        return 0;
+    if((buffer = realloc(pcontext->buffer, size)) == NULL)
+        return -1;
+
+    if(in->buf == pcontext->buffer)
+        in->buf = buffer;
+    pcontext->buffer = buffer;
+    pcontext->buffer_size = size;
+    return 0;
+}
+
+#ifndef NO_LIBJPEG
+/******************************************************************************
+Description.: Tell how many bytes the encoder reads from a raw frame
+Input Value.: * format.......: the V4L2 pixel format, not a compressed one
+              * width, height: the geometry of the frame
+Return Value: the size of the frame in bytes
+******************************************************************************/
+static int raw_frame_size(int format, int width, int height)
+{
+    switch(format) {
+    case V4L2_PIX_FMT_NV12:
+        return width * height + width * ((height + 1) / 2);
+    case V4L2_PIX_FMT_YUV420:
+        return width * height + (width / 2) * (height / 2) + (width / 2) * ((height + 1) / 2);
+    default:
+        return width * height * 2;
+    }
+}
+#endif
+
+/******************************************************************************
+Description.: Publish a dequeued frame to the output plugins and give the
+              buffers that are not needed anymore back to the driver.
+              With zero copy a MJPEG or H.264 frame is published from the
+              buffer it was captured to. The consumers copy the frame while they hold
+              the lock of the input, so that buffer is queued again once the
+              next frame replaced it. Missing Huffman tables are inserted by
+              the consumers while they copy.
+              Other formats are handed to the encoder threads.
+Input Value.: pcontext: the context of the camera
+Return Value: 0 if OK, -1 if a buffer could not be queued again
+******************************************************************************/
+static int publish_frame(context *pcontext)
+{
+    struct vdIn *vd = pcontext->videoIn;
+    input *in = &pglobal->in[pcontext->id];
+    unsigned char *frame = vd->mem[vd->buf.index];
+    int index = vd->buf.index, previous = vd->published, copy = 1;
+    const unsigned char *dht = NULL;
+    int dht_size = 0, dht_at;
+
+    /*
+     * If capturing in YUV mode the frame is converted to JPEG by the encoder
+     * threads, they publish it when the frames before it are published.
+     * This compression requires many CPU cycles, so try to avoid YUV format.
+     * Getting JPEGs straight from the webcam, is one of the major advantages of
+     * Linux-UVC compatible devices.
+     */
+    #ifndef NO_LIBJPEG
+    if(!compressed_format(vd->formatIn) && pcontext->encoder != NULL) {
+        char metadata[METADATA_SIZE];
+        int size = raw_frame_size(vd->formatIn, vd->width, vd->height);
+
+        /* the encoder would read past the end of a truncated frame */
+        if(vd->buf.bytesused < (unsigned int)size) {
+            DBG("dropping short frame of %u bytes, %d expected\n", vd->buf.bytesused, size);
+            return uvcRequeue(vd, index);
+        }
+
+        DBG("submitting frame from input: %d\n", (int)pcontext->id);
+        format_metadata(vd, metadata);
+        if(encoder_submit(pcontext->encoder, frame, size,
+                          vd->width, vd->height, vd->formatIn, &vd->buf.timestamp, metadata) < 0)
+            fprintf(stderr, "not enough memory to compress the frame\n");
+        return uvcRequeue(vd, index);
+    }
+    #endif
+
+    if(vd->formatIn == V4L2_PIX_FMT_MJPEG)
+        dht_at = huffman_insert(vd, frame, vd->buf.bytesused, &dht, &dht_size);
+    else
+        dht_at = -1;
+
+    pthread_mutex_lock(&in->db);
+
+    if(vd->zerocopy) {
+        DBG("publishing buffer %d of input: %d\n", index, (int)pcontext->id);
+        in->buf = frame;
+        vd->published = index;
+        copy = 0;
+    } else if(reserve_buffer(in, vd->buf.bytesused) == 0) {
+        DBG("copying frame from input: %d\n", (int)pcontext->id);
+        in->buf = pcontext->buffer;
+        memcpy(in->buf, frame, vd->buf.bytesused);
+        vd->published = -1;
+    } else {
+        pthread_mutex_unlock(&in->db);
+        fprintf(stderr, "not enough memory to copy the frame\n");
+        return uvcRequeue(vd, index);
+    }
+    in->size = vd->buf.bytesused;
+    /* frames without Huffman tables get them from the consumers */
+    in->insert = dht;
+    in->insert_size = (dht_at >= 0) ? dht_size : 0;
+    in->insert_at = dht_at;
+    /* copy this frame's timestamp to user space */
+    in->timestamp = vd->buf.timestamp;
+    format_metadata(vd, pcontext->metadata);
+    in->metadata = pcontext->metadata;
+
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+
+    if(previous >= 0 && uvcRequeue(vd, previous) < 0)
+        return -1;
+    if(copy && uvcRequeue(vd, index) < 0)
+        return -1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Read the control events of the camera, called when the device
+              signals POLLPRI
+Input Value.: pcontext: the context of the camera
+Return Value: -
+******************************************************************************/
+void cam_events(context *pcontext)
+{
+    pthread_mutex_lock(&pcontext->controls_mutex);
+    v4l2ControlEvents(pcontext->videoIn, pcontext->id, pglobal);
+    pthread_mutex_unlock(&pcontext->controls_mutex);
+}
+
+/******************************************************************************
+Description.: Take one frame from the driver and publish it, unless it is
+              dropped, call with the grab mutex held
+Input Value.: pcontext: the context of the camera
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+static int grab_frame(context *pcontext)
+{
+    int ret;
+
+    /* the format is being changed */
+    if(pcontext->videoIn->streamingState == STREAMING_PAUSED)
+        return 0;
+
+    /* take a frame from the driver, it is copied only if it is not dropped */
+    if((ret = uvcDequeue(pcontext->videoIn)) == 0) {
+        if(drop_frame(pcontext))
+            ret = uvcRequeue(pcontext->videoIn, pcontext->videoIn->buf.index);
+        else
+            ret = publish_frame(pcontext);
+    } else if(ret > 0) {
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/******************************************************************************
+Description.: Take one frame from the driver and publish it, unless it is
+              dropped. Waits while the format changes or the encoder is busy.
+Input Value.: pcontext: the context of the camera
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+int cam_grab(context *pcontext)
+{
+    int ret;
+
+    pthread_mutex_lock(&pcontext->grab_mutex);
+    ret = grab_frame(pcontext);
+    pthread_mutex_unlock(&pcontext->grab_mutex);
+    return ret;
+}
+
+/******************************************************************************
+Description.: Like cam_grab(), but leave the frame in the driver instead of
+              waiting for a change of the format or a free encoder slot, so
+              a thread serving several cameras goes on with the others
+Input Value.: pcontext: the context of the camera
+Return Value: 0 if OK, 1 if the camera is busy, -1 on errors
+******************************************************************************/
+int cam_trygrab(context *pcontext)
+{
+    int ret;
+
+    if(pthread_mutex_trylock(&pcontext->grab_mutex) != 0)
+        return 1;
+
+    #ifndef NO_LIBJPEG
+    if(!compressed_format(pcontext->videoIn->formatIn) && pcontext->encoder != NULL &&
+       !encoder_ready(pcontext->encoder)) {
+        pthread_mutex_unlock(&pcontext->grab_mutex);
+        return 1;
+    }
+    #endif
+
+    ret = grab_frame(pcontext);
+    pthread_mutex_unlock(&pcontext->grab_mutex);
+    return ret;
+}
+
+/******************************************************************************
+Description.: Apply the initial settings of the camera and start the encoder
+              threads, before the first frame is grabbed
+Input Value.: in: the input of the camera
+Return Value: -
+******************************************************************************/
+static void cam_setup(input *in)
 {
-    input * in = (input*)arg;
     context *pcontext = (context*)in->context;
     context_settings *settings = pcontext->init_settings;
     
-    unsigned int every_count = 0;
-    int quality = settings->quality;
-    
-    /* set cleanup handler to cleanup allocated resources */
-    pthread_cleanup_push(cam_cleanup, in);
-    
+    struct v4l2_ext_control ctrls[32];
+    const char *names[32];
+    int results[32], count = 0, i;
+
+    /* the settings are collected and sent to the camera in one request */
     #define V4L_OPT_SET(vid, var, desc) \
-      if (input_cmd(pcontext->id, vid, IN_CMD_V4L2, settings->var, NULL) != 0) {\
-          fprintf(stderr, "Failed to set " desc "\n"); \
-      } else { \
-          printf(" i: %-18s: %d\n", desc, settings->var); \
+      if (count < sizeof(ctrls) / sizeof(ctrls[0])) { \
+          memset(&ctrls[count], 0, sizeof(ctrls[count])); \
+          ctrls[count].id = vid; \
+          ctrls[count].value = settings->var; \
+          names[count++] = desc; \
       }
     
     #define V4L_INT_OPT(vid, var, desc) \
@@ -618,97 +1058,70 @@ void *cam_thread(void *arg)
         }
     }
     
-    free(settings);
-    settings = NULL;
-    pcontext->init_settings = NULL;
-
-    while(!pglobal->stop) {
-        while(pcontext->videoIn->streamingState == STREAMING_PAUSED) {
-            usleep(1); // maybe not the best way so FIXME
+    if (count > 0) {
+        pthread_mutex_lock(&pcontext->controls_mutex);
+        v4l2SetControls(pcontext->videoIn, ctrls, results, count, pcontext->id, pglobal);
+        pthread_mutex_unlock(&pcontext->controls_mutex);
+        for (i = 0; i < count; i++) {
+            if (results[i] != 0)
+                fprintf(stderr, "Failed to set %s\n", names[i]);
+            else
+                printf(" i: %-18s: %d\n", names[i], ctrls[i].value);
         }
-
-        /* grab a frame */
-        if(uvcGrab(pcontext->videoIn) < 0) {
-            IPRINT("Error grabbing frames\n");
+    }
+    
+    pcontext->quality = settings->quality;
+    #ifndef NO_LIBJPEG
+    if(!compressed_format(pcontext->videoIn->formatIn)) {
+        pcontext->encoder = encoder_new(in, pcontext->encoder_threads, settings->quality);
+        if(pcontext->encoder == NULL) {
+            IPRINT("could not start the encoder threads\n");
             exit(EXIT_FAILURE);
         }
+    }
+    #endif
 
-        if ( every_count < every - 1 ) {
-            DBG("dropping %d frame for every=%d\n", every_count + 1, every);
-            ++every_count;
-            continue;
-        } else {
-            every_count = 0;
-        }
+    free(settings);
+    settings = NULL;
+    pcontext->init_settings = NULL;
+}
 
-        //DBG("received frame of size: %d from plugin: %d\n", pcontext->videoIn->tmpbytesused, pcontext->id);
+/******************************************************************************
+Description.: this thread worker grabs a frame and copies it to the global buffer
+Input Value.: unused
+Return Value: unused, always NULL
+******************************************************************************/
+void *cam_thread(void *arg)
+{
+    input * in = (input*)arg;
+    context *pcontext = (context*)in->context;
+    
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(cam_cleanup, in);
+    
+    cam_setup(in);
 
+    while(!pglobal->stop) {
         /*
-         * Workaround for broken, corrupted frames:
-         * Under low light conditions corrupted frames may get captured.
-         * The good thing is such frames are quite small compared to the regular pictures.
-         * For example a VGA (640x480) webcam picture is normally >= 8kByte large,
-         * corrupted frames are smaller.
+         * wait for the frame without holding the grab mutex, so a change of
+         * the format does not wait for the camera. While the format changes
+         * the device is paused and cam_grab() waits for the grab mutex.
          */
-        if(pcontext->videoIn->tmpbytesused < minimum_size) {
-            DBG("dropping too small frame, assuming it as broken\n");
-            continue;
-        }
-
-        // use software frame dropping on low fps
-        if (pcontext->videoIn->soft_framedrop == 1) {
-            unsigned long last = pglobal->in[pcontext->id].timestamp.tv_sec * 1000 +
-                                (pglobal->in[pcontext->id].timestamp.tv_usec/1000); // convert to ms
-            unsigned long current = pcontext->videoIn->buf.timestamp.tv_sec * 1000 +
-                                    pcontext->videoIn->buf.timestamp.tv_usec/1000; // convert to ms
-
-            // if the requested time did not esplashed skip the frame
-            if ((current - last) < pcontext->videoIn->frame_period_time) {
-                //DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+        if(pcontext->videoIn->streamingState == STREAMING_ON) {
+            struct pollfd pfd = { .fd = pcontext->videoIn->fd, .events = POLLIN | POLLPRI };
+            if(poll(&pfd, 1, 1000) == 0)
                 continue;
+            if(pfd.revents & POLLPRI) {
+                cam_events(pcontext);
+                if(!(pfd.revents & POLLIN))
+                    continue;
             }
-            DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
         }
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[pcontext->id].db);
-
-        /*
-         * If capturing in YUV mode convert to JPEG now.
-         * This compression requires many CPU cycles, so try to avoid YUV format.
-         * Getting JPEGs straight from the webcam, is one of the major advantages of
-         * Linux-UVC compatible devices.
-         */
-        #ifndef NO_LIBJPEG
-        if ((pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUYV) ||
-	    (pcontext->videoIn->formatIn == V4L2_PIX_FMT_UYVY) ||
-	    (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
-            DBG("compressing frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
-            /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->buf.timestamp;
-        } else {
-        #endif
-            DBG("copying frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
-            /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-        #ifndef NO_LIBJPEG
-        }
-        #endif
-
-#if 0
-        /* motion detection can be done just by comparing the picture size, but it is not very accurate!! */
-        if((prev_size - global->size)*(prev_size - global->size) > 4 * 1024 * 1024) {
-            DBG("motion detected (delta: %d kB)\n", (prev_size - global->size) / 1024);
+        if(cam_grab(pcontext) < 0) {
+            IPRINT("Error grabbing frames\n");
+            exit(EXIT_FAILURE);
         }
-        prev_size = global->size;
-#endif
-
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
-        pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
     }
 
     DBG("leaving input thread, calling cleanup function now\n");
@@ -729,16 +1142,122 @@ void cam_cleanup(void *arg)
     
     IPRINT("cleaning up resources allocated by input thread\n");
 
+    #ifndef NO_LIBJPEG
+    if (pctx->encoder != NULL) {
+        encoder_free(pctx->encoder);
+        pctx->encoder = NULL;
+    }
+    #endif
+
     if (pctx->videoIn != NULL) {
+        IPRINT("frames drained....: %lu\n", pctx->videoIn->drained);
+        IPRINT("frames dropped....: %lu\n", pctx->videoIn->dropped);
+        if(pctx->videoIn->intervals > 0)
+            IPRINT("frame interval....: mean %ld us, jitter %ld us, min %ld us, max %ld us\n",
+                   pctx->videoIn->interval, pctx->videoIn->jitter,
+                   pctx->videoIn->interval_min, pctx->videoIn->interval_max);
         close_v4l2(pctx->videoIn);
-        free(pctx->videoIn->tmpbuffer);
         free(pctx->videoIn);
         pctx->videoIn = NULL;
     }
     
-    free(in->buf);
+    free(pctx->buffer);
+    pctx->buffer = NULL;
     in->buf = NULL;
     in->size = 0;
+    in->insert_size = 0;
+    in->metadata = NULL;
+}
+
+/******************************************************************************
+Description.: Change the resolution and format of the camera while it streams.
+              The grabbing thread is held off by the grab mutex, the output
+              plugins keep their clients and get the frames of the new format
+              once the camera delivers them. The metadata of these frames
+              counts the switch and tells how long it took.
+Input Value.: * in....: the input of the camera
+              * width.: the new width
+              * height: the new height
+              * format: the new pixel format
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+static int reconfigure(input *in, int width, int height, int format)
+{
+    context *pctx = (context*)in->context;
+    struct vdIn *vd = pctx->videoIn;
+    struct timeval start, end;
+    int ret, switched, i, j;
+
+    gettimeofday(&start, NULL);
+    pthread_mutex_lock(&pctx->grab_mutex);
+
+    #ifndef NO_LIBJPEG
+    /* compressing frames of other formats needs the encoder threads */
+    if(!compressed_format(format) && pctx->encoder == NULL &&
+       (pctx->encoder = encoder_new(in, pctx->encoder_threads, pctx->quality)) == NULL) {
+        pthread_mutex_unlock(&pctx->grab_mutex);
+        return -1;
+    }
+    #endif
+
+    /* the buffers get unmapped, consumers keep a copy of a published frame */
+    pthread_mutex_lock(&in->db);
+    if(vd->published >= 0) {
+        if(reserve_buffer(in, in->size) == 0) {
+            memcpy(pctx->buffer, in->buf, in->size);
+            in->buf = pctx->buffer;
+        } else {
+            in->buf = NULL;
+            in->size = 0;
+            in->insert_size = 0;
+        }
+        vd->published = -1;
+    }
+    pthread_mutex_unlock(&in->db);
+
+    /* the camera threads can not go on without a format */
+    if((ret = setFormat(vd, width, height, format)) == -2) {
+        IPRINT("Error restoring the format of %s\n", vd->videodevice);
+        exit(EXIT_FAILURE);
+    }
+    switched = (ret == 0);
+
+    /* frames of a larger size need more room */
+    pthread_mutex_lock(&in->db);
+    if(reserve_buffer(in, vd->framesizeIn) < 0) {
+        fprintf(stderr, "not enough memory for frames of %dx%d\n", vd->width, vd->height);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&in->db);
+
+    /* the driver may have chosen another size or format */
+    for(i = 0; i < in->formatCount; i++) {
+        input_format *f = &in->in_formats[i];
+
+        f->currentResolution = -1;
+        if(f->format.pixelformat != vd->formatIn)
+            continue;
+        in->currentFormat = i;
+        for(j = 0; j < f->resolutionCount; j++)
+            if(f->supportedResolutions[j].width == vd->width &&
+               f->supportedResolutions[j].height == vd->height)
+                f->currentResolution = j;
+    }
+
+    /* the metadata only counts switches that happened */
+    if(switched) {
+        gettimeofday(&end, NULL);
+        vd->switches++;
+        vd->switch_time = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+    }
+    pthread_mutex_unlock(&pctx->grab_mutex);
+
+    if(switched) {
+        IPRINT("switched to.......: %dx%d in %ld ms\n", vd->width, vd->height, vd->switch_time / 1000);
+    } else {
+        IPRINT("refused format....: %dx%d, staying at %dx%d\n", width, height, vd->width, vd->height);
+    }
+    return ret;
 }
 
 /******************************************************************************
@@ -772,27 +1291,66 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
             return -1;
         } break;
     case IN_CMD_V4L2: {
+            pthread_mutex_lock(&pctx->controls_mutex);
+            /* changes not read yet would make the cached value wrong */
+            if(pctx->videoIn->ctrl_events)
+                v4l2ControlEvents(pctx->videoIn, plugin_number, pglobal);
             ret = v4l2SetControl(pctx->videoIn, control_id, value, plugin_number, pglobal);
-            if(ret == 0) {
-                in->in_parameters[i].value = value;
-            } else {
+            pthread_mutex_unlock(&pctx->controls_mutex);
+            if(ret != 0) {
                 DBG("v4l2SetControl failed: %d\n", ret);
             }
             return ret;
         } break;
     case IN_CMD_RESOLUTION: {
         // the value points to the current formats nth resolution
-        if(value > (in->in_formats[in->currentFormat].resolutionCount - 1)) {
+        if(value < 0 || value > (in->in_formats[in->currentFormat].resolutionCount - 1)) {
             DBG("The value is out of range");
             return -1;
         }
         int height = in->in_formats[in->currentFormat].supportedResolutions[value].height;
         int width = in->in_formats[in->currentFormat].supportedResolutions[value].width;
-        ret = setResolution(pctx->videoIn, width, height);
-        if(ret == 0) {
-            in->in_formats[in->currentFormat].currentResolution = value;
+
+        return reconfigure(in, width, height, pctx->videoIn->formatIn);
+    } break;
+    case IN_CMD_FORMAT: {
+        // the value points to the nth format, the resolution is kept if possible
+        if(value < 0 || value > (in->formatCount - 1)) {
+            DBG("The value is out of range");
+            return -1;
         }
-        return ret;
+        input_format *format = &in->in_formats[value];
+        int width = pctx->videoIn->width, height = pctx->videoIn->height;
+        long area, best = -1;
+
+        switch(format->format.pixelformat) {
+        case V4L2_PIX_FMT_MJPEG:
+        case V4L2_PIX_FMT_H264:
+        #ifndef NO_LIBJPEG
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_YUV420:
+        #endif
+            break;
+        default:
+            DBG("The format is not supported\n");
+            return -1;
+        }
+
+        /* the resolution with the most similar number of pixels */
+        for(i = 0; i < format->resolutionCount; i++) {
+            area = labs((long)format->supportedResolutions[i].width * format->supportedResolutions[i].height -
+                        (long)pctx->videoIn->width * pctx->videoIn->height);
+            if(best < 0 || area < best) {
+                best = area;
+                width = format->supportedResolutions[i].width;
+                height = format->supportedResolutions[i].height;
+            }
+        }
+
+        return reconfigure(in, width, height, format->format.pixelformat);
     } break;
     case IN_CMD_JPEG_QUALITY:
         if((value >= 0) && (value < 101)) {
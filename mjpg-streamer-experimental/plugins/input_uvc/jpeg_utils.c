@@ -26,104 +26,463 @@
 #include <stdio.h>
 #include <jpeglib.h>
 #include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jerror.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
 #include "v4l2uvc.h"
-
-#define OUTPUT_BUF_SIZE  4096
+#include "jpeg_utils.h"
 
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
-    JOCTET * buffer;    /* start of buffer */
-
-    unsigned char *outbuffer;
-    int outbuffer_size;
-    unsigned char *outbuffer_cursor;
-    int *written;
-
+    unsigned char **buffer;     /* the destination, grows if needed */
+    int *size;                  /* its size */
 } mjpg_destination_mgr;
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
+/*
+ * Compression state kept from frame to frame, the parameters and the
+ * quantization tables are set up again only when the geometry, the format
+ * or the quality change.
+ */
+struct _jpeg_context {
+    struct jpeg_compress_struct cinfo;  /* first, error_exit casts it */
+    struct jpeg_error_mgr jerr;
+    jmp_buf error;
+    mjpg_destination_mgr dest;
+    unsigned char *planes;              /* lines passed as raw data */
+    size_t planes_size;
+    int width, height, format, quality; /* what cinfo is set up for */
+};
+
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: Write the compressed data straight into the destination buffer
+Input Value.: cinfo: the compressor
+Return Value: -
 ******************************************************************************/
 METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
-
-    *(dest->written) = 0;
-
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->pub.next_output_byte = *dest->buffer;
+    dest->pub.free_in_buffer = *dest->size;
 }
 
 /******************************************************************************
-Description.: called whenever local jpeg buffer fills up
-Input Value.:
-Return Value:
+Description.: called when the destination buffer is full, it is doubled
+Input Value.: cinfo: the compressor
+Return Value: TRUE, leaves through error_exit if there is not enough memory
 ******************************************************************************/
 METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
+    int size = *dest->size;
+    unsigned char *buffer = realloc(*dest->buffer, size * 2);
 
-    memcpy(dest->outbuffer_cursor, dest->buffer, OUTPUT_BUF_SIZE);
-    dest->outbuffer_cursor += OUTPUT_BUF_SIZE;
-    *(dest->written) += OUTPUT_BUF_SIZE;
+    if(buffer == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
 
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    *dest->buffer = buffer;
+    *dest->size = size * 2;
+    dest->pub.next_output_byte = buffer + size;
+    dest->pub.free_in_buffer = size;
 
     return TRUE;
 }
 
 /******************************************************************************
-Description.: called by jpeg_finish_compress after all data has been written.
-              Usually needs to flush buffer.
-Input Value.:
-Return Value:
+Description.: called by jpeg_finish_compress after all data has been written,
+              the data is in place already
+Input Value.: cinfo: the compressor
+Return Value: -
 ******************************************************************************/
 METHODDEF(void) term_destination(j_compress_ptr cinfo)
 {
-    mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
-    size_t datacount = OUTPUT_BUF_SIZE - dest->pub.free_in_buffer;
+}
+
+/******************************************************************************
+Description.: Replaces the error handler of libjpeg, which exits the process
+Input Value.: cinfo: the compressor of a jpeg_context
+Return Value: does not return, jumps back to compress_image_to_jpeg
+******************************************************************************/
+METHODDEF(void) error_exit(j_common_ptr cinfo)
+{
+    jpeg_context *ctx = (jpeg_context *)cinfo;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(ctx->error, 1);
+}
+
+/******************************************************************************
+Description.: Create a compressor that is kept for all frames of one thread
+Input Value.: -
+Return Value: the context or NULL if there is not enough memory
+******************************************************************************/
+jpeg_context *jpeg_context_new(void)
+{
+    jpeg_context *ctx = calloc(1, sizeof(jpeg_context));
+
+    if(ctx == NULL)
+        return NULL;
+
+    ctx->cinfo.err = jpeg_std_error(&ctx->jerr);
+    ctx->jerr.error_exit = error_exit;
+    if(setjmp(ctx->error)) {
+        free(ctx);
+        return NULL;
+    }
+    jpeg_create_compress(&ctx->cinfo);
+
+    ctx->dest.pub.init_destination = init_destination;
+    ctx->dest.pub.empty_output_buffer = empty_output_buffer;
+    ctx->dest.pub.term_destination = term_destination;
+    ctx->cinfo.dest = &ctx->dest.pub;
 
-    /* Write any data remaining in the buffer */
-    memcpy(dest->outbuffer_cursor, dest->buffer, datacount);
-    dest->outbuffer_cursor += datacount;
-    *(dest->written) += datacount;
+    return ctx;
 }
 
 /******************************************************************************
-Description.: Prepare for output to a stdio stream.
-Input Value.: buffer is the already allocated buffer memory that will hold
-              the compressed picture. "size" is the size in bytes.
+Description.: Free a compressor
+Input Value.: ctx: the context, may be NULL
 Return Value: -
 ******************************************************************************/
-GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size, int *written)
+void jpeg_context_free(jpeg_context *ctx)
 {
-    mjpg_dest_ptr dest;
+    if(ctx == NULL)
+        return;
+
+    jpeg_destroy_compress(&ctx->cinfo);
+    free(ctx->planes);
+    free(ctx);
+}
+
+/*
+ * The frames are split into Y, Cb and Cr planes and handed to libjpeg as raw
+ * data, so neither a conversion to RGB here nor the one back to YCbCr in
+ * libjpeg is needed.
+ */
 
-    if(cinfo->dest == NULL) {
-        cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
+/******************************************************************************
+Description.: Split a line of YUYV or UYVY pixels into planes, with SIMD
+              instructions where the compiler targets them
+Input Value.: * in....: the packed pixels
+              * pixels: width of the line, an even number
+              * uyvy..: 1 for UYVY, 0 for YUYV
+              * y, cb, cr: receive pixels, pixels/2 and pixels/2 samples
+Return Value: -
+******************************************************************************/
+static void split_422_line(const unsigned char *in, int pixels, int uyvy, unsigned char *y, unsigned char *cb, unsigned char *cr)
+{
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+
+    for(; x + 32 <= pixels; x += 32, in += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)in);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + 32));
+        __m256i ya, yb, ca, cb2, c;
+
+        if(uyvy) {
+            ya = _mm256_srli_epi16(a, 8);
+            yb = _mm256_srli_epi16(b, 8);
+            ca = _mm256_and_si256(a, low);
+            cb2 = _mm256_and_si256(b, low);
+        } else {
+            ya = _mm256_and_si256(a, low);
+            yb = _mm256_and_si256(b, low);
+            ca = _mm256_srli_epi16(a, 8);
+            cb2 = _mm256_srli_epi16(b, 8);
+        }
+        /* packing works within 128 bit lanes, the permutation restores the order */
+        _mm256_storeu_si256((__m256i *)(y + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(ya, yb), 0xd8));
+        c = _mm256_permute4x64_epi64(_mm256_packus_epi16(ca, cb2), 0xd8);
+        c = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(c, low), _mm256_srli_epi16(c, 8)), 0xd8);
+        _mm_storeu_si128((__m128i *)(cb + x / 2), _mm256_castsi256_si128(c));
+        _mm_storeu_si128((__m128i *)(cr + x / 2), _mm256_extracti128_si256(c, 1));
+    }
+#elif defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00ff);
+
+    for(; x + 16 <= pixels; x += 16, in += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)in);
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+        __m128i ya, yb, ca, cb2, c;
+
+        if(uyvy) {
+            ya = _mm_srli_epi16(a, 8);
+            yb = _mm_srli_epi16(b, 8);
+            ca = _mm_and_si128(a, low);
+            cb2 = _mm_and_si128(b, low);
+        } else {
+            ya = _mm_and_si128(a, low);
+            yb = _mm_and_si128(b, low);
+            ca = _mm_srli_epi16(a, 8);
+            cb2 = _mm_srli_epi16(b, 8);
+        }
+        _mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(ya, yb));
+        c = _mm_packus_epi16(ca, cb2);
+        c = _mm_packus_epi16(_mm_and_si128(c, low), _mm_srli_epi16(c, 8));
+        _mm_storel_epi64((__m128i *)(cb + x / 2), c);
+        _mm_storel_epi64((__m128i *)(cr + x / 2), _mm_srli_si128(c, 8));
     }
+#elif defined(__ARM_NEON)
+    for(; x + 32 <= pixels; x += 32, in += 64) {
+        uint8x16x4_t p = vld4q_u8(in);
+        uint8x16x2_t luma;
+
+        if(uyvy) {
+            luma.val[0] = p.val[1];
+            luma.val[1] = p.val[3];
+            vst1q_u8(cb + x / 2, p.val[0]);
+            vst1q_u8(cr + x / 2, p.val[2]);
+        } else {
+            luma.val[0] = p.val[0];
+            luma.val[1] = p.val[2];
+            vst1q_u8(cb + x / 2, p.val[1]);
+            vst1q_u8(cr + x / 2, p.val[3]);
+        }
+        vst2q_u8(y + x, luma);
+    }
+#endif
+
+    for(; x < pixels; x += 2, in += 4) {
+        if(uyvy) {
+            y[x] = in[1];
+            y[x + 1] = in[3];
+            cb[x / 2] = in[0];
+            cr[x / 2] = in[2];
+        } else {
+            y[x] = in[0];
+            y[x + 1] = in[2];
+            cb[x / 2] = in[1];
+            cr[x / 2] = in[3];
+        }
+    }
+}
+
+/******************************************************************************
+Description.: Split a line of interleaved Cb and Cr samples, the chroma plane
+              of NV12, into planes
+Input Value.: * in.....: the interleaved samples
+              * samples: number of Cb and Cr pairs
+              * cb, cr.: receive the samples
+Return Value: -
+******************************************************************************/
+static void split_uv_line(const unsigned char *in, int samples, unsigned char *cb, unsigned char *cr)
+{
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i low = _mm256_set1_epi16(0x00ff);
 
-    dest = (mjpg_dest_ptr) cinfo->dest;
-    dest->pub.init_destination = init_destination;
-    dest->pub.empty_output_buffer = empty_output_buffer;
-    dest->pub.term_destination = term_destination;
-    dest->outbuffer = buffer;
-    dest->outbuffer_size = size;
-    dest->outbuffer_cursor = buffer;
-    dest->written = written;
+    for(; x + 32 <= samples; x += 32, in += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)in);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + 32));
+
+        _mm256_storeu_si256((__m256i *)(cb + x),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low)), 0xd8));
+        _mm256_storeu_si256((__m256i *)(cr + x),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8));
+    }
+#elif defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00ff);
+
+    for(; x + 16 <= samples; x += 16, in += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)in);
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+
+        _mm_storeu_si128((__m128i *)(cb + x), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+        _mm_storeu_si128((__m128i *)(cr + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for(; x + 16 <= samples; x += 16, in += 32) {
+        uint8x16x2_t p = vld2q_u8(in);
+
+        vst1q_u8(cb + x, p.val[0]);
+        vst1q_u8(cr + x, p.val[1]);
+    }
+#endif
+
+    for(; x < samples; x++, in += 2) {
+        cb[x] = in[0];
+        cr[x] = in[1];
+    }
+}
+
+/******************************************************************************
+Description.: Convert two lines of RGB565 pixels to Y, Cb and Cr planes, the
+              chroma of each 2x2 block of pixels is averaged. The JFIF
+              coefficients are scaled to 8 bit, so the SIMD version can work
+              on 16 bit lanes and gets the same result.
+Input Value.: * in0, in1: the lines, little endian
+              * pixels..: width of the lines
+              * y0, y1..: receive the luma of the lines
+              * cb, cr..: receive (pixels+1)/2 samples each
+Return Value: -
+******************************************************************************/
+static void split_rgb565_lines(const unsigned char *in0, const unsigned char *in1, int pixels, unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr)
+{
+    const unsigned char *in[2] = { in0, in1 };
+    unsigned char *y[2] = { y0, y1 };
+    int x = 0, i, j;
+
+#if defined(__SSE2__)
+    const __m128i red = _mm_set1_epi16(0xf8), green = _mm_set1_epi16(0xfc);
+    const __m128i ones = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+    const __m128i half = _mm_set1_epi16(128), offset = _mm_set1_epi16((short)32896);
+
+    for(; x + 16 <= pixels; x += 16) {
+        __m128i rs[2], gs[2], bs[2], r, g, b, c;
+
+        rs[0] = rs[1] = gs[0] = gs[1] = bs[0] = bs[1] = _mm_setzero_si128();
+        for(i = 0; i < 2; i++) {
+            __m128i luma[2];
+
+            for(j = 0; j < 2; j++) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(in[i] + 2 * x + 16 * j));
+
+                r = _mm_and_si128(_mm_srli_epi16(v, 8), red);
+                g = _mm_and_si128(_mm_srli_epi16(v, 3), green);
+                b = _mm_and_si128(_mm_slli_epi16(v, 3), red);
+                luma[j] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+                                                                     _mm_mullo_epi16(g, _mm_set1_epi16(150))),
+                                                       _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(29)), half)), 8);
+                rs[j] = _mm_add_epi16(rs[j], r);
+                gs[j] = _mm_add_epi16(gs[j], g);
+                bs[j] = _mm_add_epi16(bs[j], b);
+            }
+            _mm_storeu_si128((__m128i *)(y[i] + x), _mm_packus_epi16(luma[0], luma[1]));
+        }
+
+        /* add the horizontal neighbours and average the 2x2 blocks */
+        r = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(_mm_madd_epi16(rs[0], ones), _mm_madd_epi16(rs[1], ones)), two), 2);
+        g = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(_mm_madd_epi16(gs[0], ones), _mm_madd_epi16(gs[1], ones)), two), 2);
+        b = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(_mm_madd_epi16(bs[0], ones), _mm_madd_epi16(bs[1], ones)), two), 2);
+
+        /* the sums wrap around, but the results are between 0 and 65535 */
+        c = _mm_sub_epi16(_mm_add_epi16(_mm_slli_epi16(b, 7), offset),
+                          _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(43)), _mm_mullo_epi16(g, _mm_set1_epi16(85))));
+        c = _mm_srli_epi16(c, 8);
+        _mm_storel_epi64((__m128i *)(cb + x / 2), _mm_packus_epi16(c, c));
+        c = _mm_sub_epi16(_mm_add_epi16(_mm_slli_epi16(r, 7), offset),
+                          _mm_add_epi16(_mm_mullo_epi16(g, _mm_set1_epi16(107)), _mm_mullo_epi16(b, _mm_set1_epi16(21))));
+        c = _mm_srli_epi16(c, 8);
+        _mm_storel_epi64((__m128i *)(cr + x / 2), _mm_packus_epi16(c, c));
+    }
+#endif
+
+    for(; x < pixels; x += 2) {
+        /* an odd last pixel is taken twice */
+        int last = (x + 1 < pixels) ? 1 : 0;
+        int rs = 0, gs = 0, bs = 0, r, g, b;
+
+        for(i = 0; i < 2; i++) {
+            for(j = 0; j < 2; j++) {
+                const unsigned char *p = in[i] + 2 * (x + (j & last));
+                unsigned int v = p[0] | (p[1] << 8);
+
+                r = (v >> 8) & 248;
+                g = (v >> 3) & 252;
+                b = (v << 3) & 248;
+                y[i][x + (j & last)] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+                rs += r;
+                gs += g;
+                bs += b;
+            }
+        }
+
+        r = (rs + 2) >> 2;
+        g = (gs + 2) >> 2;
+        b = (bs + 2) >> 2;
+        cb[x / 2] = (128 * b - 43 * r - 85 * g + 32896) >> 8;
+        cr[x / 2] = (128 * r - 107 * g - 21 * b + 32896) >> 8;
+    }
+}
+
+/******************************************************************************
+Description.: Fill the planes for one row of chroma samples, that is one line
+              of the packed 4:2:2 formats or two lines of RGB565, NV12 and
+              I420. Lines below the frame repeat the last one, the columns up
+              to the padded width repeat the last pixel.
+              The planes of NV12 and I420 are handed to libjpeg where they
+              are in the frame if no columns need to be added, the rows then
+              point into the frame instead of the scratch lines.
+Input Value.: * frame, width, height, format: the raw frame
+              * line..: first line of the frame to convert
+              * padded: width of the luma plane, a multiple of 16
+              * y.....: one or two rows of the luma plane
+              * cb, cr: the rows of the chroma planes
+Return Value: -
+******************************************************************************/
+static void split_lines(const unsigned char *frame, int width, int height, int format, int line, int padded, JSAMPROW *y, JSAMPROW *cb, JSAMPROW *cr)
+{
+    int chroma = (width + 1) / 2, lines = 1, i;
+
+    if(format == V4L2_PIX_FMT_RGB565) {
+        int next = (line + 1 < height) ? line + 1 : height - 1;
+
+        if(line >= height)
+            line = next = height - 1;
+        split_rgb565_lines(frame + (size_t)line * width * 2, frame + (size_t)next * width * 2,
+                           width, y[0], y[1], *cb, *cr);
+        lines = 2;
+    } else if(format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_YUV420) {
+        const unsigned char *plane = frame + (size_t)width * height;
+        int next = (line + 1 < height) ? line + 1 : height - 1, row;
+
+        if(line >= height)
+            line = next = height - 1;
+        row = line / 2;
+        for(i = 0; i < 2; i++) {
+            const unsigned char *in = frame + (size_t)(i ? next : line) * width;
+
+            if(width == padded)
+                y[i] = (JSAMPROW)in;
+            else
+                memcpy(y[i], in, width);
+        }
+        lines = 2;
+
+        if(format == V4L2_PIX_FMT_NV12) {
+            split_uv_line(plane + (size_t)row * width, width / 2, *cb, *cr);
+        } else {
+            const unsigned char *u = plane + (size_t)row * (width / 2);
+            const unsigned char *v = u + (size_t)(width / 2) * (height / 2);
+
+            if(width == padded) {
+                *cb = (JSAMPROW)u;
+                *cr = (JSAMPROW)v;
+            } else {
+                memcpy(*cb, u, width / 2);
+                memcpy(*cr, v, width / 2);
+            }
+        }
+    } else {
+        if(line >= height)
+            line = height - 1;
+        split_422_line(frame + (size_t)line * width * 2, width & ~1, format == V4L2_PIX_FMT_UYVY, y[0], *cb, *cr);
+    }
+
+    if(width == padded)
+        return;
+    for(i = 0; i < lines; i++)
+        memset(y[i] + width, y[i][width - 1], padded - width);
+    memset(*cb + chroma, (*cb)[chroma - 1], padded / 2 - chroma);
+    memset(*cr + chroma, (*cr)[chroma - 1], padded / 2 - chroma);
 }
 
 /******************************************************************************
@@ -134,133 +493,94 @@ Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               YUYV data to JPEG. Most other implementations use the
               "jpeg_stdio_dest" from libjpeg, which can not store compressed
               pictures to memory instead of a file.
-Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
-              the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
+              The frame is passed to libjpeg as raw YCbCr planes, sampled
+              4:2:2 like the frame for YUYV and UYVY and 4:2:0 for RGB565,
+              NV12 and I420. The planes of I420 and the luma plane of NV12
+              are not copied if the width is a multiple of 16.
+              Each thread compressing frames needs its own context.
+Input Value.: * ctx.......: the compressor of this thread
+              * frame.....: the raw frame with its geometry and V4L2 pixel
+                            format
+              * buffer, size: the destination, a malloc()ed buffer that is
+                            enlarged if the frame does not fit
+              * quality...: JPEG quality
+Return Value: the number of bytes in the buffer, -1 on errors
 ******************************************************************************/
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+int compress_image_to_jpeg(jpeg_context *ctx, const unsigned char *frame, int width, int height, int format, unsigned char **buffer, int *size, int quality)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
-    int z;
-    static int written;
-
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
-
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    jpeg_start_compress(&cinfo, TRUE);
-
-    z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[0] << 8;
-                else
-                    y = yuyv[2] << 8;
-                u = yuyv[1] - 128;
-                v = yuyv[3] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+    struct jpeg_compress_struct *cinfo = &ctx->cinfo;
+    JSAMPROW rows[3][2 * DCTSIZE];
+    JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+    int padded = (width + 15) & ~15;
+    int vsamp = (format == V4L2_PIX_FMT_YUYV || format == V4L2_PIX_FMT_UYVY) ? 1 : 2;
+    size_t planes_size = (size_t)DCTSIZE * padded * (vsamp + 1);
+    int line, i;
+
+    if(format != V4L2_PIX_FMT_YUYV && format != V4L2_PIX_FMT_UYVY && format != V4L2_PIX_FMT_RGB565 &&
+       format != V4L2_PIX_FMT_NV12 && format != V4L2_PIX_FMT_YUV420)
+        return -1;
+
+    /* the luma lines of one row of blocks followed by the lines of Cb and Cr */
+    if(ctx->planes_size < planes_size) {
+        free(ctx->planes);
+        ctx->planes_size = 0;
+        if((ctx->planes = malloc(planes_size)) == NULL)
+            return -1;
+        ctx->planes_size = planes_size;
+    }
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-            for(x = 0; x < vd->width; x++) {
-                /*
-                unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
-                r =  ((unsigned char)(raw[i+1]) & 248);
-                g = (unsigned char)(( tb & 2016) >> 3);
-                b =  ((unsigned char)raw[i] & 31) * 8;
-                */
-                unsigned int twoByte = (yuyv[1] << 8) + yuyv[0];
-                *(ptr++) = (yuyv[1] & 248);
-                *(ptr++) = (unsigned char)((twoByte & 2016) >> 3);
-                *(ptr++) = ((yuyv[0] & 31) * 8);
-                yuyv += 2;
-            }
+    if(setjmp(ctx->error)) {
+        jpeg_abort_compress(cinfo);
+        ctx->width = 0;
+        return -1;
+    }
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    }  else if (vd->formatIn == V4L2_PIX_FMT_UYVY) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[1] << 8;
-                else
-                    y = yuyv[3] << 8;
-                u = yuyv[0] - 128;
-                v = yuyv[2] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+    if(ctx->width != width || ctx->height != height || ctx->format != format || ctx->quality != quality) {
+        cinfo->image_width = width;
+        cinfo->image_height = height;
+        cinfo->input_components = 3;
+        cinfo->in_color_space = JCS_YCbCr;
+
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, quality, TRUE);
+
+        cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+        cinfo->do_fancy_downsampling = FALSE;
+#endif
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = vsamp;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+
+        ctx->width = width;
+        ctx->height = height;
+        ctx->format = format;
+        ctx->quality = quality;
+    }
+
+    ctx->dest.buffer = buffer;
+    ctx->dest.size = size;
+
+    jpeg_start_compress(cinfo, TRUE);
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    for(line = 0; line < height; line += DCTSIZE * vsamp) {
+        /* the rows of the last pass may point into the frame */
+        for(i = 0; i < DCTSIZE * vsamp; i++)
+            rows[0][i] = ctx->planes + i * padded;
+        for(i = 0; i < DCTSIZE; i++) {
+            rows[1][i] = ctx->planes + DCTSIZE * padded * vsamp + i * padded / 2;
+            rows[2][i] = rows[1][i] + DCTSIZE * padded / 2;
         }
+        for(i = 0; i < DCTSIZE; i++)
+            split_lines(frame, width, height, format, line + i * vsamp, padded,
+                        &rows[0][i * vsamp], &rows[1][i], &rows[2][i]);
+        jpeg_write_raw_data(cinfo, planes, DCTSIZE * vsamp);
     }
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
 
-    free(line_buffer);
+    jpeg_finish_compress(cinfo);
 
-    return (written);
+    return *size - (int)ctx->dest.pub.free_in_buffer;
 }
@@ -1 +1,10 @@
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
+#ifndef JPEG_UTILS_H
+#define JPEG_UTILS_H
+
+typedef struct _jpeg_context jpeg_context;
+
+jpeg_context *jpeg_context_new(void);
+void jpeg_context_free(jpeg_context *ctx);
+int compress_image_to_jpeg(jpeg_context *ctx, const unsigned char *frame, int width, int height, int format, unsigned char **buffer, int *size, int quality);
+
+#endif
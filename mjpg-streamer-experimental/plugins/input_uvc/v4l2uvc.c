@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
 #include "v4l2uvc.h"
 #include "huffman.h"
 #include "dynctrl.h"
@@ -87,6 +88,8 @@ int xioctl(int fd, int IOCTL_X, void *arg)
 }
 
 static int init_v4l2(struct vdIn *vd);
+static int set_format(struct vdIn *vd);
+static int map_buffers(struct vdIn *vd);
 
 int init_videoIn(struct vdIn *vd, char *device, int width,
                  int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd)
@@ -198,7 +201,8 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
 
                 pglobal->in[id].in_formats[pglobal->in[id].formatCount].supportedResolutions[j-1].width = fsenum.discrete.width;
                 pglobal->in[id].in_formats[pglobal->in[id].formatCount].supportedResolutions[j-1].height = fsenum.discrete.height;
-                if(format == fmtdesc.pixelformat) {
+                if(format == fmtdesc.pixelformat &&
+                   fsenum.discrete.width == vd->width && fsenum.discrete.height == vd->height) {
                     pglobal->in[id].in_formats[pglobal->in[id].formatCount].currentResolution = (j - 1);
                     DBG("\tSupported size with the current format: %dx%d\n", fsenum.discrete.width, fsenum.discrete.height);
                 } else {
@@ -210,34 +214,6 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
         }
     }
 
-    /* alloc a temp buffer to reconstruct the pict */
-    vd->framesizeIn = (vd->width * vd->height << 1);
-    switch(vd->formatIn) {
-    case V4L2_PIX_FMT_MJPEG: // in JPG mode the frame size is varies at every frame, so we allocate a bit bigger buffer
-        vd->tmpbuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-        if(!vd->tmpbuffer)
-            goto error;
-        vd->framebuffer =
-            (unsigned char *) calloc(1, (size_t) vd->width * (vd->height + 8) * 2);
-        break;
-    case V4L2_PIX_FMT_RGB565: // buffer allocation for non varies on frame size formats
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_UYVY:
-        vd->framebuffer =
-            (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-        break;
-        vd->framebuffer =
-            (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-        break;
-    default:
-        fprintf(stderr, " should never arrive exit fatal !!\n");
-        goto error;
-        break;
-
-    }
-
-    if(!vd->framebuffer)
-        goto error;
     return 0;
 error:
     free(pglobal->in[id].in_parameters);
@@ -250,7 +226,6 @@ error:
 
 static int init_v4l2(struct vdIn *vd)
 {
-    int i;
     int ret = 0;
     if((vd->fd = OPEN_VIDEO(vd->videodevice, O_RDWR)) == -1) {
         perror("ERROR opening V4L interface");
@@ -290,9 +265,24 @@ static int init_v4l2(struct vdIn *vd)
         }
     }
 
-    /*
-     * set format in
-     */
+    if(set_format(vd) < 0 || map_buffers(vd) < 0)
+        goto fatal;
+    return 0;
+fatal:
+    return -1;
+
+}
+
+/******************************************************************************
+Description.: Negotiate the format, resolution and frame rate of vd with the
+              driver, the driver must not have buffers allocated
+Input Value.: vd: the device
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+static int set_format(struct vdIn *vd)
+{
+    int ret;
+
     memset(&vd->fmt, 0, sizeof(struct v4l2_format));
     vd->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->fmt.fmt.pix.width = vd->width;
@@ -342,6 +332,15 @@ static int init_v4l2(struct vdIn *vd)
 	fprintf(stderr, "    ... Falling back to RGB565 mode (consider using -fourcc option). Note that this requires much more CPU power\n");
 	vd->formatIn = vd->fmt.fmt.pix.pixelformat;
 	break;
+      case V4L2_PIX_FMT_NV12:
+      case V4L2_PIX_FMT_YUV420:
+	fprintf(stderr, "    ... Falling back to %s mode (consider using -fourcc option). Note that this requires much more CPU power\n", fmtStringObtained);
+	vd->formatIn = vd->fmt.fmt.pix.pixelformat;
+	break;
+      case V4L2_PIX_FMT_H264:
+	/* the JPEG consumers can not show H.264 frames */
+	fprintf(stderr, "    ... H.264 is only captured when requested with -fourcc H264.\n");
+	goto fatal;
       default:
 	goto fatal;
 	break;
@@ -405,24 +404,52 @@ static int init_v4l2(struct vdIn *vd)
         }
     }
 
+    /* the size of the frames in YUV formats, MJPEG frames stay below */
+    vd->framesizeIn = (vd->width * vd->height << 1);
+    return 0;
+fatal:
+    return -1;
+}
+
+/******************************************************************************
+Description.: Allocate, map and queue the buffers of the driver
+Input Value.: vd: the device
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+static int map_buffers(struct vdIn *vd)
+{
+    int i, ret;
+
+    memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
+    vd->rb.count = (vd->buffers > 0) ? vd->buffers : NB_BUFFER;
     /*
-     * request buffers
+     * with zero copy the published frame stays dequeued until the next one
+     * replaced it, one more buffer keeps the driver at the same number of
+     * queued buffers
      */
-    memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
-    vd->rb.count = NB_BUFFER;
+    if(vd->zerocopy)
+        vd->rb.count++;
+    if(vd->rb.count > NB_BUFFER_MAX)
+        vd->rb.count = NB_BUFFER_MAX;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->rb.memory = V4L2_MEMORY_MMAP;
 
     ret = xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb);
-    if(ret < 0) {
+    if(ret < 0 || vd->rb.count == 0) {
         perror("Unable to allocate buffers");
         goto fatal;
     }
 
+    /* the driver may hand out fewer buffers than requested */
+    vd->nbuffers = (vd->rb.count < NB_BUFFER_MAX) ? vd->rb.count : NB_BUFFER_MAX;
+    vd->published = -1;
+    if(debug)
+        fprintf(stderr, "%d buffers allocated\n", vd->nbuffers);
+
     /*
      * map the buffers
      */
-    for(i = 0; i < NB_BUFFER; i++) {
+    for(i = 0; i < vd->nbuffers; i++) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -430,6 +457,7 @@ static int init_v4l2(struct vdIn *vd)
         ret = xioctl(vd->fd, VIDIOC_QUERYBUF, &vd->buf);
         if(ret < 0) {
             perror("Unable to query buffer");
+            vd->nbuffers = i;
             goto fatal;
         }
 
@@ -441,8 +469,10 @@ static int init_v4l2(struct vdIn *vd)
                           vd->buf.m.offset);
         if(vd->mem[i] == MAP_FAILED) {
             perror("Unable to map buffer");
+            vd->nbuffers = i;
             goto fatal;
         }
+        vd->length[i] = vd->buf.length;
         if(debug)
             fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
     }
@@ -450,7 +480,7 @@ static int init_v4l2(struct vdIn *vd)
     /*
      * Queue the buffers.
      */
-    for(i = 0; i < NB_BUFFER; ++i) {
+    for(i = 0; i < vd->nbuffers; ++i) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -458,13 +488,35 @@ static int init_v4l2(struct vdIn *vd)
         ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
         if(ret < 0) {
             perror("Unable to queue buffer");
-            goto fatal;;
+            goto fatal;
         }
     }
     return 0;
 fatal:
     return -1;
+}
+
+/******************************************************************************
+Description.: Unmap the buffers and free them in the driver, so the format
+              can be changed, the stream must be off
+Input Value.: vd: the device
+Return Value: -
+******************************************************************************/
+static void unmap_buffers(struct vdIn *vd)
+{
+    int i;
 
+    for(i = 0; i < vd->nbuffers; i++)
+        munmap(vd->mem[i], vd->length[i]);
+    vd->nbuffers = 0;
+    vd->published = -1;
+
+    memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
+    vd->rb.count = 0;
+    vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vd->rb.memory = V4L2_MEMORY_MMAP;
+    if(xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb) < 0)
+        perror("Unable to free buffers");
 }
 
 static int video_enable(struct vdIn *vd)
@@ -478,6 +530,10 @@ static int video_enable(struct vdIn *vd)
         return ret;
     }
     vd->streamingState = STREAMING_ON;
+    /* drivers start counting again */
+    vd->sequence = -1;
+    /* the format may have changed, look for Huffman tables again */
+    vd->dht = -1;
     return 0;
 }
 
@@ -497,62 +553,220 @@ static int video_disable(struct vdIn *vd, streaming_state disabledState)
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: Walk the markers of a JPEG up to the start of the scan
+Input Value.: * buf: the JPEG
+              * size: its size
+              * sof: receives the offset of the frame header (SOFn marker)
+Return Value: 1 if it carries Huffman tables, 0 if not, -1 if the headers can
+              not be parsed
 ******************************************************************************/
-int is_huffman(unsigned char *buf)
+static int walk_markers(const unsigned char *buf, int size, int *sof)
 {
-    unsigned char *ptbuf;
-    int i = 0;
-    ptbuf = buf;
-    while(((ptbuf[0] << 8) | ptbuf[1]) != 0xffda) {
-        if(i++ > 2048)
-            return 0;
-        if(((ptbuf[0] << 8) | ptbuf[1]) == 0xffc4)
+    int pos = 2, marker;
+
+    *sof = -1;
+    if(size < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+        return -1;
+
+    while(pos + 4 <= size) {
+        if(buf[pos] != 0xff)
+            return -1;
+        marker = buf[pos + 1];
+        if(marker == 0xff) {
+            /* fill byte */
+            pos++;
+            continue;
+        }
+        if(marker == 0xc4)
             return 1;
-        ptbuf++;
+        if(marker == 0xda)
+            return (*sof >= 0) ? 0 : -1;
+        if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            /* markers without a segment */
+            pos += 2;
+            continue;
+        }
+        if(*sof < 0 && marker >= 0xc0 && marker <= 0xcf &&
+           marker != 0xc8 && marker != 0xcc)
+            *sof = pos;
+        pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
     }
-    return 0;
+    return -1;
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: Many UVC cameras leave the Huffman tables out of their MJPEG
+              frames and expect the standard tables. Whether they are there
+              is checked with the first frame after the stream started, after
+              that only the position of the frame header is verified.
+Input Value.: * vd...: the device
+              * frame: a MJPEG frame
+              * size.: its size
+              * dht..: receives the tables to insert
+              * dht_size: receives their size
+Return Value: offset to insert the tables at, -1 if the frame needs none
 ******************************************************************************/
-int memcpy_picture(unsigned char *out, unsigned char *buf, int size)
+int huffman_insert(struct vdIn *vd, const unsigned char *frame, int size,
+                   const unsigned char **dht, int *dht_size)
 {
-    unsigned char *ptdeb, *ptlimit, *ptcur = buf;
-    int sizein, pos = 0;
-
-    if(!is_huffman(buf)) {
-        ptdeb = ptcur = buf;
-        ptlimit = buf + size;
-        while((((ptcur[0] << 8) | ptcur[1]) != 0xffc0) && (ptcur < ptlimit))
-            ptcur++;
-        if(ptcur >= ptlimit)
-            return pos;
-        sizein = ptcur - ptdeb;
-
-        memcpy(out + pos, buf, sizein); pos += sizein;
-        memcpy(out + pos, dht_data, sizeof(dht_data)); pos += sizeof(dht_data);
-        memcpy(out + pos, ptcur, size - sizein); pos += size - sizein;
-    } else {
-        memcpy(out + pos, ptcur, size); pos += size;
+    int ret;
+
+    if(vd->dht == 0 && vd->dht_at >= 0 && vd->dht_at + 1 < size &&
+       frame[vd->dht_at] == 0xff && (frame[vd->dht_at + 1] & 0xf0) == 0xc0)
+        goto insert;
+    if(vd->dht > 0)
+        return -1;
+
+    /* first frame of the stream or the headers changed */
+    if((ret = walk_markers(frame, size, &vd->dht_at)) < 0)
+        return -1;
+    if(vd->dht < 0)
+        DBG("the frames %s Huffman tables\n", ret ? "carry" : "do not carry");
+    vd->dht = ret;
+    if(ret)
+        return -1;
+
+insert:
+    *dht = dht_data;
+    *dht_size = sizeof(dht_data);
+    return vd->dht_at;
+}
+
+/******************************************************************************
+Description.: Find out if a H.264 frame can be decoded on its own. The frame
+              is an Annex B byte stream, its NAL units are looked at up to the
+              first slice, which is an IDR slice in key frames. Few drivers
+              set V4L2_BUF_FLAG_KEYFRAME, uvcvideo does not.
+Input Value.: * frame: a H.264 frame
+              * size.: its size
+Return Value: 1 for a key frame, 0 otherwise
+******************************************************************************/
+int h264_keyframe(const unsigned char *frame, int size)
+{
+    int pos, type;
+
+    for(pos = 0; pos + 3 < size; pos++) {
+        if(frame[pos] != 0 || frame[pos + 1] != 0 || frame[pos + 2] != 1)
+            continue;
+        type = frame[pos + 3] & 0x1f;
+        if(type == 5)
+            return 1;
+        if(type == 1)
+            return 0;
+        pos += 3;
     }
-    return pos;
+    return 0;
 }
 
-int uvcGrab(struct vdIn *vd)
+/******************************************************************************
+Description.: Count the frames the driver dropped before this buffer, they
+              show up as gaps in the sequence numbers, and measure the
+              interval between the frames. Mean interval and jitter are
+              running averages over about 16 frames like the interarrival
+              jitter of RTP (RFC 3550), intervals across a gap are skipped.
+Input Value.: * vd.: the device
+              * buf: a buffer that was just dequeued
+Return Value: -
+******************************************************************************/
+static void count_sequence(struct vdIn *vd, const struct v4l2_buffer *buf)
 {
+    long interval;
+
+    if(vd->sequence >= 0 && buf->sequence > vd->sequence + 1)
+        vd->dropped += buf->sequence - vd->sequence - 1;
+
+    if(vd->sequence >= 0 && buf->sequence == vd->sequence + 1) {
+        interval = (buf->timestamp.tv_sec - vd->timestamp.tv_sec) * 1000000L +
+                   (buf->timestamp.tv_usec - vd->timestamp.tv_usec);
+        if(vd->intervals == 0) {
+            vd->interval = interval;
+            vd->interval_min = vd->interval_max = interval;
+        } else {
+            vd->jitter += (labs(interval - vd->interval) - vd->jitter) / 16;
+            vd->interval += (interval - vd->interval) / 16;
+            if(interval < vd->interval_min)
+                vd->interval_min = interval;
+            if(interval > vd->interval_max)
+                vd->interval_max = interval;
+        }
+        vd->intervals++;
+    }
+
+    vd->sequence = buf->sequence;
+    vd->timestamp = buf->timestamp;
+}
+
 #define HEADERFRAME1 0xaf
-    int ret;
 
-    if(vd->streamingState == STREAMING_OFF) {
-        if(video_enable(vd))
-            goto err;
+/******************************************************************************
+Description.: Dequeue the buffers the driver has filled in the meantime
+              without waiting for one and keep only the newest of them, the
+              older ones go back to the driver unread
+Input Value.: vd: the device, vd->buf holds a dequeued buffer
+Return Value: 0 if OK, -1 if a buffer could not be queued again
+******************************************************************************/
+static int drain_buffers(struct vdIn *vd)
+{
+    struct pollfd pfd;
+    struct v4l2_buffer buf;
+
+    pfd.fd = vd->fd;
+    pfd.events = POLLIN;
+
+    while(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        memset(&buf, 0, sizeof(struct v4l2_buffer));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        /* errors show up again with the next blocking VIDIOC_DQBUF */
+        if(xioctl(vd->fd, VIDIOC_DQBUF, &buf) < 0)
+            break;
+        count_sequence(vd, &buf);
+
+        /* an empty buffer does not replace a frame */
+        if(vd->formatIn == V4L2_PIX_FMT_MJPEG && buf.bytesused <= HEADERFRAME1) {
+            if(uvcRequeue(vd, buf.index) < 0)
+                return -1;
+            continue;
+        }
+
+        if(uvcRequeue(vd, vd->buf.index) < 0)
+            return -1;
+        vd->buf = buf;
+        vd->drained++;
     }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Start the stream if it is not running yet
+Input Value.: vd: the device
+Return Value: 0 if OK, the result of VIDIOC_STREAMON otherwise
+******************************************************************************/
+int uvcStart(struct vdIn *vd)
+{
+    if(vd->streamingState == STREAMING_OFF)
+        return video_enable(vd);
+    return 0;
+}
+
+/******************************************************************************
+Description.: Take the next filled buffer from the driver, the stream is
+              started if necessary. The frame stays in vd->mem[vd->buf.index]
+              until the buffer is given back with uvcRequeue(), so frames
+              can be dropped before they were copied. In latest mode the
+              newest of the buffers that are ready is taken.
+Input Value.: vd: the device
+Return Value: 0 if OK, 1 for an empty buffer that was queued again right away,
+              -1 on errors
+******************************************************************************/
+int uvcDequeue(struct vdIn *vd)
+{
+    int ret;
+
+    if(uvcStart(vd))
+        goto err;
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->buf.memory = V4L2_MEMORY_MMAP;
@@ -562,66 +776,56 @@ int uvcGrab(struct vdIn *vd)
         perror("Unable to dequeue buffer");
         goto err;
     }
+    count_sequence(vd, &vd->buf);
 
-    switch(vd->formatIn) {
-    case V4L2_PIX_FMT_MJPEG:
-        if(vd->buf.bytesused <= HEADERFRAME1) {
-            /* Prevent crash
-                                                        * on empty image */
-            fprintf(stderr, "Ignoring empty buffer ...\n");
-            return 0;
-        }
+    /* every H.264 frame is needed to decode the following ones */
+    if(vd->latest && vd->formatIn != V4L2_PIX_FMT_H264 && drain_buffers(vd) < 0)
+        return -1;
 
-        /* memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+    if(vd->formatIn == V4L2_PIX_FMT_MJPEG && vd->buf.bytesused <= HEADERFRAME1) {
+        /* Prevent crash on empty image */
+        fprintf(stderr, "Ignoring empty buffer ...\n");
+        return (uvcRequeue(vd, vd->buf.index) < 0) ? -1 : 1;
+    }
 
-        memcpy (vd->tmpbuffer, vd->mem[vd->buf.index], HEADERFRAME1);
-        memcpy (vd->tmpbuffer + HEADERFRAME1, dht_data, sizeof(dht_data));
-        memcpy (vd->tmpbuffer + HEADERFRAME1 + sizeof(dht_data), vd->mem[vd->buf.index] + HEADERFRAME1, (vd->buf.bytesused - HEADERFRAME1));
-        */
+    if(debug)
+        fprintf(stderr, "bytes in used %d \n", vd->buf.bytesused);
 
-        memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
-        vd->tmpbytesused = vd->buf.bytesused;
-        vd->tmptimestamp = vd->buf.timestamp;
+    return 0;
 
-        if(debug)
-            fprintf(stderr, "bytes in used %d \n", vd->buf.bytesused);
-        break;
-    case V4L2_PIX_FMT_RGB565:
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_UYVY:
-        if(vd->buf.bytesused > vd->framesizeIn)
-            memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->framesizeIn);
-        else
-            memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->buf.bytesused);
-        break;
+err:
+    vd->signalquit = 0;
+    return -1;
+}
 
-    default:
-        goto err;
-        break;
-    }
+/******************************************************************************
+Description.: Give a buffer back to the driver to be filled again
+Input Value.: * vd...: the device
+              * index: number of the buffer
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+int uvcRequeue(struct vdIn *vd, int index)
+{
+    struct v4l2_buffer buf;
 
-    ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-    if(ret < 0) {
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if(xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0) {
         perror("Unable to requeue buffer");
-        goto err;
+        vd->signalquit = 0;
+        return -1;
     }
 
     return 0;
-
-err:
-    vd->signalquit = 0;
-    return -1;
 }
 
 int close_v4l2(struct vdIn *vd)
 {
     if(vd->streamingState == STREAMING_ON)
         video_disable(vd, STREAMING_OFF);
-    if(vd->tmpbuffer)
-        free(vd->tmpbuffer);
-    vd->tmpbuffer = NULL;
-    free(vd->framebuffer);
-    vd->framebuffer = NULL;
     free(vd->videodevice);
     free(vd->status);
     free(vd->pictName);
@@ -660,22 +864,43 @@ static int isv4l2Control(struct vdIn *vd, int control, struct v4l2_queryctrl *qu
     return -1;
 }
 
-int v4l2GetControl(struct vdIn *vd, int control)
+/******************************************************************************
+Description.: Find a V4L2 control in the list of controls of an input, its
+              value there is the cache the controls are read from
+Input Value.: * pglobal, plugin_number: the input
+              * control_id: id of the control
+Return Value: the control or NULL if the input has no such control
+******************************************************************************/
+static control *find_control(globals *pglobal, int plugin_number, unsigned int control_id)
 {
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control_s;
-    int err;
+    input *in = &pglobal->in[plugin_number];
+    int i;
 
-    if((err = isv4l2Control(vd, control, &queryctrl)) < 0) {
-        return -1;
-    }
+    for(i = 0; i < in->parametercount; i++)
+        if(in->in_parameters[i].group == IN_CMD_V4L2 && in->in_parameters[i].ctrl.id == control_id)
+            return &in->in_parameters[i];
+    return NULL;
+}
 
-    control_s.id = control;
-    if((err = xioctl(vd->fd, VIDIOC_G_CTRL, &control_s)) < 0) {
-        return -1;
-    }
+/******************************************************************************
+Description.: Read the value of a control from the cache instead of the
+              device, each control ioctl is a request to the camera, which
+              may take several milliseconds on USB. The values are read when
+              the controls are enumerated, updated when they are set and
+              kept up to date by the change events of the driver, see
+              v4l2SubscribeControls().
+Input Value.: * vd........: the device
+              * control_id: id of the control
+              * plugin_number, pglobal: the input of the device
+Return Value: the value, -1 if the input has no such control
+******************************************************************************/
+int v4l2GetControl(struct vdIn *vd, int control_id, int plugin_number, globals *pglobal)
+{
+    control *ctrl = find_control(pglobal, plugin_number, control_id);
 
-    return control_s.value;
+    if(ctrl == NULL)
+        return -1;
+    return ctrl->value;
 }
 
 int v4l2SetControl(struct vdIn *vd, int control_id, int value, int plugin_number, globals *pglobal)
@@ -696,6 +921,11 @@ int v4l2SetControl(struct vdIn *vd, int control_id, int value, int plugin_number
 
     if (got == 0) { // we have found the control with the specified id
         DBG("V4L2 ctrl 0x%08x found\n", control_id);
+        /* the cached value is the current one while the events arrive */
+        if (vd->ctrl_events && pglobal->in[plugin_number].in_parameters[i].value == value) {
+            DBG("V4L2 ctrl 0x%08x has the value %d already\n", control_id, value);
+            return 0;
+        }
         if (pglobal->in[plugin_number].in_parameters[i].class_id == V4L2_CTRL_CLASS_USER) {
             DBG("Control type: USER\n");
             min = pglobal->in[plugin_number].in_parameters[i].ctrl.minimum;
@@ -747,6 +977,7 @@ int v4l2SetControl(struct vdIn *vd, int control_id, int value, int plugin_number
                 return -1;
             } else {
                 DBG("control id: 0x%08x new value: %d\n", ext_ctrl.id, ext_ctrl.value);
+                pglobal->in[plugin_number].in_parameters[i].value = value;
             }
             return 0;
         }
@@ -756,6 +987,153 @@ int v4l2SetControl(struct vdIn *vd, int control_id, int value, int plugin_number
     }
 }
 
+/******************************************************************************
+Description.: Set several controls with a single VIDIOC_S_EXT_CTRLS, the
+              driver takes the request as a whole instead of one request to
+              the camera per control. Drivers that refuse the request, e.g.
+              because they take only controls of one class at once, get the
+              controls one after the other.
+Input Value.: * vd.....: the device
+              * ctrls..: id and value of the controls, in the order they
+                         would be set one by one
+              * results: receives 0 or -1 for each control
+              * count..: number of controls
+              * plugin_number, pglobal: the input of the device
+Return Value: 0 if all controls were set, -1 otherwise
+******************************************************************************/
+int v4l2SetControls(struct vdIn *vd, const struct v4l2_ext_control *ctrls, int *results, int count, int plugin_number, globals *pglobal)
+{
+    struct v4l2_ext_controls ext_ctrls;
+    struct v4l2_ext_control *batch;
+    control *ctrl;
+    int i, j, n = 0, ret = 0;
+
+    if((batch = calloc(count, sizeof(struct v4l2_ext_control))) == NULL)
+        return -1;
+
+    for(i = 0; i < count; i++) {
+        results[i] = -1;
+        if((ctrl = find_control(pglobal, plugin_number, ctrls[i].id)) == NULL) {
+            LOG("Invalid V4L2_set_control request for the id: 0x%08x. Control cannot be found in the list\n", ctrls[i].id);
+            continue;
+        }
+        if(ctrls[i].value < ctrl->ctrl.minimum || ctrls[i].value > ctrl->ctrl.maximum) {
+            LOG("Value (%d) out of range (%d .. %d)\n", ctrls[i].value, ctrl->ctrl.minimum, ctrl->ctrl.maximum);
+            continue;
+        }
+        results[i] = 0;
+
+        /* a control given twice gets the last value, as if set one by one */
+        for(j = 0; j < n && batch[j].id != ctrls[i].id; j++);
+        if(j == n)
+            n++;
+        batch[j].id = ctrls[i].id;
+        if(ctrl->ctrl.type == V4L2_CTRL_TYPE_INTEGER64)
+            batch[j].value64 = ctrls[i].value;
+        else
+            batch[j].value = ctrls[i].value;
+    }
+
+    if(n > 0) {
+        memset(&ext_ctrls, 0, sizeof(struct v4l2_ext_controls));
+        ext_ctrls.count = n;
+        ext_ctrls.controls = batch;
+        if(xioctl(vd->fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls) == 0) {
+            for(i = 0; i < count; i++)
+                if(results[i] == 0)
+                    find_control(pglobal, plugin_number, ctrls[i].id)->value = ctrls[i].value;
+        } else {
+            DBG("VIDIOC_S_EXT_CTRLS failed at control %d of %d, setting them one by one\n", ext_ctrls.error_idx, n);
+            for(i = 0; i < count; i++)
+                if(results[i] == 0 && v4l2SetControl(vd, ctrls[i].id, ctrls[i].value, plugin_number, pglobal) != 0)
+                    results[i] = -1;
+        }
+    }
+
+    free(batch);
+    for(i = 0; i < count; i++)
+        if(results[i] != 0)
+            ret = -1;
+    return ret;
+}
+
+/******************************************************************************
+Description.: Subscribe to the change events of the V4L2 controls, so the
+              cached values follow the changes the camera or other programs
+              make, e.g. a control that becomes inactive or changes with an
+              automatic mode. The events are signalled as POLLPRI on the
+              device and read with v4l2ControlEvents().
+Input Value.: * vd...: the device
+              * plugin_number, pglobal: the input of the device
+Return Value: number of controls subscribed, 0 if the driver has no events
+******************************************************************************/
+int v4l2SubscribeControls(struct vdIn *vd, int plugin_number, globals *pglobal)
+{
+    input *in = &pglobal->in[plugin_number];
+    struct v4l2_event_subscription sub;
+    int i;
+
+    vd->ctrl_events = 0;
+    for(i = 0; i < in->parametercount; i++) {
+        if(in->in_parameters[i].group != IN_CMD_V4L2)
+            continue;
+
+        memset(&sub, 0, sizeof(struct v4l2_event_subscription));
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = in->in_parameters[i].ctrl.id;
+        if(xioctl(vd->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0) {
+            DBG("Unable to subscribe to the events of %s: %s\n", in->in_parameters[i].ctrl.name, strerror(errno));
+            continue;
+        }
+        vd->ctrl_events++;
+    }
+
+    return vd->ctrl_events;
+}
+
+/******************************************************************************
+Description.: Read the pending control events and update the cached values,
+              flags and ranges of the controls. Never waits for an event.
+Input Value.: * vd...: the device
+              * plugin_number, pglobal: the input of the device
+Return Value: number of events read
+******************************************************************************/
+int v4l2ControlEvents(struct vdIn *vd, int plugin_number, globals *pglobal)
+{
+    struct pollfd pfd = { .fd = vd->fd, .events = POLLPRI };
+    struct v4l2_event ev;
+    control *ctrl;
+    int n = 0;
+
+    do {
+        /* the device is opened blocking, DQEVENT would wait for the next event */
+        if(poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI))
+            break;
+
+        memset(&ev, 0, sizeof(struct v4l2_event));
+        if(xioctl(vd->fd, VIDIOC_DQEVENT, &ev) < 0)
+            break;
+        n++;
+
+        if(ev.type != V4L2_EVENT_CTRL || (ctrl = find_control(pglobal, plugin_number, ev.id)) == NULL)
+            continue;
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE) {
+            ctrl->value = (ev.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64) ? ev.u.ctrl.value64 : ev.u.ctrl.value;
+            DBG("V4L2 ctrl 0x%08x changed to %d\n", ev.id, ctrl->value);
+        }
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_FLAGS)
+            ctrl->ctrl.flags = ev.u.ctrl.flags;
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE) {
+            ctrl->ctrl.minimum = ev.u.ctrl.minimum;
+            ctrl->ctrl.maximum = ev.u.ctrl.maximum;
+            ctrl->ctrl.step = ev.u.ctrl.step;
+            ctrl->ctrl.default_value = ev.u.ctrl.default_value;
+        }
+    } while(ev.pending > 0);
+
+    return n;
+}
+
 int v4l2ResetControl(struct vdIn *vd, int control)
 {
     struct v4l2_control control_s;
@@ -888,44 +1266,49 @@ void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglob
     pglobal->in[id].parametercount++;
 }
 
-/*  It should set the capture resolution
-    Cheated from the openCV cap_libv4l.cpp the method is the following:
-    Turn off the stream (video_disable)
-    Unmap buffers
-    Close the filedescriptor
-    Initialize the camera again with the new resolution
-*/
-int setResolution(struct vdIn *vd, int width, int height)
+/******************************************************************************
+Description.: Change the resolution and format while the device stays open:
+              stream off, free the buffers, negotiate the new format and frame
+              rate, map new buffers and stream on again. If the driver refuses
+              the new format the previous one is restored. No other thread may
+              dequeue frames meanwhile.
+Input Value.: * vd....: the device
+              * width.: the new width
+              * height: the new height
+              * format: the new pixel format
+Return Value: 0 if OK, -1 if the previous format is used again, -2 if that
+              failed as well and the device does not stream anymore
+******************************************************************************/
+int setFormat(struct vdIn *vd, int width, int height, int format)
 {
-    int ret;
-    DBG("setResolution(%d, %d)\n", width, height);
+    int old_width = vd->width, old_height = vd->height, old_format = vd->formatIn;
+    DBG("setFormat(%d, %d, %d)\n", width, height, format);
 
+    /* the device stays open, the driver only reallocates its buffers */
+    if(vd->streamingState == STREAMING_ON && video_disable(vd, STREAMING_PAUSED) != 0) {
+        DBG("Unable to disable streaming\n");
+        return -1;
+    }
     vd->streamingState = STREAMING_PAUSED;
-    if(video_disable(vd, STREAMING_PAUSED) == 0) {  // do streamoff
-        DBG("Unmap buffers\n");
-        int i;
-        for(i = 0; i < NB_BUFFER; i++)
-            munmap(vd->mem[i], vd->buf.length);
+    unmap_buffers(vd);
 
-        if(CLOSE_VIDEO(vd->fd) == 0) {
-            DBG("Device closed successfully\n");
-        }
+    vd->width = width;
+    vd->height = height;
+    vd->formatIn = format;
+    if(set_format(vd) == 0 && map_buffers(vd) == 0 && video_enable(vd) == 0)
+        return 0;
 
-        vd->width = width;
-        vd->height = height;
-        if(init_v4l2(vd) < 0) {
-            fprintf(stderr, " Init v4L2 failed !! exit fatal \n");
-            return -1;
-        } else {
-            DBG("reinit done\n");
-            video_enable(vd);
-            return 0;
-        }
-    } else {
-        DBG("Unable to disable streaming\n");
+    /* go back to the format that worked */
+    fprintf(stderr, "Unable to switch to %dx%d, restoring %dx%d\n", width, height, old_width, old_height);
+    unmap_buffers(vd);
+    vd->width = old_width;
+    vd->height = old_height;
+    vd->formatIn = old_format;
+    if(set_format(vd) == 0 && map_buffers(vd) == 0 && video_enable(vd) == 0)
         return -1;
-    }
-    return ret;
+
+    vd->streamingState = STREAMING_OFF;
+    return -2;
 }
 
 /*
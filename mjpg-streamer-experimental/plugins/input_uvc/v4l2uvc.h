@@ -42,6 +42,10 @@
 
 #include "../../mjpg_streamer.h"
 #define NB_BUFFER 4
+#define NB_BUFFER_MAX 32
+
+/* size of the metadata published with each frame */
+#define METADATA_SIZE 320
 
 
 #define IOCTL_RETRY 4
@@ -82,9 +86,26 @@ struct vdIn {
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
-    unsigned char *tmpbuffer;
-    unsigned char *framebuffer;
+    void *mem[NB_BUFFER_MAX];
+    unsigned int length[NB_BUFFER_MAX];
+    int buffers;                /* buffers to request, 0 for NB_BUFFER */
+    int nbuffers;               /* number of mapped buffers */
+    int zerocopy;               /* publish MJPEG and H.264 frames from the mapped buffers */
+    int published;              /* buffer the consumers currently read, -1 if none */
+    int latest;                 /* skip to the newest frame the driver has ready */
+    long long sequence;         /* sequence number of the last frame, -1 after STREAMON */
+    unsigned long drained;      /* older frames given back unread in latest mode */
+    unsigned long dropped;      /* frames the driver dropped, gaps in the sequence */
+    struct timeval timestamp;   /* of the last frame */
+    unsigned long intervals;    /* frame intervals measured */
+    long interval;              /* mean frame interval in us */
+    long jitter;                /* mean deviation from it in us */
+    long interval_min, interval_max;
+    unsigned long switches;     /* changes of the format at runtime */
+    long switch_time;           /* duration of the last one in us */
+    int dht;                    /* the MJPEG frames carry Huffman tables, -1 if not known yet */
+    int dht_at;                 /* offset of the frame header, the tables go there if not */
+    int ctrl_events;            /* controls whose changes the driver reports */
     streaming_state streamingState;
     int grabmethod;
     int width;
@@ -109,8 +130,6 @@ struct vdIn {
     int framecount;
     int recordstart;
     int recordtime;
-    uint32_t tmpbytesused;
-    struct timeval tmptimestamp;
     v4l2_std_id vstd;
     unsigned long frame_period_time; // in ms
     unsigned char soft_framedrop;
@@ -140,22 +159,47 @@ typedef struct {
     int id;
     globals *pglobal;
     pthread_t threadID;
-    pthread_mutex_t controls_mutex;
+    pthread_mutex_t controls_mutex; /* held while controls are set or their events read */
+    pthread_mutex_t grab_mutex; /* held while a frame is grabbed or the format changes */
     struct vdIn *videoIn;
+    unsigned char *buffer;      /* copied and compressed frames are published from here */
+    int buffer_size;            /* grows with the resolution, never shrinks */
+    char metadata[METADATA_SIZE]; /* capture counters published with each frame */
+    struct _encoder *encoder;   /* compresses YUV and RGB frames, NULL for MJPEG and H.264 */
+    int encoder_threads;
+    int quality;                /* of the encoder */
+    unsigned int every;         /* publish only every n-th frame */
+    unsigned int every_count;   /* frames dropped since the last published one */
+    unsigned int minimum_size;  /* drop smaller MJPEG frames */
     context_settings *init_settings;
+    int shared_capture;         /* grabbed by the capture thread of all cameras */
+    int capture_fd;             /* fd registered with that thread, -1 if none */
+    int capture_busy;           /* that thread grabs without holding its mutex */
+    long capture_retry;         /* monotonic ms before a busy camera is polled again, 0 if not busy */
 } context;
 
+int cam_grab(context *pcontext);
+int cam_trygrab(context *pcontext);
+void cam_events(context *pcontext);
+
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd);
 void enumerateControls(struct vdIn *vd, globals *pglobal, int id);
 void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglobal, int id);
-int setResolution(struct vdIn *vd, int width, int height);
-
-int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
-int uvcGrab(struct vdIn *vd);
+int setFormat(struct vdIn *vd, int width, int height, int format);
+
+int huffman_insert(struct vdIn *vd, const unsigned char *frame, int size,
+                   const unsigned char **dht, int *dht_size);
+int h264_keyframe(const unsigned char *frame, int size);
+int uvcStart(struct vdIn *vd);
+int uvcDequeue(struct vdIn *vd);
+int uvcRequeue(struct vdIn *vd, int index);
 int close_v4l2(struct vdIn *vd);
 
-int v4l2GetControl(struct vdIn *vd, int control);
+int v4l2GetControl(struct vdIn *vd, int control, int plugin_number, globals *pglobal);
 int v4l2SetControl(struct vdIn *vd, int control, int value, int plugin_number, globals *pglobal);
+int v4l2SetControls(struct vdIn *vd, const struct v4l2_ext_control *ctrls, int *results, int count, int plugin_number, globals *pglobal);
+int v4l2SubscribeControls(struct vdIn *vd, int plugin_number, globals *pglobal);
+int v4l2ControlEvents(struct vdIn *vd, int plugin_number, globals *pglobal);
 int v4l2UpControl(struct vdIn *vd, int control);
 int v4l2DownControl(struct vdIn *vd, int control);
 int v4l2ToggleControl(struct vdIn *vd, int control);
@@ -116,8 +116,8 @@ void *worker_thread(void *arg)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        frame_size = input_frame_size(&pglobal->in[input_number]);
+        input_copy_frame(&pglobal->in[input_number], frame);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
@@ -218,7 +218,7 @@ void *worker_thread(void *arg)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_frame_size(&pglobal->in[input_number]);
 
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -235,7 +235,7 @@ void *worker_thread(void *arg)
         }
 
         /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -558,7 +558,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                         return -1;
                                     }
                                     /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
+                                    frame_size = input_frame_size(&pglobal->in[input_number]);
 
                                     /* check if buffer for frame is large enough, increase it if necessary */
                                     if(frame_size > max_frame_size) {
@@ -575,7 +575,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                     }
 
                                     /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+                                    input_copy_frame(&pglobal->in[input_number], frame);
 
                                     /* allow others to access the global buffer again */
                                     pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -0,0 +1,586 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "httpd.h"
+
+/* file name extensions of precompressed siblings, e.g. "jquery.js.gz" */
+static const char *encoding_extension[ENC_COUNT] = { "", ".gz", ".br" };
+static const char *encoding_name[ENC_COUNT] = { NULL, "gzip", "br" };
+
+/******************************************************************************
+Description.: Look up the mimetype of a file by its extension
+Input Value.: name of the file
+Return Value: the mimetype or NULL if the file type is not served
+******************************************************************************/
+static const char *lookup_mimetype(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+    int i;
+
+    if(extension == NULL || extension == name)
+        return NULL;
+
+    for(i = 0; i < LENGTH_OF(mimetypes); i++) {
+        if(strcmp(mimetypes[i].dot_extension, extension) == 0)
+            return mimetypes[i].mimetype;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Read a regular file completely into memory
+Input Value.: * path: absolute path of the file
+              * st..: filled with the status of the file
+Return Value: allocated buffer or NULL if the file could not be read or is
+              larger than FILECACHE_MAX_FILE
+******************************************************************************/
+static char *read_file(const char *path, struct stat *st)
+{
+    char *data;
+    ssize_t rc;
+    size_t done = 0;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if(fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_size > FILECACHE_MAX_FILE ||
+       (data = malloc(st->st_size + 1)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    while(done < st->st_size) {
+        if((rc = read(fd, data + done, st->st_size - done)) <= 0) {
+            if(rc < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        done += rc;
+    }
+    close(fd);
+
+    /* the file changed while reading it, the next inotify event reloads it */
+    if(done != st->st_size) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+#ifdef HAVE_ZLIB
+/******************************************************************************
+Description.: Compress a buffer to the gzip format
+Input Value.: * data.....: the uncompressed content
+              * size.....: size of the content
+              * out_size.: set to the size of the compressed content
+Return Value: allocated buffer or NULL on error
+******************************************************************************/
+static char *gzip_data(const char *data, size_t size, size_t *out_size)
+{
+    z_stream zs;
+    char *out;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 added to the window bits selects the gzip wrapper */
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    if((out = malloc(deflateBound(&zs, size))) != NULL) {
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = size;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = deflateBound(&zs, size);
+
+        if(deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+            *out_size = zs.total_out;
+        } else {
+            free(out);
+            out = NULL;
+        }
+    }
+    deflateEnd(&zs);
+
+    return out;
+}
+#endif
+
+/******************************************************************************
+Description.: Free a cached file with all its variants
+Input Value.: file to free
+Return Value: -
+******************************************************************************/
+static void free_file(cached_file *file)
+{
+    int i;
+
+    for(i = 0; i < ENC_COUNT; i++) {
+        free(file->variant[i].data);
+        free(file->variant[i].header);
+    }
+    free(file->name);
+    free(file);
+}
+
+/******************************************************************************
+Description.: Memory used by the content of a cached file
+Input Value.: the file
+Return Value: sum of the sizes of all variants
+******************************************************************************/
+static size_t file_size(cached_file *file)
+{
+    size_t size = 0;
+    int i;
+
+    for(i = 0; i < ENC_COUNT; i++)
+        size += file->variant[i].size;
+
+    return size;
+}
+
+/******************************************************************************
+Description.: Load a file of the www-folder together with its precompressed
+              siblings. Text files without a ".gz" sibling get compressed
+              here if zlib is available. The headers of all variants are
+              prepared, so a request just has to prepend the status line.
+Input Value.: * cache: the cache the file is loaded for
+              * name.: file name relative to the www-folder
+Return Value: the file with a reference count of 1 or NULL if the file does
+              not exist or is not cacheable
+******************************************************************************/
+static cached_file *load_file(filecache *cache, const char *name)
+{
+    char path[PATH_MAX], header[512];
+    const char *mimetype;
+    cached_file *file;
+    cached_variant *v;
+    struct stat st, base;
+    struct tm tm;
+    size_t total;
+    int i, vary = 0;
+
+    if((mimetype = lookup_mimetype(name)) == NULL)
+        return NULL;
+
+    if((file = calloc(1, sizeof(cached_file))) == NULL)
+        return NULL;
+    file->refcount = 1;
+
+    if((file->name = strdup(name)) == NULL)
+        goto fail;
+
+    for(i = 0; i < ENC_COUNT; i++) {
+        v = &file->variant[i];
+        snprintf(path, sizeof(path), "%s%s%s", cache->folder, name, encoding_extension[i]);
+        if((v->data = read_file(path, &st)) == NULL) {
+            if(i == ENC_IDENTITY)
+                goto fail;
+            continue;
+        }
+        v->size = st.st_size;
+        if(i == ENC_IDENTITY)
+            base = st;
+
+        /* the ETag differs for each variant, but changes with each of the files */
+        snprintf(v->etag, sizeof(v->etag), "\"%lx-%lx%s%s\"", (unsigned long)st.st_mtime,
+                 (unsigned long)st.st_size, (i == ENC_IDENTITY) ? "" : "-", (i == ENC_IDENTITY) ? "" : encoding_name[i]);
+        vary |= (i != ENC_IDENTITY);
+    }
+
+    #ifdef HAVE_ZLIB
+    v = &file->variant[ENC_GZIP];
+    if(v->data == NULL && (strncmp(mimetype, "text/", 5) == 0 || strcmp(mimetype, "application/json") == 0)) {
+        if((v->data = gzip_data(file->variant[ENC_IDENTITY].data, file->variant[ENC_IDENTITY].size, &v->size)) != NULL) {
+            /* not worth the effort for small or incompressible files */
+            if(v->size >= file->variant[ENC_IDENTITY].size) {
+                free(v->data);
+                v->data = NULL;
+                v->size = 0;
+            } else {
+                snprintf(v->etag, sizeof(v->etag), "\"%lx-%lx-gzip\"",
+                         (unsigned long)base.st_mtime, (unsigned long)base.st_size);
+                vary = 1;
+            }
+        }
+    }
+    #endif
+
+    /* the watcher thread changes the total while it replaces files */
+    pthread_mutex_lock(&cache->mutex);
+    total = cache->total;
+    pthread_mutex_unlock(&cache->mutex);
+
+    if(total + file_size(file) > FILECACHE_MAX_TOTAL) {
+        DBG("cache is full, serving %s from disk\n", name);
+        goto fail;
+    }
+
+    gmtime_r(&base.st_mtime, &tm);
+    strftime(file->last_modified, sizeof(file->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    for(i = 0; i < ENC_COUNT; i++) {
+        v = &file->variant[i];
+        if(v->data == NULL)
+            continue;
+
+        snprintf(header, sizeof(header), "Content-type: %s\r\n" \
+                 "Content-Length: %lu\r\n" \
+                 "%s%s%s" \
+                 "%s" \
+                 "ETag: %s\r\n" \
+                 "Last-Modified: %s\r\n" \
+                 CACHED_HEADER,
+                 mimetype, (unsigned long)v->size,
+                 (i == ENC_IDENTITY) ? "" : "Content-Encoding: ",
+                 (i == ENC_IDENTITY) ? "" : encoding_name[i],
+                 (i == ENC_IDENTITY) ? "" : "\r\n",
+                 vary ? "Vary: Accept-Encoding\r\n" : "",
+                 v->etag, file->last_modified);
+        if((v->header = strdup(header)) == NULL)
+            goto fail;
+    }
+
+    DBG("cached %s (%lu bytes, gzip: %lu, br: %lu)\n", name, (unsigned long)file->variant[ENC_IDENTITY].size,
+        (unsigned long)file->variant[ENC_GZIP].size, (unsigned long)file->variant[ENC_BROTLI].size);
+
+    return file;
+
+fail:
+    free_file(file);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Position of a file in the sorted table, the caller must hold
+              the mutex of the cache
+Input Value.: * cache: the cache
+              * name.: file name to look for
+              * found: set to 1 if the file is in the table
+Return Value: index of the file or the index to insert it at
+******************************************************************************/
+static int find_file(filecache *cache, const char *name, int *found)
+{
+    int low = 0, high = cache->count - 1, mid, cmp;
+
+    *found = 0;
+    while(low <= high) {
+        mid = (low + high) / 2;
+        if((cmp = strcmp(cache->files[mid]->name, name)) == 0) {
+            *found = 1;
+            return mid;
+        }
+        if(cmp < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+/******************************************************************************
+Description.: Replace the cached version of a file. Clients that are still
+              sending the old version keep it until they release it.
+Input Value.: * cache: the cache
+              * name.: file name
+              * file.: the new version or NULL to remove the file
+Return Value: -
+******************************************************************************/
+static void replace_file(filecache *cache, const char *name, cached_file *file)
+{
+    cached_file *old = NULL, **files;
+    int i, found;
+
+    pthread_mutex_lock(&cache->mutex);
+    i = find_file(cache, name, &found);
+
+    if(found) {
+        old = cache->files[i];
+        cache->total -= file_size(old);
+        if(file != NULL) {
+            cache->files[i] = file;
+        } else {
+            memmove(&cache->files[i], &cache->files[i + 1], (cache->count - i - 1) * sizeof(cached_file *));
+            cache->count--;
+        }
+    } else if(file != NULL) {
+        if((files = realloc(cache->files, (cache->count + 1) * sizeof(cached_file *))) == NULL) {
+            pthread_mutex_unlock(&cache->mutex);
+            free_file(file);
+            return;
+        }
+        cache->files = files;
+        memmove(&cache->files[i + 1], &cache->files[i], (cache->count - i) * sizeof(cached_file *));
+        cache->files[i] = file;
+        cache->count++;
+    }
+
+    if(file != NULL)
+        cache->total += file_size(file);
+
+    if(old != NULL && --old->refcount > 0)
+        old = NULL;
+    pthread_mutex_unlock(&cache->mutex);
+
+    if(old != NULL)
+        free_file(old);
+}
+
+/******************************************************************************
+Description.: Reload a file after inotify reported a change. Changes of a
+              precompressed sibling reload the file it belongs to.
+Input Value.: * cache: the cache
+              * name.: name of the changed file
+Return Value: -
+******************************************************************************/
+static void refresh_file(filecache *cache, const char *name)
+{
+    char base[NAME_MAX + 1];
+    size_t len = strlen(name);
+    int i;
+
+    snprintf(base, sizeof(base), "%s", name);
+    for(i = 1; i < ENC_COUNT; i++) {
+        size_t ext = strlen(encoding_extension[i]);
+        if(len > ext && strcmp(name + len - ext, encoding_extension[i]) == 0) {
+            base[len - ext] = '\0';
+            break;
+        }
+    }
+
+    if(lookup_mimetype(base) == NULL)
+        return;
+
+    DBG("refreshing cached file %s\n", base);
+    replace_file(cache, base, load_file(cache, base));
+}
+
+/******************************************************************************
+Description.: Keeps the cache in sync with the www-folder
+Input Value.: arg is the cache
+Return Value: always NULL
+******************************************************************************/
+static void *watcher_thread(void *arg)
+{
+    filecache *cache = arg;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    struct pollfd pfd;
+    ssize_t len;
+    char *p;
+
+    pfd.fd = cache->inotify_fd;
+    pfd.events = POLLIN;
+
+    while(!cache->stop) {
+        /* wake up from time to time to notice the stop flag */
+        if(poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        if((len = read(cache->inotify_fd, buffer, sizeof(buffer))) <= 0)
+            continue;
+
+        for(p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)p;
+            if(event->len > 0)
+                refresh_file(cache, event->name);
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Compare function for qsort
+******************************************************************************/
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp((*(cached_file **)a)->name, (*(cached_file **)b)->name);
+}
+
+/******************************************************************************
+Description.: Load all servable files of the www-folder and start watching
+              the folder for changes
+Input Value.: * cache.: the cache to initialize
+              * folder: the www-folder, ending with a "/"
+Return Value: 0 on success, -1 if the folder can not be watched. In that case
+              nothing is cached and files are read for each request.
+******************************************************************************/
+int filecache_init(filecache *cache, const char *folder)
+{
+    cached_file *file, **files;
+    struct dirent *entry;
+    DIR *dir;
+
+    memset(cache, 0, sizeof(filecache));
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    if((cache->folder = strdup(folder)) == NULL)
+        return -1;
+
+    /* watch first, so changes during loading are not missed */
+    if((cache->inotify_fd = inotify_init1(IN_CLOEXEC)) < 0 ||
+       inotify_add_watch(cache->inotify_fd, folder, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        perror("inotify");
+        goto fail;
+    }
+
+    if((dir = opendir(folder)) == NULL) {
+        perror("opendir");
+        goto fail;
+    }
+
+    while((entry = readdir(dir)) != NULL) {
+        if((file = load_file(cache, entry->d_name)) == NULL)
+            continue;
+        if((files = realloc(cache->files, (cache->count + 1) * sizeof(cached_file *))) == NULL) {
+            free_file(file);
+            break;
+        }
+        cache->files = files;
+        cache->files[cache->count++] = file;
+        cache->total += file_size(file);
+    }
+    closedir(dir);
+
+    qsort(cache->files, cache->count, sizeof(cached_file *), compare_files);
+
+    if(pthread_create(&cache->watcher, NULL, watcher_thread, cache) != 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    filecache_free(cache);
+    return -1;
+}
+
+/******************************************************************************
+Description.: Stop watching the www-folder and release the cached files
+Input Value.: cache to free
+Return Value: -
+******************************************************************************/
+void filecache_free(filecache *cache)
+{
+    int i;
+
+    if(cache->watcher) {
+        cache->stop = 1;
+        pthread_join(cache->watcher, NULL);
+        cache->watcher = 0;
+    }
+
+    if(cache->inotify_fd > 0)
+        close(cache->inotify_fd);
+    cache->inotify_fd = -1;
+
+    for(i = 0; i < cache->count; i++) {
+        if(--cache->files[i]->refcount == 0)
+            free_file(cache->files[i]);
+    }
+    free(cache->files);
+    cache->files = NULL;
+    cache->count = 0;
+
+    free(cache->folder);
+    cache->folder = NULL;
+}
+
+/******************************************************************************
+Description.: Look up a file, the caller has to release it with filecache_put
+Input Value.: * cache: the cache
+              * name.: file name relative to the www-folder
+Return Value: the file or NULL if it is not cached
+******************************************************************************/
+cached_file *filecache_get(filecache *cache, const char *name)
+{
+    cached_file *file = NULL;
+    int i, found;
+
+    pthread_mutex_lock(&cache->mutex);
+    i = find_file(cache, name, &found);
+    if(found) {
+        file = cache->files[i];
+        file->refcount++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    return file;
+}
+
+/******************************************************************************
+Description.: Release a file returned by filecache_get
+Input Value.: * cache: the cache
+              * file.: the file
+Return Value: -
+******************************************************************************/
+void filecache_put(filecache *cache, cached_file *file)
+{
+    int unused;
+
+    pthread_mutex_lock(&cache->mutex);
+    unused = (--file->refcount == 0);
+    pthread_mutex_unlock(&cache->mutex);
+
+    if(unused)
+        free_file(file);
+}
+
+/******************************************************************************
+Description.: Select the variant of a file to send
+Input Value.: * file....: the file
+              * accepted: bit mask of content codings the client accepts,
+                          (1 << ENC_GZIP) etc.
+Return Value: the smallest acceptable variant
+******************************************************************************/
+cached_variant *filecache_variant(cached_file *file, int accepted)
+{
+    if((accepted & (1 << ENC_BROTLI)) && file->variant[ENC_BROTLI].data != NULL)
+        return &file->variant[ENC_BROTLI];
+
+    if((accepted & (1 << ENC_GZIP)) && file->variant[ENC_GZIP].data != NULL)
+        return &file->variant[ENC_GZIP];
+
+    return &file->variant[ENC_IDENTITY];
+}
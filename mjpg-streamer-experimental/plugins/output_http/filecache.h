@@ -0,0 +1,86 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Files larger than this are not cached but sent with sendfile() for each
+ * request, the cache of one server instance never grows beyond the total.
+ */
+#define FILECACHE_MAX_FILE (1024*1024)
+#define FILECACHE_MAX_TOTAL (16*1024*1024)
+
+/*
+ * header lines of cached files, unlike STD_HEADER they allow the browser to
+ * store the file as long as it revalidates it with the ETag
+ */
+#define CACHED_HEADER "Server: MJPG-Streamer/0.2\r\n" \
+    "Cache-Control: no-cache\r\n"
+
+/* content codings a file may be cached in, also the bits of the request */
+enum {
+    ENC_IDENTITY,
+    ENC_GZIP,
+    ENC_BROTLI,
+    ENC_COUNT
+};
+
+/* one variant of a cached file */
+typedef struct {
+    char *data;
+    size_t size;
+    char *header;   /* entity headers, each line terminated by CRLF */
+    char etag[48];
+} cached_variant;
+
+/* a file of the www-folder, shared by all clients that request it */
+typedef struct {
+    char *name;     /* file name relative to the www-folder */
+    int refcount;   /* protected by the mutex of the cache */
+    char last_modified[40];
+    cached_variant variant[ENC_COUNT];
+} cached_file;
+
+/* the cache of one server instance */
+typedef struct {
+    char *folder;
+    cached_file **files;    /* sorted by name */
+    int count;
+    size_t total;
+    pthread_mutex_t mutex;
+
+    int inotify_fd;
+    int stop;
+    pthread_t watcher;
+} filecache;
+
+int filecache_init(filecache *cache, const char *folder);
+void filecache_free(filecache *cache);
+cached_file *filecache_get(filecache *cache, const char *name);
+void filecache_put(filecache *cache, cached_file *file);
+cached_variant *filecache_variant(cached_file *file, int accepted);
+
+#endif
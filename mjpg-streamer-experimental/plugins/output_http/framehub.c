@@ -0,0 +1,611 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "framehub.h"
+#include "transcode.h"
+
+/*
+ * One hub per input plugin. While clients are subscribed a thread copies
+ * each new frame of the input once and hands it to the schedules. All
+ * server instances of this plugin share the hubs.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    int running;                /* the hub thread is active */
+    int subscribers;
+    int refused;                /* the input publishes frames that are not JPEG */
+    unsigned long seq;
+    frame_schedule *schedules;
+    variant_stats variants[FRAMEHUB_SCALES][FRAMEHUB_RUNGS];
+} frame_hub;
+
+/* quality of the rungs in percent of the quality of the input */
+const int framehub_quality[FRAMEHUB_RUNGS] = {100, 90, 70, 50};
+
+static globals *pglobal;
+static frame_hub hubs[MAX_INPUT_PLUGINS];
+static pthread_once_t hubs_once = PTHREAD_ONCE_INIT;
+
+/******************************************************************************
+Description.: Initialize the hubs, called once
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void init_hubs(void)
+{
+    int i;
+
+    for(i = 0; i < MAX_INPUT_PLUGINS; i++) {
+        memset(&hubs[i], 0, sizeof(frame_hub));
+        pthread_mutex_init(&hubs[i].mutex, NULL);
+    }
+}
+
+/******************************************************************************
+Description.: Prepare the hubs of all inputs, safe to call from each server
+Input Value.: pglobal: the global structure of the program
+Return Value: -
+******************************************************************************/
+void framehub_init(globals *global)
+{
+    pglobal = global;
+    pthread_once(&hubs_once, init_hubs);
+}
+
+/******************************************************************************
+Description.: Drop a reference to a frame, the caller holds the hub mutex
+Input Value.: frame to release, may be NULL
+Return Value: -
+******************************************************************************/
+static void release_locked(shared_frame *frame)
+{
+    if(frame != NULL && --frame->refcount == 0)
+        free(frame);
+}
+
+/******************************************************************************
+Description.: Allocate a frame with a copy of the JPEG and the metadata
+Input Value.: * data.....: the JPEG, NULL to copy it afterwards
+              * size.....: its size
+              * timestamp: time the input captured it
+              * metadata.: metadata of the plugin or NULL
+Return Value: the frame with a refcount of 0 or NULL if there is no memory
+******************************************************************************/
+static shared_frame *alloc_frame(const unsigned char *data, int size, const struct timeval *timestamp, const char *metadata)
+{
+    shared_frame *frame;
+    size_t len = (metadata != NULL) ? strlen(metadata) + 1 : 0;
+
+    if((frame = malloc(sizeof(shared_frame) + size + len)) == NULL)
+        return NULL;
+
+    frame->refcount = 0;
+    frame->seq = 0;
+    frame->size = size;
+    frame->timestamp = *timestamp;
+    if(data != NULL)
+        memcpy(frame->data, data, size);
+
+    /* the metadata is kept behind the JPEG */
+    frame->metadata = NULL;
+    if(metadata != NULL) {
+        frame->metadata = (char *)frame->data + size;
+        memcpy(frame->metadata, metadata, len);
+    }
+
+    return frame;
+}
+
+/******************************************************************************
+Description.: Decide if a schedule accepts a frame. "every" counts the frames
+              of the input, "fps" compares the timestamps, so the rate stays
+              right even if the input drops frames. A quarter of the period
+              is tolerated as jitter.
+Input Value.: * s...: the schedule
+              * time: timestamp of the frame in seconds
+Return Value: 1 if the frame is accepted
+******************************************************************************/
+static int schedule_accepts(frame_schedule *s, double time)
+{
+    double period;
+
+    if(s->every > 1 && (s->count++ % s->every) != 0)
+        return 0;
+
+    if(s->fps > 0) {
+        period = 1.0 / s->fps;
+
+        if(time + period * 0.25 < s->due) {
+            if(s->due - time <= 2 * period)
+                return 0;
+            /* timestamps jumped backwards, e.g. a restarted input */
+            s->due = time;
+        }
+
+        s->due = (s->due + period > time) ? s->due + period : time + period;
+    }
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: Hand a frame to the clients of a rung of a schedule, the caller
+              holds the hub mutex and wakes up the clients
+Input Value.: * s....: the schedule
+              * rung.: the rung of the quality ladder
+              * frame: the frame
+Return Value: -
+******************************************************************************/
+static void deliver(frame_schedule *s, int rung, shared_frame *frame)
+{
+    release_locked(s->frame[rung]);
+    s->frame[rung] = frame;
+    frame->refcount++;
+}
+
+/******************************************************************************
+Description.: Produce a variant of a frame, called without the hub mutex so
+              that the clients of the original frame are not delayed
+Input Value.: * hub..: the hub
+              * frame: the frame to convert, of the size of the variant
+              * scale: scale the frame to 1/2^scale if rung is 0
+              * rung.: requantize the frame to the quality of this rung
+Return Value: the variant with a refcount of 0 or NULL on error
+******************************************************************************/
+static shared_frame *produce_variant(frame_hub *hub, shared_frame *frame, int scale, int rung)
+{
+    shared_frame *variant = NULL;
+    unsigned char *data;
+    unsigned long size;
+    struct timespec start, end;
+    long long usec;
+    int result;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    if(rung == 0)
+        result = transcode_scale(frame->data, frame->size, 1 << scale, &data, &size);
+    else
+        result = transcode_requantize(frame->data, frame->size, framehub_quality[rung], &data, &size);
+
+    if(result == 0) {
+        if((variant = alloc_frame(data, size, &frame->timestamp, frame->metadata)) != NULL)
+            variant->seq = frame->seq;
+        free(data);
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    pthread_mutex_lock(&hub->mutex);
+    hub->variants[scale][rung].cpu_usec += usec;
+    if(variant != NULL) {
+        hub->variants[scale][rung].frames++;
+        hub->variants[scale][rung].bytes += variant->size;
+    } else {
+        hub->variants[scale][rung].errors++;
+    }
+    pthread_mutex_unlock(&hub->mutex);
+
+    return variant;
+}
+
+/******************************************************************************
+Description.: Rungs of a schedule with clients, the caller holds the hub mutex
+Input Value.: s: the schedule
+Return Value: bit n is set if rung n has clients
+******************************************************************************/
+static int rungs_in_use(frame_schedule *s)
+{
+    int r, rungs = 0;
+
+    for(r = 0; r < FRAMEHUB_RUNGS; r++) {
+        if(s->clients[r] > 0)
+            rungs |= 1 << r;
+    }
+
+    return rungs;
+}
+
+/******************************************************************************
+Description.: Copies the frames of an input and distributes them to the
+              schedules. Each variant, a size and rung of the quality ladder,
+              is produced once per frame for all schedules that need it.
+              Leaves when the last client unsubscribed.
+Input Value.: arg is the hub
+Return Value: always NULL
+******************************************************************************/
+static void *hub_thread(void *arg)
+{
+    frame_hub *hub = arg;
+    int id = hub - hubs;
+    input *in = &pglobal->in[id];
+    shared_frame *frame, *variants[FRAMEHUB_SCALES][FRAMEHUB_RUNGS], *v;
+    frame_schedule *s;
+    struct timeval now;
+    double time;
+    int i, r, rungs, pending, needed[FRAMEHUB_SCALES], jpeg;
+
+    while(!pglobal->stop) {
+        /* wait for fresh frames */
+        pthread_mutex_lock(&in->db);
+        pthread_cond_wait(&in->db_update, &in->db);
+
+        frame = NULL;
+        if((jpeg = input_frame_jpeg(in)) &&
+           (frame = alloc_frame(NULL, input_frame_size(in), &in->timestamp, in->metadata)) != NULL)
+            input_copy_frame(in, frame->data);
+        pthread_mutex_unlock(&in->db);
+
+        pthread_mutex_lock(&hub->mutex);
+        if(hub->subscribers == 0) {
+            hub->running = 0;
+            pthread_mutex_unlock(&hub->mutex);
+            free(frame);
+            DBG("no more clients for input %d, leaving hub thread\n", id);
+            return NULL;
+        }
+
+        /* the clients can not decode other codecs, their streams end */
+        if(jpeg == hub->refused) {
+            hub->refused = !jpeg;
+            if(hub->refused) {
+                LOG("input %d does not publish JPEG frames, its streams are stopped\n", id);
+                for(s = hub->schedules; s != NULL; s = s->next)
+                    pthread_cond_broadcast(&s->update);
+            }
+        }
+
+        if(frame == NULL) {
+            pthread_mutex_unlock(&hub->mutex);
+            continue;
+        }
+
+        /* not every plugin reports timestamps */
+        if(frame->timestamp.tv_sec == 0 && frame->timestamp.tv_usec == 0) {
+            gettimeofday(&now, NULL);
+            time = now.tv_sec + now.tv_usec / 1000000.0;
+        } else {
+            time = frame->timestamp.tv_sec + frame->timestamp.tv_usec / 1000000.0;
+        }
+
+        /* the hub keeps a reference until the variants are delivered */
+        frame->seq = ++hub->seq;
+        frame->refcount = 1;
+        pending = 0;
+        memset(needed, 0, sizeof(needed));
+        for(s = hub->schedules; s != NULL; s = s->next) {
+            if(!schedule_accepts(s, time))
+                continue;
+            s->seq = frame->seq;
+            rungs = rungs_in_use(s);
+
+            /* the original frame is available right away */
+            if(s->scale == 0 && (rungs & 1)) {
+                deliver(s, 0, frame);
+                pthread_cond_broadcast(&s->update);
+                rungs &= ~1;
+            }
+
+            if(rungs) {
+                s->pending = 1;
+                needed[s->scale] |= rungs;
+                pending = 1;
+            }
+        }
+        pthread_mutex_unlock(&hub->mutex);
+
+        if(pending) {
+            /* the rungs of a size are requantized from the frame of that size */
+            memset(variants, 0, sizeof(variants));
+            for(i = 0; i < FRAMEHUB_SCALES; i++) {
+                if(!needed[i])
+                    continue;
+                variants[i][0] = (i == 0) ? frame : produce_variant(hub, frame, i, 0);
+                for(r = 1; r < FRAMEHUB_RUNGS && variants[i][0] != NULL; r++) {
+                    if(needed[i] & (1 << r))
+                        variants[i][r] = produce_variant(hub, variants[i][0], i, r);
+                }
+            }
+
+            pthread_mutex_lock(&hub->mutex);
+            for(s = hub->schedules; s != NULL; s = s->next) {
+                if(!s->pending)
+                    continue;
+                s->pending = 0;
+                rungs = rungs_in_use(s);
+                for(r = 0; r < FRAMEHUB_RUNGS; r++) {
+                    /* clients of a rung that failed get the best frame there is */
+                    v = (variants[s->scale][r] != NULL) ? variants[s->scale][r] : variants[s->scale][0];
+                    if((rungs & (1 << r)) && v != NULL && (s->scale != 0 || r != 0))
+                        deliver(s, r, v);
+                }
+                pthread_cond_broadcast(&s->update);
+            }
+            for(i = 0; i < FRAMEHUB_SCALES; i++) {
+                for(r = 0; r < FRAMEHUB_RUNGS; r++) {
+                    v = variants[i][r];
+                    if(v != NULL && v != frame && v->refcount == 0)
+                        free(v);
+                }
+            }
+            pthread_mutex_unlock(&hub->mutex);
+        }
+
+        framehub_release(id, frame);
+    }
+
+    /* wake up all clients, they notice the stop flag */
+    pthread_mutex_lock(&hub->mutex);
+    hub->running = 0;
+    for(s = hub->schedules; s != NULL; s = s->next)
+        pthread_cond_broadcast(&s->update);
+    pthread_mutex_unlock(&hub->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Subscribe a client to the frames of an input. Clients with the
+              same rate and size share a schedule. The hub thread is started
+              if this is the first client. The client starts on rung 0.
+Input Value.: * id...: number of the input plugin
+              * fps..: frames per second, 0 for all frames
+              * every: send every n-th frame, 1 for all frames
+              * scale: scale the frames to 1/2^scale, 0 for the original size
+Return Value: the schedule or NULL on error
+******************************************************************************/
+frame_schedule *framehub_subscribe(int id, int fps, int every, int scale)
+{
+    frame_hub *hub = &hubs[id];
+    frame_schedule *s;
+    pthread_t thread;
+
+    every = MAX(every, 1);
+    fps = MAX(fps, 0);
+
+    pthread_mutex_lock(&hub->mutex);
+
+    for(s = hub->schedules; s != NULL; s = s->next) {
+        if(s->fps == fps && s->every == every && s->scale == scale)
+            break;
+    }
+
+    if(s == NULL) {
+        if((s = calloc(1, sizeof(frame_schedule))) == NULL) {
+            pthread_mutex_unlock(&hub->mutex);
+            return NULL;
+        }
+        s->fps = fps;
+        s->every = every;
+        s->scale = scale;
+        s->seq = hub->seq;
+        pthread_cond_init(&s->update, NULL);
+        s->next = hub->schedules;
+        hub->schedules = s;
+    }
+
+    s->refcount++;
+    s->clients[0]++;
+    hub->subscribers++;
+
+    if(!hub->running) {
+        hub->refused = 0;
+        if(pthread_create(&thread, NULL, hub_thread, hub) != 0) {
+            pthread_mutex_unlock(&hub->mutex);
+            framehub_unsubscribe(id, s, 0);
+            return NULL;
+        }
+        pthread_detach(thread);
+        hub->running = 1;
+    }
+
+    pthread_mutex_unlock(&hub->mutex);
+
+    return s;
+}
+
+/******************************************************************************
+Description.: Take a client from a rung, the caller holds the hub mutex.
+              Frames of rungs without clients are released right away.
+Input Value.: * s...: the schedule
+              * rung: the rung the client leaves
+Return Value: -
+******************************************************************************/
+static void leave_rung(frame_schedule *s, int rung)
+{
+    if(s->clients[rung] > 0 && --s->clients[rung] == 0) {
+        release_locked(s->frame[rung]);
+        s->frame[rung] = NULL;
+    }
+}
+
+/******************************************************************************
+Description.: Unsubscribe a client, unused schedules are removed
+Input Value.: * id......: number of the input plugin
+              * schedule: returned by framehub_subscribe
+              * rung....: the rung of the client
+Return Value: -
+******************************************************************************/
+void framehub_unsubscribe(int id, frame_schedule *schedule, int rung)
+{
+    frame_hub *hub = &hubs[id];
+    frame_schedule **prev;
+
+    pthread_mutex_lock(&hub->mutex);
+
+    if(schedule->refcount > 0) {
+        schedule->refcount--;
+        hub->subscribers--;
+        leave_rung(schedule, rung);
+    }
+
+    if(schedule->refcount == 0) {
+        for(prev = &hub->schedules; *prev != NULL; prev = &(*prev)->next) {
+            if(*prev == schedule) {
+                *prev = schedule->next;
+                break;
+            }
+        }
+        pthread_cond_destroy(&schedule->update);
+        free(schedule);
+    }
+
+    pthread_mutex_unlock(&hub->mutex);
+}
+
+/******************************************************************************
+Description.: Move a client to another rung of the quality ladder. The next
+              frame the client receives has the new quality.
+Input Value.: * id......: number of the input plugin
+              * schedule: the schedule of the client
+              * from....: the current rung
+              * to......: the new rung
+Return Value: -
+******************************************************************************/
+void framehub_set_rung(int id, frame_schedule *schedule, int from, int to)
+{
+    frame_hub *hub = &hubs[id];
+
+    pthread_mutex_lock(&hub->mutex);
+    leave_rung(schedule, from);
+    schedule->clients[to]++;
+    pthread_mutex_unlock(&hub->mutex);
+}
+
+/******************************************************************************
+Description.: Wait for the next frame of a schedule
+Input Value.: * id......: number of the input plugin
+              * schedule: the schedule of the client
+              * rung....: the rung of the client
+              * seq.....: number of the last frame the client received, gets
+                          updated
+Return Value: the frame, the client must release it with framehub_release(),
+              NULL if the program stops or the input publishes no JPEG
+              frames
+******************************************************************************/
+shared_frame *framehub_wait(int id, frame_schedule *schedule, int rung, unsigned long *seq)
+{
+    return framehub_timedwait(id, schedule, rung, seq, NULL);
+}
+
+/******************************************************************************
+Description.: Wait for the next frame of a schedule until a deadline
+Input Value.: * id......: number of the input plugin
+              * schedule: the schedule of the client
+              * rung....: the rung of the client
+              * seq.....: number of the last frame the client received, gets
+                          updated
+              * deadline: CLOCK_REALTIME time to give up, NULL to wait forever
+Return Value: the frame, the client must release it with framehub_release(),
+              NULL if the program stops, the input publishes no JPEG frames
+              or the deadline passed
+******************************************************************************/
+shared_frame *framehub_timedwait(int id, frame_schedule *schedule, int rung, unsigned long *seq, const struct timespec *deadline)
+{
+    frame_hub *hub = &hubs[id];
+    shared_frame *frame = NULL;
+    int rc = 0;
+
+    pthread_mutex_lock(&hub->mutex);
+    while((schedule->frame[rung] == NULL || schedule->frame[rung]->seq <= *seq) && !pglobal->stop && !hub->refused && rc == 0) {
+        if(deadline != NULL)
+            rc = pthread_cond_timedwait(&schedule->update, &hub->mutex, deadline);
+        else
+            pthread_cond_wait(&schedule->update, &hub->mutex);
+    }
+
+    if(!pglobal->stop && !hub->refused && schedule->frame[rung] != NULL && schedule->frame[rung]->seq > *seq) {
+        frame = schedule->frame[rung];
+        frame->refcount++;
+        *seq = frame->seq;
+    }
+    pthread_mutex_unlock(&hub->mutex);
+
+    return frame;
+}
+
+/******************************************************************************
+Description.: Tell if the hub stopped the streams of an input because it
+              publishes frames that are not JPEG
+Input Value.: id: number of the input plugin
+Return Value: 1 if the frames are refused, 0 otherwise
+******************************************************************************/
+int framehub_refused(int id)
+{
+    int refused;
+
+    pthread_mutex_lock(&hubs[id].mutex);
+    refused = hubs[id].refused;
+    pthread_mutex_unlock(&hubs[id].mutex);
+
+    return refused;
+}
+
+/******************************************************************************
+Description.: Release a frame returned by framehub_wait
+Input Value.: * id...: number of the input plugin
+              * frame: the frame
+Return Value: -
+******************************************************************************/
+void framehub_release(int id, shared_frame *frame)
+{
+    pthread_mutex_lock(&hubs[id].mutex);
+    release_locked(frame);
+    pthread_mutex_unlock(&hubs[id].mutex);
+}
+
+/******************************************************************************
+Description.: Report the statistics of the variants of an input
+Input Value.: * id...: number of the input plugin
+              * stats: receives the statistics, indexed by scale and rung
+Return Value: -
+******************************************************************************/
+void framehub_stats(int id, variant_stats stats[FRAMEHUB_SCALES][FRAMEHUB_RUNGS])
+{
+    frame_hub *hub = &hubs[id];
+    frame_schedule *s;
+    int i, r;
+
+    pthread_mutex_lock(&hub->mutex);
+    for(i = 0; i < FRAMEHUB_SCALES; i++) {
+        for(r = 0; r < FRAMEHUB_RUNGS; r++) {
+            stats[i][r] = hub->variants[i][r];
+            stats[i][r].clients = 0;
+        }
+    }
+    for(s = hub->schedules; s != NULL; s = s->next) {
+        for(r = 0; r < FRAMEHUB_RUNGS; r++)
+            stats[s->scale][r].clients += s->clients[r];
+    }
+    pthread_mutex_unlock(&hub->mutex);
+}
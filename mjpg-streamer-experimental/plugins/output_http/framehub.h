@@ -0,0 +1,98 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAMEHUB_H
+#define FRAMEHUB_H
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*
+ * A frame of an input, copied once from the input plugin and shared by all
+ * stream clients. It is freed when the last client released it.
+ */
+typedef struct {
+    int refcount;               /* protected by the mutex of the hub */
+    unsigned long seq;          /* number of the frame, counted by the hub */
+    struct timeval timestamp;   /* as reported by the input plugin */
+    char *metadata;             /* metadata of the plugin, stored behind the data, or NULL */
+    int size;
+    unsigned char data[];
+} shared_frame;
+
+/*
+ * Sizes a stream can be scaled to, scale n means 1/2^n of the original size.
+ * A scaled variant is produced once per frame and only while clients use it.
+ */
+#define FRAMEHUB_SCALES 4
+
+/*
+ * Rungs of the quality ladder, rung 0 is the quality of the input. The
+ * others are requantized from the coefficients of the input frame, clients
+ * move between them depending on how fast their connection is.
+ */
+#define FRAMEHUB_RUNGS 4
+extern const int framehub_quality[FRAMEHUB_RUNGS];
+
+/* statistics of a variant, a size and quality of the frames */
+typedef struct {
+    int clients;
+    unsigned long frames;       /* frames produced */
+    unsigned long errors;       /* frames libjpeg failed to convert */
+    unsigned long long cpu_usec; /* CPU time spent on converting */
+    unsigned long long bytes;   /* size of all produced frames */
+} variant_stats;
+
+/*
+ * Decides which frames clients with the same frame rate receive. All clients
+ * asking for the same "fps", "every" and "scale" share one schedule, the
+ * frames are selected once and only the clients of a schedule that accepted
+ * a frame wake up. Each rung of the ladder that has clients gets its own
+ * variant of the frame.
+ */
+typedef struct _frame_schedule {
+    struct _frame_schedule *next;
+    int fps;                    /* frames per second, 0 for all */
+    int every;                  /* send every n-th frame, 1 for all */
+    int scale;                  /* send frames scaled to 1/2^scale */
+    int pending;                /* accepted a frame, waiting for its variants */
+    int refcount;               /* subscribed clients */
+    int clients[FRAMEHUB_RUNGS]; /* subscribed clients on each rung */
+    unsigned long count;        /* frames of the input seen */
+    double due;                 /* earliest time for the next frame if fps is set */
+    unsigned long seq;          /* number of the latest accepted frame */
+    shared_frame *frame[FRAMEHUB_RUNGS]; /* the latest accepted frame of each rung */
+    pthread_cond_t update;      /* signalled for each accepted frame */
+} frame_schedule;
+
+void framehub_init(globals *pglobal);
+frame_schedule *framehub_subscribe(int input, int fps, int every, int scale);
+void framehub_unsubscribe(int input, frame_schedule *schedule, int rung);
+void framehub_set_rung(int input, frame_schedule *schedule, int from, int to);
+shared_frame *framehub_wait(int input, frame_schedule *schedule, int rung, unsigned long *seq);
+shared_frame *framehub_timedwait(int input, frame_schedule *schedule, int rung, unsigned long *seq, const struct timespec *deadline);
+int framehub_refused(int input);
+void framehub_release(int input, shared_frame *frame);
+void framehub_stats(int input, variant_stats stats[FRAMEHUB_SCALES][FRAMEHUB_RUNGS]);
+
+#endif
@@ -30,8 +30,16 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sock_diag.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
@@ -44,7 +52,10 @@
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 
+#include "framehub.h"
 #include "httpd.h"
+#include "jsoncache.h"
+#include "websocket.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 #define V4L2_CTRL_TYPE_STRING_SUPPORTED
@@ -64,7 +75,6 @@ Return Value: iobuf
 ******************************************************************************/
 void init_iobuffer(iobuffer *iobuf)
 {
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
     iobuf->level = 0;
 }
 
@@ -76,9 +86,20 @@ Return Value: req
 void init_request(request *req)
 {
     req->type        = A_UNKNOWN;
+    req->method      = M_OTHER;
+    req->path        = NULL;
     req->parameter   = NULL;
     req->client      = NULL;
     req->credentials = NULL;
+    req->query_string = NULL;
+    req->http_minor  = 0;
+    req->connection  = CONN_DEFAULT;
+    req->accept_encoding = 0;
+    req->if_none_match = NULL;
+    req->if_modified_since = NULL;
+    req->upgrade_websocket = 0;
+    req->websocket_version = 0;
+    req->websocket_key = NULL;
 }
 
 /******************************************************************************
@@ -89,111 +110,72 @@ Return Value: -
 ******************************************************************************/
 void free_request(request *req)
 {
+    if(req->path != NULL) free(req->path);
     if(req->parameter != NULL) free(req->parameter);
     if(req->client != NULL) free(req->client);
     if(req->credentials != NULL) free(req->credentials);
     if(req->query_string != NULL) free(req->query_string);
+    if(req->if_none_match != NULL) free(req->if_none_match);
+    if(req->if_modified_since != NULL) free(req->if_modified_since);
+    if(req->websocket_key != NULL) free(req->websocket_key);
 }
 
 /******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
+Description.: Protocol version for the status line of a response. Persistent
+              connections are answered with HTTP/1.1, all other responses keep
+              the traditional HTTP/1.0.
+Input Value.: context_fd: the connection the response is sent to
+Return Value: string to use in the status line
 ******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
+static const char *http_version(cfd *context_fd)
 {
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
-
-    memset(buffer, 0, len);
-
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
-
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
-
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
-
-            /* this must be a timeout */
-            return copied;
-        }
-
-        init_iobuffer(iobuf);
-
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
-
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
-    }
+    return context_fd->keep_alive ? "HTTP/1.1" : "HTTP/1.0";
+}
 
-    return 0;
+/******************************************************************************
+Description.: "Connection" header lines of a response that may leave the
+              connection open
+Input Value.: context_fd: the connection the response is sent to
+Return Value: header lines, each terminated by CRLF
+******************************************************************************/
+static const char *connection_header(cfd *context_fd)
+{
+    return context_fd->keep_alive ? context_fd->pc->keepalive_header : CLOSE_HEADER;
 }
 
 /******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    char c = '\0', *out = buffer;
-    int i;
+Description.: Send header and body of a response with a single system call,
+              so small responses on persistent connections leave as one
+              segment.
+Input Value.: * fd.........: filedescriptor to send the answer to
+              * header.....: the complete HTTP header including the empty line
+              * body.......: content to send, may be NULL
+              * body_size..: size of content in bytes
+Return Value: 0 on success, -1 in case of an error
+******************************************************************************/
+static int write_response(int fd, const char *header, const void *body, int body_size)
+{
+    struct iovec iov[2];
+    ssize_t total, rc;
 
-    memset(buffer, 0, len);
+    iov[0].iov_base = (void *)header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = (body != NULL) ? body_size : 0;
+    total = iov[0].iov_len + iov[1].iov_len;
 
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
+    if((rc = writev(fd, iov, 2)) < 0)
+        return -1;
+
+    /* a blocking socket only returns early if a signal interrupted the call */
+    if(rc < total && rc >= iov[0].iov_len) {
+        if(write(fd, (char *)body + (rc - iov[0].iov_len), total - rc) < 0)
             return -1;
-        }
-        *out++ = c;
+    } else if(rc < total) {
+        return -1;
     }
 
-    return i;
+    return 0;
 }
 
 /******************************************************************************
@@ -305,388 +287,1892 @@ int unescape(char *string)
     return 0;
 }
 
-#ifdef MANAGMENT
+/******************************************************************************
+Description.: Find the empty line that terminates a request header. Lines may
+              end with CRLF or with a bare LF.
+Input Value.: * buffer: the received bytes
+              * from..: offset to start searching at, bytes before it were
+                        searched by an earlier call already
+              * len...: number of valid bytes in buffer
+Return Value: length of the header including the empty line or 0 if the
+              header is not complete yet
+******************************************************************************/
+static int header_end(const char *buffer, int from, int len)
+{
+    const char *p = buffer + from, *end = buffer + len;
+
+    while((p = memchr(p, '\n', end - p)) != NULL) {
+        if(p + 1 < end && p[1] == '\n')
+            return p + 2 - buffer;
+        if(p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - buffer;
+        p++;
+    }
+
+    return 0;
+}
 
 /******************************************************************************
-Description.: Adds a new client information struct to the ino list.
-Input Value.: Client IP address as a string
-Return Value: Returns with the newly added info or with a pointer to the existing item
+Description.: Remove a request that was handled from the buffer. Bytes of
+              pipelined requests move to the front of the buffer.
+Input Value.: * iobuf: the buffer of the connection
+              * len..: number of bytes to remove
+Return Value: -
 ******************************************************************************/
-client_info *add_client(char *address)
+static void consume_request(iobuffer *iobuf, int len)
+{
+    iobuf->level -= len;
+    if(iobuf->level > 0)
+        memmove(iobuf->buffer, iobuf->buffer + len, iobuf->level);
+}
+
+/******************************************************************************
+Description.: Receive until a complete request header is in the buffer of the
+              connection. Everything that is already available gets read at
+              once, so a typical request takes a single read() and a poll()
+              only if the client did not send the request yet. The timeout
+              covers the complete header, not each single read.
+Input Value.: * fd.....: fildescriptor to read from
+              * iobuf..: buffer of the connection, keeps unparsed bytes
+                         between calls
+              * timeout: seconds to wait for the complete header
+Return Value: length of the header including the terminating empty line,
+              -1 in case of timeout, error or if the client closed the
+              connection, -2 if the header does not fit into the buffer
+******************************************************************************/
+int read_request(int fd, iobuffer *iobuf, int timeout)
 {
-    unsigned int i = 0;
-    int name_length = strlen(address) + 1;
+    struct pollfd pfd;
+    struct timeval now, deadline;
+    int rc, len, searched = 0, skip, wait_ms;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout;
+
+    while(1) {
+        /* empty lines in front of a request are allowed and ignored */
+        for(skip = 0; skip < iobuf->level && (iobuf->buffer[skip] == '\r' || iobuf->buffer[skip] == '\n'); skip++);
+        if(skip > 0) {
+            consume_request(iobuf, skip);
+            searched = 0;
+        }
+
+        /* the last two bytes of the previous search may start the empty line */
+        if((len = header_end(iobuf->buffer, MAX(searched - 2, 0), iobuf->level)) > 0)
+            return len;
+        searched = iobuf->level;
+
+        if(iobuf->level >= IO_BUFFER)
+            return -2;
 
-    pthread_mutex_lock(&client_infos.mutex);
+        rc = recv(fd, iobuf->buffer + iobuf->level, IO_BUFFER - iobuf->level, MSG_DONTWAIT);
+        if(rc > 0) {
+            iobuf->level += rc;
+            continue;
+        }
+        if(rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return -1;
+
+        /* nothing to read yet, wait for the client */
+        gettimeofday(&now, NULL);
+        wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_usec - now.tv_usec) / 1000;
+        if(wait_ms <= 0)
+            return -1;
 
-    for (; i<client_infos.client_count; i++) {
-        if (strcmp(client_infos.infos[i]->address, address) == 0) {
-            pthread_mutex_unlock(&client_infos.mutex);
-            return client_infos.infos[i];
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if((rc = poll(&pfd, 1, wait_ms)) == 0)
+            return -1;
+        if(rc < 0 && errno != EINTR) {
+            DBG("poll() failed: %s\n", strerror(errno));
+            return -1;
         }
     }
+}
 
-    client_info *current_client_info = malloc(sizeof(client_info));
-    if (current_client_info == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
-    }
+/******************************************************************************
+Description.: Parse the request line, e.g. "GET /?action=stream HTTP/1.1"
+Input Value.: * line: the first line of the request, gets modified
+              * req.: the fields method, path, query_string and http_minor
+                      are set
+Return Value: 0 on success, -1 if the line is malformed
+******************************************************************************/
+static int parse_request_line(char *line, request *req)
+{
+    char *method, *target, *version, *query, *saveptr = NULL;
 
-    current_client_info->address = malloc(name_length * sizeof(char));
-    if (current_client_info->address == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
+    method = strtok_r(line, " ", &saveptr);
+    target = strtok_r(NULL, " ", &saveptr);
+    version = strtok_r(NULL, " ", &saveptr);
+
+    if(method == NULL || target == NULL || target[0] != '/')
+        return -1;
+
+    if(strcmp(method, "GET") == 0)
+        req->method = M_GET;
+    else if(strcmp(method, "POST") == 0)
+        req->method = M_POST;
+    else
+        req->method = M_OTHER;
+
+    /* requests without version are HTTP/0.9, treat them like HTTP/1.0 */
+    if(version != NULL && strncmp(version, "HTTP/1.", 7) == 0 && version[7] != '0')
+        req->http_minor = 1;
+
+    if((query = strchr(target, '?')) != NULL) {
+        *query++ = '\0';
+        req->query_string = strdup(query);
     }
+    req->path = strdup(target);
+
+    if(req->path == NULL || (query != NULL && req->query_string == NULL))
+        return -1;
+
+    return 0;
+}
 
-    strcpy(current_client_info->address, address);
-    memset(&(current_client_info->last_take_time), 0, sizeof(struct timeval)); // set last time to zero
+/******************************************************************************
+Description.: Parse the value of the "Accept-Encoding" header, e.g.
+              "gzip, deflate, br" or "gzip;q=1.0, br;q=0"
+Input Value.: value: the value of the header, gets modified
+Return Value: bit mask of accepted content codings, (1 << ENC_GZIP) etc.
+******************************************************************************/
+static int parse_accept_encoding(char *value)
+{
+    char *coding, *q, *saveptr = NULL;
+    int accepted = 0;
+
+    for(coding = strtok_r(value, ",", &saveptr); coding != NULL; coding = strtok_r(NULL, ",", &saveptr)) {
+        coding += strspn(coding, " \t");
+
+        /* a quality of zero means "not acceptable" */
+        if((q = strchr(coding, ';')) != NULL) {
+            *q++ = '\0';
+            q += strspn(q, " \t");
+            if(strncmp(q, "q=0", 3) == 0 && strspn(q + 3, ".0") == strlen(q + 3))
+                continue;
+        }
+        coding[strcspn(coding, " \t")] = '\0';
 
-    client_infos.infos = realloc(client_infos.infos, (client_infos.client_count + 1) * sizeof(client_info*));
-    client_infos.infos[client_infos.client_count] = current_client_info;
-    client_infos.client_count += 1;
+        if(strcasecmp(coding, "gzip") == 0)
+            accepted |= 1 << ENC_GZIP;
+        else if(strcasecmp(coding, "br") == 0)
+            accepted |= 1 << ENC_BROTLI;
+    }
 
-    pthread_mutex_unlock(&client_infos.mutex);
-    return current_client_info;
+    return accepted;
 }
 
 /******************************************************************************
-Description.: Looks in the client_infos for the current ip address.
-Input Value.: Client IP address as a string
-Return Value: If a frame was served to it within the specified interval it returns 1
-              If not it returns with 0
+Description.: Evaluate a single header field of the request
+Input Value.: * name.: name of the field, compared case insensitive
+              * value: value of the field without leading whitespace
+              * req..: request to store the result in
+Return Value: -
 ******************************************************************************/
-int check_client_status(client_info *client)
+static void parse_header(const char *name, char *value, request *req)
 {
-    unsigned int i = 0;
-    pthread_mutex_lock(&client_infos.mutex);
-    for (; i<client_infos.client_count; i++) {
-        if (client_infos.infos[i] == client) {
-            long msec;
-            struct timeval tim;
-            gettimeofday(&tim, NULL);
-            msec  =(tim.tv_sec - client_infos.infos[i]->last_take_time.tv_sec)*1000;
-            msec +=(tim.tv_usec - client_infos.infos[i]->last_take_time.tv_usec)/1000;
-            DBG("diff: %ld\n", msec);
-            if ((msec < 1000) && (msec > 0)) { // FIXME make it parameter
-                DBG("CHEATER\n");
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 1;
-            } else {
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 0;
-            }
+    if(strcasecmp(name, "User-Agent") == 0) {
+        free(req->client);
+        req->client = strdup(value);
+    } else if(strcasecmp(name, "Authorization") == 0 && strncasecmp(value, "Basic ", 6) == 0) {
+        free(req->credentials);
+        req->credentials = strdup(value + 6);
+        if(req->credentials != NULL) {
+            decodeBase64(req->credentials);
+            DBG("username:password: %s\n", req->credentials);
         }
+    } else if(strcasecmp(name, "Connection") == 0) {
+        if(strcasestr(value, "close") != NULL)
+            req->connection = CONN_CLOSE;
+        else if(strcasestr(value, "keep-alive") != NULL)
+            req->connection = CONN_KEEPALIVE;
+    } else if(strcasecmp(name, "Accept-Encoding") == 0) {
+        req->accept_encoding = parse_accept_encoding(value);
+    } else if(strcasecmp(name, "If-None-Match") == 0) {
+        free(req->if_none_match);
+        req->if_none_match = strdup(value);
+    } else if(strcasecmp(name, "If-Modified-Since") == 0) {
+        free(req->if_modified_since);
+        req->if_modified_since = strdup(value);
+    } else if(strcasecmp(name, "Upgrade") == 0) {
+        req->upgrade_websocket = (strcasestr(value, "websocket") != NULL);
+    } else if(strcasecmp(name, "Sec-WebSocket-Key") == 0) {
+        free(req->websocket_key);
+        req->websocket_key = strdup(value);
+    } else if(strcasecmp(name, "Sec-WebSocket-Version") == 0) {
+        req->websocket_version = atoi(value);
+    }
+}
+
+/******************************************************************************
+Description.: Parse a complete request header as returned by read_request().
+              The header gets tokenized in place, all strings the request
+              keeps are copies.
+Input Value.: * header: start of the header
+              * len...: length of the header including the empty line
+              * req...: initialized request to fill
+Return Value: 0 on success, -1 if the request is malformed
+******************************************************************************/
+int parse_request(char *header, int len, request *req)
+{
+    char *line = header, *end = header + len, *eol, *value;
+
+    /* the request line */
+    if((eol = memchr(line, '\n', end - line)) == NULL)
+        return -1;
+    *eol = '\0';
+    if(eol > line && eol[-1] == '\r')
+        eol[-1] = '\0';
+    if(parse_request_line(line, req) < 0)
+        return -1;
+
+    /* the header fields up to the empty line */
+    for(line = eol + 1; line < end; line = eol + 1) {
+        if((eol = memchr(line, '\n', end - line)) == NULL)
+            break;
+        *eol = '\0';
+        if(eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+        if(*line == '\0')
+            break;
+
+        if((value = strchr(line, ':')) == NULL)
+            continue;
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        parse_header(line, value, req);
     }
-    DBG("Client not found in the client list! How did it happend?? This is a BUG\n");
-    pthread_mutex_unlock(&client_infos.mutex);
+
     return 0;
 }
 
-void update_client_timestamp(client_info *client)
+/******************************************************************************
+Description.: Copy the allowed leading characters of a string
+Input Value.: * source.: string to copy from
+              * allowed: set of allowed characters, copying stops at the
+                         first other character
+              * maxlen.: maximum number of characters to copy
+Return Value: newly allocated string or NULL if there was not enough memory
+******************************************************************************/
+static char *copy_allowed(const char *source, const char *allowed, int maxlen)
 {
-    struct timeval tim;
-    pthread_mutex_lock(&client_infos.mutex);
-    gettimeofday(&tim, NULL);
-    memcpy(&client->last_take_time, &tim, sizeof(struct timeval));
-    pthread_mutex_unlock(&client_infos.mutex);
+    return strndup(source, MIN(strspn(source, allowed), maxlen));
 }
-#endif
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a single JPG-frame.
-Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+Description.: Determine the answer to a parsed request with the tables
+              "actions" and "paths" from httpd.h. Sets type and parameter of
+              the request.
+Input Value.: * req..........: the parsed request
+              * input_number.: set to the plugin number of the URL, e.g. 1 for
+                               "?action=stream_1", 0 if there is none
+Return Value: ROUTE_* flags of the matching entry, 0 for files and CGI scripts,
+              -1 if there was not enough memory
 ******************************************************************************/
-void send_snapshot(cfd *context_fd, int input_number)
+int route_request(request *req, int *input_number)
 {
-    unsigned char *frame = NULL;
-    int frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    const char *suffix;
+    char *action = NULL, *rest = NULL, *number = NULL;
+    size_t len;
+    int i, flags = 0;
+
+    *input_number = 0;
+
+    /* "/?action=..." */
+    if(strcmp(req->path, "/") == 0 && req->query_string != NULL &&
+       strncmp(req->query_string, "action=", 7) == 0) {
+        action = req->query_string + 7;
+        len = strcspn(action, "_&");
+        rest = action + strcspn(action, "&");
+        for(i = 0; i < LENGTH_OF(actions); i++) {
+            if(strlen(actions[i].action) == len && strncmp(action, actions[i].action, len) == 0) {
+                req->type = actions[i].type;
+                flags = actions[i].flags;
+                if(action[len] == '_')
+                    number = action + len + 1;
+                break;
+            }
+        }
+    }
 
-    /* wait for a fresh frame */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    /* the stream is also available as "POST /stream" */
+    if(req->type == A_UNKNOWN && req->method == M_POST && strncmp(req->path, "/stream", 7) == 0) {
+        req->type = A_STREAM;
+        flags = ROUTE_INPUT | ROUTE_MANAGED;
+        number = strchr(req->path, '_');
+        if(number != NULL)
+            number++;
+    }
 
-    /* read buffer */
-    frame_size = pglobal->in[input_number].size;
+    /* fixed paths like "/input_1.json" */
+    for(i = 0; req->type == A_UNKNOWN && req->method == M_GET && i < LENGTH_OF(paths); i++) {
+        len = strlen(req->path);
+        if(strncmp(req->path, paths[i].prefix, strlen(paths[i].prefix)) != 0 ||
+           len < strlen(paths[i].prefix) + strlen(paths[i].suffix))
+            continue;
+        suffix = req->path + len - strlen(paths[i].suffix);
+        if(strcmp(suffix, paths[i].suffix) != 0)
+            continue;
 
-    /* allocate a buffer for this single frame */
-    if((frame = malloc(frame_size + 1)) == NULL) {
-        free(frame);
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        send_error(context_fd->fd, 500, "not enough memory");
-        return;
+        req->type = paths[i].type;
+        flags = paths[i].flags;
+        if(req->path[strlen(paths[i].prefix)] == '_')
+            number = req->path + strlen(paths[i].prefix) + 1;
     }
-    /* copy v4l2_buffer timeval to user space */
-    timestamp = pglobal->in[input_number].timestamp;
 
-    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-    DBG("got frame (size: %d kB)\n", frame_size / 1024);
+    if(req->type == A_UNKNOWN && req->method != M_GET)
+        return 0;
 
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
+    /*
+     * Since when we are working with multiple input plugins
+     * there are some url which could have a _[plugin number suffix]
+     * For compatibility reasons it could be left in that case the output will be
+     * generated from the 0. input plugin
+     */
+    if((flags & ROUTE_INPUT) && number != NULL) {
+        *input_number = atoi(number);
+        if((req->type == A_SNAPSHOT_WXP) || (req->type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
+            (*input_number)--;
+        }
+        DBG("plugin_no: %d\n", *input_number);
+    }
 
-    #ifdef MANAGMENT
-    update_client_timestamp(context_fd->client);
-    #endif
+    if(flags & ROUTE_PARAMETER) {
+        /* only accept certain characters */
+        req->parameter = copy_allowed(rest, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./", 100);
+        if(req->parameter == NULL)
+            return -1;
+        DBG("parameter: \"%s\"\n", req->parameter);
+    }
 
-    /* write the response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-type: image/jpeg\r\n" \
-            "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
+    if(req->type != A_UNKNOWN)
+        return flags;
+
+    /* everything else is a file of the www-folder or a CGI script */
+    DBG("try to serve a file\n");
+    req->type = A_FILE;
+    req->parameter = copy_allowed(req->path + 1, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890", 100);
+    if(req->parameter == NULL)
+        return -1;
+
+    if(strstr(req->path, ".cgi") != NULL) {
+        req->type = A_CGI;
+        rest = copy_allowed((req->query_string != NULL) ? req->query_string : " ",
+                            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=& ", INT_MAX);
+        if(rest == NULL)
+            return -1;
+        free(req->query_string);
+        req->query_string = rest;
+    }
+    DBG("parameter: \"%s\"\n", req->parameter);
 
-    /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
-        free(frame);
-        return;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Find a parameter in the query string
+Input Value.: * query: the query string, may be NULL
+              * name.: name of the parameter
+Return Value: the value, terminated by '&' or '\0', NULL if it is missing
+******************************************************************************/
+static const char *query_value(const char *query, const char *name)
+{
+    const char *p = query;
+    size_t len = strlen(name);
+
+    while(p != NULL && *p != '\0') {
+        if(strncmp(p, name, len) == 0 && p[len] == '=')
+            return p + len + 1;
+        if((p = strchr(p, '&')) != NULL)
+            p++;
     }
 
-    free(frame);
+    return NULL;
 }
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a stream of JPG-frames.
-Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+Description.: Read a numeric parameter from the query string
+Input Value.: * query: the query string, may be NULL
+              * name.: name of the parameter
+              * value: value if the parameter is missing or invalid
+Return Value: the value of the parameter
 ******************************************************************************/
-void send_stream(cfd *context_fd, int input_number)
+static int query_int(const char *query, const char *name, int value)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    const char *p = query_value(query, name);
+    char *end;
+    long number;
 
-    DBG("preparing header\n");
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
-            "\r\n" \
-            "--" BOUNDARY "\r\n");
+    if(p == NULL)
+        return value;
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
-        return;
-    }
+    number = strtol(p, &end, 10);
+    if(end != p && (*end == '\0' || *end == '&') && number >= 0 && number <= INT_MAX)
+        value = (int)number;
 
-    DBG("Headers send, sending stream now\n");
+    return value;
+}
 
-    while(!pglobal->stop) {
+/******************************************************************************
+Description.: Fill the stream options from "fps=N", "every=N", "scale=1/N",
+              "quality=auto|N" and "latency=low" of the query
+Input Value.: * query..: the query string, may be NULL
+              * options: is filled
+Return Value: 0 if OK, -1 for an invalid scale or quality, -2 if the frames
+              would have to be converted but libjpeg is missing
+******************************************************************************/
+static int parse_stream_options(const char *query, stream_options *options)
+{
+    const char *scale, *quality, *latency;
+    size_t len;
+    int i;
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    options->fps = query_int(query, "fps", 0);
+    options->low_latency = ((latency = query_value(query, "latency")) != NULL && strncmp(latency, "low", 3) == 0);
+    options->every = MAX(query_int(query, "every", 1), 1);
+    options->scale = 0;
+    #ifdef NO_LIBJPEG
+    options->quality = 0;
+    #else
+    options->quality = -1;
+    #endif
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    if((scale = query_value(query, "scale")) != NULL) {
+        len = strcspn(scale, "&");
+        for(i = 1; i < FRAMEHUB_SCALES; i++) {
+            if(len == 3 && strncmp(scale, "1/", 2) == 0 && scale[2] - '0' == 1 << i)
+                options->scale = i;
+        }
+        if(options->scale == 0 && !(len == 1 && scale[0] == '1'))
+            return -1;
+    }
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    if((quality = query_value(query, "quality")) != NULL && strncmp(quality, "auto", 4) != 0) {
+        options->quality = query_int(query, "quality", -1);
+        for(i = 0; i < FRAMEHUB_RUNGS && framehub_quality[i] != options->quality; i++);
+        if(i == FRAMEHUB_RUNGS)
+            return -1;
+        options->quality = i;
+    }
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+    #ifdef NO_LIBJPEG
+    if(options->scale != 0 || options->quality != 0)
+        return -2;
+    #endif
 
-            frame = tmp;
-        }
+    DBG("stream options: fps=%d every=%d scale=1/%d quality=%d low_latency=%d\n", options->fps, options->every,
+        1 << options->scale, (options->quality < 0) ? -1 : framehub_quality[options->quality], options->low_latency);
+    return 0;
+}
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+/******************************************************************************
+Description.: Answer requests with stream options that can not be served
+Input Value.: * context_fd: the connection
+              * result....: the return value of parse_stream_options()
+Return Value: -
+******************************************************************************/
+static void stream_options_error(cfd *context_fd, int result)
+{
+    if(result == -2)
+        send_error(context_fd, 501, "this server was built without libjpeg and can not convert streams");
+    else
+        send_error(context_fd, 400, "scale must be 1, 1/2, 1/4 or 1/8, quality auto, 100, 90, 70 or 50");
+}
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+#ifdef MANAGMENT
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+static client_registry clients = { PTHREAD_MUTEX_INITIALIZER };
 
-        #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
-        #endif
+/******************************************************************************
+Description.: Current time in microseconds, the unit of the timestamps of the
+              client registry
+Input Value.: -
+Return Value: microseconds since the epoch
+******************************************************************************/
+static long long client_clock(void)
+{
+    struct timeval tim;
 
-        /*
-         * print the individual mimetype and the length
-         * sending the content-length fixes random stream disruption observed
-         * with firefox
-         */
-        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
-                "Content-Length: %d\r\n" \
-                "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+    gettimeofday(&tim, NULL);
+    return tim.tv_sec * 1000000LL + tim.tv_usec;
+}
 
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+/******************************************************************************
+Description.: Hash an address for the table of the client registry (FNV-1a)
+Input Value.: address: the address as a string
+Return Value: the hash
+******************************************************************************/
+static unsigned int client_hash(const char *address)
+{
+    unsigned int hash = 2166136261u;
 
-        DBG("sending boundary\n");
-        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
-    }
+    for(; *address != '\0'; address++)
+        hash = (hash ^ (unsigned char)*address) * 16777619u;
 
-    free(frame);
+    return hash;
 }
 
-#ifdef WXP_COMPAT
 /******************************************************************************
-Description.: Sends a mjpg stream in the same format as the WebcamXP does
-Input Value.: fildescriptor fd to send the answer to
+Description.: Remove a client from the list of unused clients
+              must be called with the mutex of the registry locked
+Input Value.: client: the client
 Return Value: -
 ******************************************************************************/
-void send_stream_wxp(cfd *context_fd, int input_number)
+static void unlink_unused_client(client_info *client)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    if(client->newer != NULL)
+        client->newer->older = client->older;
+    else if(clients.newest == client)
+        clients.newest = client->older;
 
-    DBG("preparing header\n");
+    if(client->older != NULL)
+        client->older->newer = client->newer;
+    else if(clients.oldest == client)
+        clients.oldest = client->newer;
 
-    time_t curDate, expiresDate;
-    curDate = time(NULL);
-    expiresDate = curDate - 1380; // teh expires date is before the current date with 23 minute (1380) sec
+    client->newer = client->older = NULL;
+}
 
-    char curDateBuffer[80];
-    char expDateBuffer[80];
+/******************************************************************************
+Description.: Free the least recently used clients without connections that
+              were not seen for CLIENT_TTL seconds, or as many as needed to
+              get below CLIENT_LIMIT entries
+              must be called with the mutex of the registry locked
+Input Value.: now: current time in seconds
+Return Value: -
+******************************************************************************/
+static void expire_clients(time_t now)
+{
+    client_info *client, **link;
 
-    strftime(curDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&curDate));
-    strftime(expDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&expiresDate));
-    sprintf(buffer, "HTTP/1.1 200 OK\r\n" \
-                    "Connection: keep-alive\r\n" \
-                    "Content-Type: multipart/x-mixed-replace; boundary=--myboundary\r\n" \
-                    "Content-Length: 9999999\r\n" \
-                    "Cache-control: no-cache, must revalidate\r\n" \
-                    "Date: %s\r\n" \
-                    "Expires: %s\r\n" \
-                    "Pragma: no-cache\r\n" \
-                    "Server: webcamXP\r\n"
-                    "\r\n",
-                    curDateBuffer,
-                    expDateBuffer);
+    while((client = clients.oldest) != NULL &&
+          (clients.count > CLIENT_LIMIT || now - client->released > CLIENT_TTL)) {
+        unlink_unused_client(client);
+
+        for(link = &clients.buckets[client->hash & (CLIENT_BUCKETS - 1)]; *link != client; link = &(*link)->next);
+        *link = client->next;
+
+        DBG("expiring client %s\n", client->address);
+        free(client->address);
+        free(client);
+        clients.count--;
+    }
+}
+
+/******************************************************************************
+Description.: Look up the client with this address in the registry or add
+              it. The connection uses the entry until release_client().
+Input Value.: Client IP address as a string
+Return Value: Returns with the newly added info or with a pointer to the existing
+              item, NULL if there is not enough memory
+******************************************************************************/
+client_info *add_client(char *address)
+{
+    unsigned int hash = client_hash(address);
+    client_info *client, **bucket = &clients.buckets[hash & (CLIENT_BUCKETS - 1)];
+
+    pthread_mutex_lock(&clients.mutex);
+
+    for(client = *bucket; client != NULL; client = client->next) {
+        if(client->hash == hash && strcmp(client->address, address) == 0)
+            break;
+    }
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+    if(client == NULL) {
+        if((client = calloc(1, sizeof(client_info))) == NULL || (client->address = strdup(address)) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            free(client);
+            pthread_mutex_unlock(&clients.mutex);
+            return NULL;
+        }
+        client->hash = hash;
+        client->rate_start = client_clock();
+        client->next = *bucket;
+        *bucket = client;
+        clients.count++;
+    } else if(client->connections == 0) {
+        unlink_unused_client(client);
+    }
+    client->connections++;
+
+    expire_clients(time(NULL));
+    pthread_mutex_unlock(&clients.mutex);
+    return client;
+}
+
+/******************************************************************************
+Description.: A connection ended, once the last connection of a client ended
+              its entry may expire
+Input Value.: client: the client, may be NULL
+Return Value: -
+******************************************************************************/
+void release_client(client_info *client)
+{
+    if(client == NULL)
+        return;
+
+    pthread_mutex_lock(&clients.mutex);
+    if(--client->connections == 0) {
+        client->released = time(NULL);
+        client->older = clients.newest;
+        if(clients.newest != NULL)
+            clients.newest->newer = client;
+        clients.newest = client;
+        if(clients.oldest == NULL)
+            clients.oldest = client;
+    }
+    expire_clients(time(NULL));
+    pthread_mutex_unlock(&clients.mutex);
+}
+
+/******************************************************************************
+Description.: Checks if the client was served a frame too recently
+Input Value.: the client
+Return Value: If a frame was served to it within the specified interval it returns 1
+              If not it returns with 0
+******************************************************************************/
+int check_client_status(client_info *client)
+{
+    long long msec;
+
+    if(client == NULL)
+        return 0;
+
+    msec = (client_clock() - __atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED)) / 1000;
+    DBG("diff: %lld\n", msec);
+    if((msec < 1000) && (msec > 0)) { // FIXME make it parameter
+        DBG("CHEATER\n");
+        return 1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: Remember when the client was served the last frame
+Input Value.: the client
+Return Value: -
+******************************************************************************/
+void update_client_timestamp(client_info *client)
+{
+    if(client != NULL)
+        __atomic_store_n(&client->last_take_time, client_clock(), __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: Account bytes sent to a client, the rate is updated about once
+              per second by the connection that finds the period is over
+Input Value.: * client: the client
+              * bytes.: number of bytes just sent
+Return Value: -
+******************************************************************************/
+void update_client_rate(client_info *client, int bytes)
+{
+    long long now, start;
+    unsigned long sent;
+    double rate;
+
+    if(client == NULL)
+        return;
+
+    __atomic_add_fetch(&client->bytes, bytes, __ATOMIC_RELAXED);
+
+    now = client_clock();
+    start = __atomic_load_n(&client->rate_start, __ATOMIC_RELAXED);
+    if(now - start >= 1000000 &&
+       __atomic_compare_exchange_n(&client->rate_start, &start, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        sent = __atomic_exchange_n(&client->bytes, 0, __ATOMIC_RELAXED);
+        rate = sent * 1000000.0 / (now - start);
+        __atomic_store(&client->rate, &rate, __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+/******************************************************************************
+Description.: Prepare a token bucket, it starts full
+Input Value.: * bucket: the bucket
+              * rate..: bytes per second, 0 means unlimited
+Return Value: -
+******************************************************************************/
+static void bucket_init(token_bucket *bucket, double rate)
+{
+    bucket->rate = rate;
+    bucket->tokens = rate;
+    gettimeofday(&bucket->last, NULL);
+}
+
+/******************************************************************************
+Description.: Add the tokens earned since the last call, at most one second
+              worth of data is saved up
+Input Value.: * bucket: the bucket
+              * now...: current time
+Return Value: 1 if the bucket is not empty
+******************************************************************************/
+static int bucket_refill(token_bucket *bucket, struct timeval *now)
+{
+    double elapsed = (now->tv_sec - bucket->last.tv_sec) + (now->tv_usec - bucket->last.tv_usec) / 1000000.0;
+
+    bucket->tokens = MIN(bucket->tokens + elapsed * bucket->rate, bucket->rate);
+    bucket->last = *now;
+
+    return bucket->tokens >= 0;
+}
+
+/******************************************************************************
+Description.: Decide if a frame of a stream may be sent without exceeding the
+              bandwidth limits of the client and of the server. Frames are
+              allowed as long as the buckets are not empty, so a frame larger
+              than the budget of a second still gets through now and then and
+              the average stays at the limit.
+Input Value.: * context_fd: the connection the stream is sent to
+              * size......: size of the frame
+Return Value: 1 if the frame may be sent, 0 if it has to be skipped
+******************************************************************************/
+static int shape_frame(cfd *context_fd, int size)
+{
+    context *pc = context_fd->pc;
+    struct timeval now;
+    int allowed = 1;
+
+    /* without limits no stream waits for the lock of the statistics */
+    if(pc->conf.client_rate <= 0 && pc->conf.egress_rate <= 0) {
+        __atomic_add_fetch(&pc->stats.bytes_sent, size, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    gettimeofday(&now, NULL);
+
+    if(pc->conf.client_rate > 0 && !bucket_refill(&context_fd->bucket, &now))
+        allowed = 0;
+
+    pthread_mutex_lock(&pc->stats.mutex);
+    if(pc->conf.egress_rate > 0 && !bucket_refill(&pc->egress, &now))
+        allowed = 0;
+
+    if(allowed) {
+        if(pc->conf.egress_rate > 0)
+            pc->egress.tokens -= size;
+        __atomic_add_fetch(&pc->stats.bytes_sent, size, __ATOMIC_RELAXED);
+    } else {
+        pc->stats.frames_skipped++;
+    }
+    pthread_mutex_unlock(&pc->stats.mutex);
+
+    if(allowed && pc->conf.client_rate > 0)
+        context_fd->bucket.tokens -= size;
+
+    return allowed;
+}
+
+/******************************************************************************
+Description.: Check the limits for concurrent streams and register a new one
+Input Value.: context_fd: the connection that asks for a stream
+Return Value: 0 if the stream may start, -1 if a limit is reached
+******************************************************************************/
+static int admit_stream(cfd *context_fd)
+{
+    context *pc = context_fd->pc;
+    stream_address *sa;
+
+    pthread_mutex_lock(&pc->stats.mutex);
+
+    for(sa = pc->stream_addresses; sa != NULL; sa = sa->next) {
+        if(strcmp(sa->address, context_fd->address) == 0)
+            break;
+    }
+
+    if((pc->conf.max_streams > 0 && pc->stats.streams >= pc->conf.max_streams) ||
+       (pc->conf.max_streams_ip > 0 && sa != NULL && sa->streams >= pc->conf.max_streams_ip)) {
+        pc->stats.streams_refused++;
+        pthread_mutex_unlock(&pc->stats.mutex);
+        return -1;
+    }
+
+    if(sa == NULL) {
+        if((sa = calloc(1, sizeof(stream_address))) == NULL) {
+            pthread_mutex_unlock(&pc->stats.mutex);
+            return -1;
+        }
+        snprintf(sa->address, sizeof(sa->address), "%s", context_fd->address);
+        sa->next = pc->stream_addresses;
+        pc->stream_addresses = sa;
+    }
+
+    sa->streams++;
+    pc->stats.streams++;
+    pthread_mutex_unlock(&pc->stats.mutex);
+
+    bucket_init(&context_fd->bucket, pc->conf.client_rate);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Unregister a stream started with admit_stream()
+Input Value.: context_fd: the connection the stream was sent to
+Return Value: -
+******************************************************************************/
+static void release_stream(cfd *context_fd)
+{
+    context *pc = context_fd->pc;
+    stream_address *sa, **prev;
+
+    pthread_mutex_lock(&pc->stats.mutex);
+    pc->stats.streams--;
+
+    for(prev = &pc->stream_addresses; (sa = *prev) != NULL; prev = &sa->next) {
+        if(strcmp(sa->address, context_fd->address) == 0) {
+            if(--sa->streams == 0) {
+                *prev = sa->next;
+                free(sa);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pc->stats.mutex);
+}
+
+/******************************************************************************
+Description.: Send a complete HTTP response and a single JPG-frame.
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_snapshot(cfd *context_fd, int input_number)
+{
+    unsigned char *frame = NULL;
+    int frame_size = 0;
+    char buffer[BUFFER_SIZE] = {0};
+    struct timeval timestamp;
+
+    /* wait for a fresh frame */
+    pthread_mutex_lock(&pglobal->in[input_number].db);
+    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+
+    /* a browser can not show the frames of other codecs */
+    if(!input_frame_jpeg(&pglobal->in[input_number])) {
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        send_error(context_fd, 500, "the input does not publish JPEG frames");
+        return;
+    }
+
+    /* read buffer */
+    frame_size = input_frame_size(&pglobal->in[input_number]);
+
+    /* allocate a buffer for this single frame */
+    if((frame = malloc(frame_size + 1)) == NULL) {
         free(frame);
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        context_fd->keep_alive = 0;
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+    /* copy v4l2_buffer timeval to user space */
+    timestamp = pglobal->in[input_number].timestamp;
+
+    input_copy_frame(&pglobal->in[input_number], frame);
+    DBG("got frame (size: %d kB)\n", frame_size / 1024);
+
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+    #ifdef MANAGMENT
+    update_client_timestamp(context_fd->client);
+    #endif
+
+    /* write the response */
+    sprintf(buffer, "%s 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            "%s" \
+            STD_HEADER \
+            "Content-type: image/jpeg\r\n" \
+            "Content-Length: %d\r\n" \
+            "X-Timestamp: %d.%06d\r\n" \
+            "\r\n", http_version(context_fd), connection_header(context_fd),
+            frame_size, (int) timestamp.tv_sec, (int) timestamp.tv_usec);
+
+    /* send header and image now */
+    if(write_response(context_fd->fd, buffer, frame, frame_size) < 0)
+        context_fd->keep_alive = 0;
+
+    free(frame);
+}
+
+/******************************************************************************
+Description.: Put a stream client on the quality ladder
+Input Value.: * input_number: number of the input plugin
+              * schedule....: the schedule of the client
+              * ladder......: is initialized
+              * quality.....: rung the client asked for, -1 to adapt it
+Return Value: -
+******************************************************************************/
+static void init_ladder(int input_number, frame_schedule *schedule, quality_ladder *ladder, int quality)
+{
+    memset(ladder, 0, sizeof(quality_ladder));
+    ladder->fixed = (quality >= 0);
+
+    if(quality > 0) {
+        framehub_set_rung(input_number, schedule, 0, quality);
+        ladder->rung = quality;
+    }
+}
+
+/******************************************************************************
+Description.: Move a stream client on the quality ladder. Data that is still
+              in the send queue when the next frame is due means the
+              connection is slower than the stream, the client steps down.
+              After the queue was empty for a while it steps up again.
+Input Value.: * context_fd..: the connection
+              * input_number: number of the input plugin
+              * schedule....: the schedule of the client
+              * ladder......: position of the client, is updated
+              * frame_size..: size of the frame that is sent next
+Return Value: -
+******************************************************************************/
+static void adapt_quality(cfd *context_fd, int input_number, frame_schedule *schedule, quality_ladder *ladder, int frame_size)
+{
+    int queued, rung = ladder->rung;
+
+    if(ladder->fixed || ioctl(context_fd->fd, SIOCOUTQ, &queued) < 0)
         return;
+
+    if(ladder->cooldown > 0)
+        ladder->cooldown--;
+
+    if(queued > frame_size / 2) {
+        ladder->calm = 0;
+        if(ladder->cooldown == 0 && rung < FRAMEHUB_RUNGS - 1) {
+            rung++;
+            ladder->cooldown = LADDER_COOLDOWN;
+        }
+    } else if(queued == 0) {
+        if(++ladder->calm >= LADDER_CALM && rung > 0) {
+            rung--;
+            ladder->calm = 0;
+        }
+    } else {
+        ladder->calm = 0;
     }
 
+    if(rung != ladder->rung) {
+        DBG("client %d moves to %d%% quality, %d bytes queued\n", context_fd->fd, framehub_quality[rung], queued);
+        framehub_set_rung(input_number, schedule, ladder->rung, rung);
+        ladder->rung = rung;
+    }
+}
+
+/******************************************************************************
+Description.: Prepare the socket of a low latency stream. The kernel reports
+              it writable only while less than LOW_LATENCY_LOWAT bytes wait
+              to be sent, and the small headers between the frames leave
+              without delay.
+Input Value.: context_fd: the connection
+Return Value: 1 if the kernel applies the low-water mark, 0 otherwise
+******************************************************************************/
+static int init_low_latency(cfd *context_fd)
+{
+    int lowat = LOW_LATENCY_LOWAT, nodelay = 1, ret = 0;
+
+    #ifdef TCP_NOTSENT_LOWAT
+    if(setsockopt(context_fd->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        DBG("setsockopt(TCP_NOTSENT_LOWAT) failed: %s\n", strerror(errno));
+    else
+        ret = 1;
+    #endif
+    setsockopt(context_fd->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return ret;
+}
+
+/******************************************************************************
+Description.: Limit the send buffer of a low latency stream to a few frames,
+              so data in flight does not pile up either. Called with the
+              first frame, the buffer size depends on the size of the frames.
+Input Value.: * context_fd: the connection
+              * frame_size: size of the frames of the stream
+Return Value: -
+******************************************************************************/
+static void size_send_buffer(cfd *context_fd, int frame_size)
+{
+    int size = MAX(frame_size * LOW_LATENCY_FRAMES, 2 * LOW_LATENCY_LOWAT);
+
+    /* the kernel doubles the value for its bookkeeping */
+    setsockopt(context_fd->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/******************************************************************************
+Description.: Wait until the bytes of a low latency stream that were not sent
+              yet (SIOCOUTQNSD) dropped to LOW_LATENCY_LOWAT. The frame taken
+              from the hub afterwards is the newest one.
+Input Value.: * context_fd: the connection
+              * lowat.....: the low-water mark is set, without it the socket
+                            is writable as long as there is room and
+                            SIOCOUTQNSD is checked every LOW_LATENCY_RECHECK
+                            microseconds instead
+Return Value: 0 if the next frame may be sent, -1 if the connection broke or
+              the program stops
+******************************************************************************/
+static int wait_drained(cfd *context_fd, int lowat)
+{
+    struct pollfd pfd = { context_fd->fd, POLLOUT, 0 };
+    int unsent;
+
+    while(!pglobal->stop) {
+        /* kernels without SIOCOUTQNSD stream as usual */
+        if(ioctl(context_fd->fd, SIOCOUTQNSD, &unsent) < 0 || unsent <= LOW_LATENCY_LOWAT)
+            break;
+
+        if(!lowat) {
+            usleep(LOW_LATENCY_RECHECK);
+            continue;
+        }
+        if(poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            return -1;
+        if(pfd.revents & (POLLERR | POLLHUP))
+            return -1;
+    }
+
+    return pglobal->stop ? -1 : 0;
+}
+
+/******************************************************************************
+Description.: Send a complete HTTP response and a stream of JPG-frames.
+Input Value.: * context_fd..: fildescriptor fd to send the answer to
+              * input_number: number of the input plugin
+              * options.....: frame rate the client asked for
+Return Value: -
+******************************************************************************/
+void send_stream(cfd *context_fd, int input_number, stream_options *options)
+{
+    frame_schedule *schedule;
+    shared_frame *frame;
+    quality_ladder ladder;
+    unsigned long seq;
+    int buffer_sized = 0, lowat = 0;
+    char buffer[BUFFER_SIZE] = {0};
+
+    DBG("preparing header\n");
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            CLOSE_HEADER \
+            STD_HEADER \
+            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+            "\r\n" \
+            "--" BOUNDARY "\r\n");
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0)
+        return;
+
+    /* clients asking for the same rate share one schedule */
+    if((schedule = framehub_subscribe(input_number, options->fps, options->every, options->scale)) == NULL)
+        return;
+    seq = schedule->seq;
+    init_ladder(input_number, schedule, &ladder, options->quality);
+    if(options->low_latency)
+        lowat = init_low_latency(context_fd);
+
     DBG("Headers send, sending stream now\n");
 
-    while(!pglobal->stop) {
+    while(!pglobal->stop) {
+
+        /* low latency streams send the newest frame once the previous one left */
+        if(options->low_latency && wait_drained(context_fd, lowat) < 0)
+            break;
+
+        /* wait for the next frame of this schedule, the others never wake us up */
+        if((frame = framehub_wait(input_number, schedule, ladder.rung, &seq)) == NULL)
+            break;
+
+        if(options->low_latency && buffer_sized++ == 0)
+            size_send_buffer(context_fd, frame->size);
+
+        adapt_quality(context_fd, input_number, schedule, &ladder, frame->size);
+
+        /* clients over their budget skip frames instead of being disconnected */
+        if(!shape_frame(context_fd, frame->size)) {
+            framehub_release(input_number, frame);
+            continue;
+        }
+
+        DBG("got frame (size: %d kB)\n", frame->size / 1024);
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        /*
+         * print the individual mimetype and the length
+         * sending the content-length fixes random stream disruption observed
+         * with firefox
+         */
+        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
+                "Content-Length: %d\r\n" \
+                "X-Timestamp: %d.%06d\r\n" \
+                "\r\n", frame->size, (int)frame->timestamp.tv_sec, (int)frame->timestamp.tv_usec);
+        DBG("sending intemdiate header\n");
+        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+            framehub_release(input_number, frame);
+            break;
+        }
+
+        DBG("sending frame\n");
+        if(write(context_fd->fd, frame->data, frame->size) < 0) {
+            framehub_release(input_number, frame);
+            break;
+        }
+
+        #ifdef MANAGMENT
+        update_client_rate(context_fd->client, frame->size);
+        #endif
+        framehub_release(input_number, frame);
+
+        DBG("sending boundary\n");
+        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
+        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+    }
+
+    framehub_unsubscribe(input_number, schedule, ladder.rung);
+}
+
+#ifdef WXP_COMPAT
+/******************************************************************************
+Description.: Sends a mjpg stream in the same format as the WebcamXP does
+Input Value.: * context_fd..: fildescriptor fd to send the answer to
+              * input_number: number of the input plugin
+              * options.....: frame rate the client asked for
+Return Value: -
+******************************************************************************/
+void send_stream_wxp(cfd *context_fd, int input_number, stream_options *options)
+{
+    frame_schedule *schedule;
+    shared_frame *frame;
+    quality_ladder ladder;
+    unsigned long seq;
+    int buffer_sized = 0, lowat = 0;
+    char buffer[BUFFER_SIZE] = {0};
+
+    DBG("preparing header\n");
+
+    time_t curDate, expiresDate;
+    curDate = time(NULL);
+    expiresDate = curDate - 1380; // teh expires date is before the current date with 23 minute (1380) sec
+
+    char curDateBuffer[80];
+    char expDateBuffer[80];
+
+    strftime(curDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&curDate));
+    strftime(expDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&expiresDate));
+    sprintf(buffer, "HTTP/1.1 200 OK\r\n" \
+                    "Connection: keep-alive\r\n" \
+                    "Content-Type: multipart/x-mixed-replace; boundary=--myboundary\r\n" \
+                    "Content-Length: 9999999\r\n" \
+                    "Cache-control: no-cache, must revalidate\r\n" \
+                    "Date: %s\r\n" \
+                    "Expires: %s\r\n" \
+                    "Pragma: no-cache\r\n" \
+                    "Server: webcamXP\r\n"
+                    "\r\n",
+                    curDateBuffer,
+                    expDateBuffer);
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0)
+        return;
+
+    if((schedule = framehub_subscribe(input_number, options->fps, options->every, options->scale)) == NULL)
+        return;
+    seq = schedule->seq;
+    init_ladder(input_number, schedule, &ladder, options->quality);
+    if(options->low_latency)
+        lowat = init_low_latency(context_fd);
+
+    DBG("Headers send, sending stream now\n");
+
+    while(!pglobal->stop) {
+
+        if(options->low_latency && wait_drained(context_fd, lowat) < 0)
+            break;
+
+        if((frame = framehub_wait(input_number, schedule, ladder.rung, &seq)) == NULL)
+            break;
+
+        if(options->low_latency && buffer_sized++ == 0)
+            size_send_buffer(context_fd, frame->size);
+
+        adapt_quality(context_fd, input_number, schedule, &ladder, frame->size);
+
+        /* clients over their budget skip frames instead of being disconnected */
+        if(!shape_frame(context_fd, frame->size)) {
+            framehub_release(input_number, frame);
+            continue;
+        }
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        DBG("got frame (size: %d kB)\n", frame->size / 1024);
+
+        memset(buffer, 0, 50*sizeof(char));
+        sprintf(buffer, "mjpeg %07d12345", frame->size);
+        DBG("sending intemdiate header\n");
+        if(write(context_fd->fd, buffer, 50) < 0) {
+            framehub_release(input_number, frame);
+            break;
+        }
+
+        DBG("sending frame\n");
+        if(write(context_fd->fd, frame->data, frame->size) < 0) {
+            framehub_release(input_number, frame);
+            break;
+        }
+
+        #ifdef MANAGMENT
+        update_client_rate(context_fd->client, frame->size);
+        #endif
+        framehub_release(input_number, frame);
+    }
+
+    framehub_unsubscribe(input_number, schedule, ladder.rung);
+}
+#endif
+
+/******************************************************************************
+Description.: Copy a string into a JSON string literal
+Input Value.: * source.....: the string
+              * destination: receives the escaped string without quotes
+              * size.......: size of destination
+Return Value: -
+******************************************************************************/
+static void escape_JSON_string(const char *source, char *destination, size_t size)
+{
+    size_t o = 0;
+
+    for(; *source != '\0' && o + 2 < size; source++) {
+        if(*source == '"' || *source == '\\')
+            destination[o++] = '\\';
+        destination[o++] = isprint((unsigned char)*source) ? *source : ' ';
+    }
+    destination[o] = '\0';
+}
+
+/******************************************************************************
+Description.: Wait until no other thread writes to the connection and take
+              the turn, call with the mutex of the session held
+Input Value.: ws: the session
+Return Value: -
+******************************************************************************/
+static void websocket_begin(websocket_session *ws)
+{
+    while(ws->sending)
+        pthread_cond_wait(&ws->idle, &ws->mutex);
+    ws->sending = 1;
+}
+
+/******************************************************************************
+Description.: Send the queued messages and give the turn back, call with the
+              mutex of the session held. The mutex is released while a
+              message is written.
+Input Value.: ws: the session
+Return Value: -
+******************************************************************************/
+static void websocket_end(websocket_session *ws)
+{
+    websocket_message *msg;
+    int rc;
+
+    while((msg = ws->queue) != NULL) {
+        if((ws->queue = msg->next) == NULL)
+            ws->tail = &ws->queue;
+        pthread_mutex_unlock(&ws->mutex);
+        rc = websocket_send(ws->context_fd->fd, msg->opcode, NULL, 0, msg->data, msg->size);
+        free(msg);
+        pthread_mutex_lock(&ws->mutex);
+        if(rc < 0)
+            ws->closing = 1;
+    }
+
+    ws->sending = 0;
+    pthread_cond_broadcast(&ws->idle);
+}
+
+/******************************************************************************
+Description.: Queue a message and send it right away, unless another thread
+              writes to the connection, that one takes it along. So the
+              reader does not wait for a frame to a slow client.
+Input Value.: * ws....: the session
+              * opcode: WS_TEXT, WS_PONG or WS_CLOSE, nothing is sent after
+                        WS_CLOSE
+              * data, size: the payload
+Return Value: -
+******************************************************************************/
+static void websocket_post(websocket_session *ws, int opcode, const void *data, size_t size)
+{
+    websocket_message *msg;
+
+    pthread_mutex_lock(&ws->mutex);
+    if(ws->closing || (msg = malloc(sizeof(websocket_message) + size)) == NULL) {
+        pthread_mutex_unlock(&ws->mutex);
+        return;
+    }
+
+    msg->next = NULL;
+    msg->opcode = opcode;
+    msg->size = size;
+    memcpy(msg->data, data, size);
+    *ws->tail = msg;
+    ws->tail = &msg->next;
+    if(opcode == WS_CLOSE)
+        ws->closing = 1;
+
+    if(!ws->sending) {
+        websocket_begin(ws);
+        websocket_end(ws);
+    }
+    pthread_mutex_unlock(&ws->mutex);
+}
+
+/******************************************************************************
+Description.: Send a close message once, later calls do nothing
+Input Value.: * ws..: the session
+              * code: WS_CLOSE_* status code
+Return Value: -
+******************************************************************************/
+static void websocket_close(websocket_session *ws, int code)
+{
+    unsigned char status[2] = { code >> 8, code & 0xFF };
+
+    websocket_post(ws, WS_CLOSE, status, sizeof(status));
+}
+
+/******************************************************************************
+Description.: Handle the messages of a WebSocket client. Text messages are
+              commands like the parameter of "?action=command", the answer is
+              a JSON object with the HTTP status code and the result.
+Input Value.: arg is the session
+Return Value: always NULL
+******************************************************************************/
+static void *websocket_reader(void *arg)
+{
+    websocket_session *ws = arg;
+    cfd *context_fd = ws->context_fd;
+    char payload[WS_MAX_MESSAGE + 1], answer[BUFFER_SIZE], escaped[BUFFER_SIZE], reply[BUFFER_SIZE + 64];
+    char *parameter;
+    int opcode, len, status;
+
+    while(1) {
+        len = websocket_read(context_fd->fd, ws->pending, &opcode, payload, sizeof(payload));
+        if(len == -1)
+            break;
+        if(len < -1) {
+            websocket_close(ws, -len);
+            break;
+        }
+
+        if(opcode == WS_CLOSE) {
+            websocket_close(ws, WS_CLOSE_NORMAL);
+            break;
+        } else if(opcode == WS_PING) {
+            websocket_post(ws, WS_PONG, payload, len);
+            continue;
+        } else if(opcode != WS_TEXT) {
+            continue;
+        }
+
+        DBG("WebSocket command: %s\n", payload);
+        if(context_fd->pc->conf.nocommands) {
+            status = 501;
+            snprintf(answer, sizeof(answer), "this server is configured to not accept commands");
+        } else if((parameter = copy_allowed(payload, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./", 100)) == NULL) {
+            status = 500;
+            snprintf(answer, sizeof(answer), "could not allocate memory");
+        } else if(unescape(parameter) == -1) {
+            status = 500;
+            snprintf(answer, sizeof(answer), "could not properly unescape command parameter string");
+            free(parameter);
+        } else {
+            /* the same as the parameter of "?action=command" */
+            status = execute_command(parameter, answer, sizeof(answer));
+            free(parameter);
+        }
+
+        escape_JSON_string(answer, escaped, sizeof(escaped));
+        snprintf(reply, sizeof(reply), "{\"status\": %d, \"answer\": \"%s\"}", status, escaped);
+
+        websocket_post(ws, WS_TEXT, reply, strlen(reply));
+    }
+
+    pthread_mutex_lock(&ws->mutex);
+    ws->closing = 1;
+    pthread_mutex_unlock(&ws->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Upgrade the connection to a WebSocket and send the frames as
+              binary messages. Each message is a ws_frame_prefix followed by
+              the JPEG, which is sent from the buffer shared by all clients.
+              Commands arrive as text messages on the same connection.
+Input Value.: * context_fd..: the connection
+              * input_number: number of the input plugin
+              * options.....: frame rate, size and quality the client asked for
+              * req.........: the request with the handshake
+              * pending.....: bytes the client sent after the request
+Return Value: -
+******************************************************************************/
+void send_websocket(cfd *context_fd, int input_number, stream_options *options, request *req, iobuffer *pending)
+{
+    websocket_session ws;
+    frame_schedule *schedule;
+    shared_frame *frame;
+    quality_ladder ladder;
+    ws_frame_prefix prefix;
+    struct timeval now;
+    unsigned long seq;
+    char buffer[BUFFER_SIZE] = {0}, accept[32];
+    int rc, nodelay = 1;
+
+    if(req->method != M_GET || !req->upgrade_websocket || req->websocket_key == NULL ||
+       req->websocket_version != 13 || websocket_accept_key(req->websocket_key, accept, sizeof(accept)) < 0) {
+        send_error(context_fd, 400, "this URL expects a WebSocket handshake, version 13");
+        return;
+    }
+
+    sprintf(buffer, "HTTP/1.1 101 Switching Protocols\r\n" \
+            "Upgrade: websocket\r\n" \
+            "Connection: Upgrade\r\n" \
+            "Sec-WebSocket-Accept: %s\r\n" \
+            STD_HEADER \
+            "\r\n", accept);
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0)
+        return;
+
+    /* answers to commands are small, they should not wait for a frame */
+    setsockopt(context_fd->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if((schedule = framehub_subscribe(input_number, options->fps, options->every, options->scale)) == NULL)
+        return;
+    seq = schedule->seq;
+    init_ladder(input_number, schedule, &ladder, options->quality);
+
+    ws.context_fd = context_fd;
+    ws.pending = pending;
+    ws.closing = 0;
+    ws.sending = 0;
+    ws.queue = NULL;
+    ws.tail = &ws.queue;
+    pthread_mutex_init(&ws.mutex, NULL);
+    pthread_cond_init(&ws.idle, NULL);
+    if(pthread_create(&ws.reader, NULL, websocket_reader, &ws) != 0) {
+        framehub_unsubscribe(input_number, schedule, ladder.rung);
+        pthread_cond_destroy(&ws.idle);
+        pthread_mutex_destroy(&ws.mutex);
+        return;
+    }
+
+    DBG("WebSocket established, sending frames now\n");
+
+    memset(&prefix, 0, sizeof(prefix));
+    prefix.version = WS_PREFIX_VERSION;
+    prefix.length = sizeof(prefix);
+    prefix.scale = options->scale;
+
+    while(!pglobal->stop) {
+        if((frame = framehub_wait(input_number, schedule, ladder.rung, &seq)) == NULL)
+            break;
+
+        adapt_quality(context_fd, input_number, schedule, &ladder, frame->size);
+
+        /* clients over their budget skip frames instead of being disconnected */
+        if(!shape_frame(context_fd, frame->size)) {
+            framehub_release(input_number, frame);
+            continue;
+        }
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        gettimeofday(&now, NULL);
+        prefix.quality = framehub_quality[ladder.rung];
+        prefix.seq = htonl(frame->seq);
+        prefix.size = htonl(frame->size);
+        prefix.timestamp_sec = htonl(frame->timestamp.tv_sec);
+        prefix.timestamp_usec = htonl(frame->timestamp.tv_usec);
+        prefix.sent_sec = htonl(now.tv_sec);
+        prefix.sent_usec = htonl(now.tv_usec);
+
+        pthread_mutex_lock(&ws.mutex);
+        websocket_begin(&ws);
+        rc = ws.closing ? -1 : 0;
+        pthread_mutex_unlock(&ws.mutex);
+        if(rc == 0)
+            rc = websocket_send(context_fd->fd, WS_BINARY, &prefix, sizeof(prefix), frame->data, frame->size);
+        pthread_mutex_lock(&ws.mutex);
+        websocket_end(&ws);
+        pthread_mutex_unlock(&ws.mutex);
+
+        #ifdef MANAGMENT
+        if(rc == 0)
+            update_client_rate(context_fd->client, frame->size);
+        #endif
+        framehub_release(input_number, frame);
+
+        if(rc < 0)
+            break;
+    }
+
+    /* the reader thread returns as soon as it can not read any more */
+    websocket_close(&ws, WS_CLOSE_NORMAL);
+    shutdown(context_fd->fd, SHUT_RDWR);
+    pthread_join(ws.reader, NULL);
+
+    framehub_unsubscribe(input_number, schedule, ladder.rung);
+    while(ws.queue != NULL) {
+        websocket_message *msg = ws.queue;
+
+        ws.queue = msg->next;
+        free(msg);
+    }
+    pthread_cond_destroy(&ws.idle);
+    pthread_mutex_destroy(&ws.mutex);
+}
+
+/******************************************************************************
+Description.: Read the topics of an event stream from "topics=a,b" of the query
+Input Value.: query: the query string, may be NULL
+Return Value: TOPIC_* flags, -1 if a topic is unknown
+******************************************************************************/
+static int parse_topics(const char *query)
+{
+    static const struct {
+        const char *name;
+        int flag;
+    } topics[] = {
+        { "frame",    TOPIC_FRAME },
+        { "metadata", TOPIC_METADATA },
+        { "stats",    TOPIC_STATS }
+    };
+    const char *p = query_value(query, "topics");
+    size_t len;
+    int i, flags = 0;
+
+    if(p == NULL)
+        return TOPIC_FRAME | TOPIC_STATS;
+
+    while(*p != '\0' && *p != '&') {
+        len = strcspn(p, ",&");
+        for(i = 0; i < LENGTH_OF(topics); i++) {
+            if(strlen(topics[i].name) == len && strncmp(p, topics[i].name, len) == 0)
+                break;
+        }
+        if(i == LENGTH_OF(topics))
+            return -1;
+        flags |= topics[i].flag;
+        p += len;
+        if(*p == ',')
+            p++;
+    }
+
+    /* all frames include the ones with metadata */
+    if(flags & TOPIC_FRAME)
+        flags &= ~TOPIC_METADATA;
+
+    return (flags == 0) ? -1 : flags;
+}
+
+/******************************************************************************
+Description.: Send a frame event with the sequence number, size, timestamp
+              and the metadata the input plugin published with the frame
+Input Value.: * context_fd: the connection
+              * frame.....: the frame
+Return Value: result of write()
+******************************************************************************/
+static int send_frame_event(cfd *context_fd, shared_frame *frame)
+{
+    char *event, *p;
+    int size, len, start, rc;
+
+    size = 192 + ((frame->metadata != NULL) ? strlen(frame->metadata) : 0);
+    if((event = malloc(size)) == NULL)
+        return 0;
+
+    start = snprintf(event, size, "event: frame\n" \
+                     "id: %lu\n" \
+                     "data: {\"seq\": %lu, \"size\": %d, \"timestamp\": %d.%06d, \"metadata\": ",
+                     frame->seq, frame->seq, frame->size, (int)frame->timestamp.tv_sec, (int)frame->timestamp.tv_usec);
+    len = start + snprintf(event + start, size - start, "%s", (frame->metadata != NULL) ? frame->metadata : "null");
+
+    /* a line break would end the data field of the event */
+    for(p = event + start; p < event + len; p++) {
+        if(*p == '\r' || *p == '\n')
+            *p = ' ';
+    }
+    len += snprintf(event + len, size - len, "}\n\n");
+
+    rc = write(context_fd->fd, event, len);
+    free(event);
+    return rc;
+}
+
+/******************************************************************************
+Description.: Send the counters of the server that changed since the last
+              stats event, "clients" and "streams" are current values, all
+              others are differences to the previous event
+Input Value.: * context_fd: the connection
+              * last......: counters of the previous event, is updated
+Return Value: result of write(), 0 if nothing changed
+******************************************************************************/
+static int send_stats_event(cfd *context_fd, server_stats *last)
+{
+    static const char header[] = "event: stats\ndata: {";
+    context *pc = context_fd->pc;
+    server_stats stats;
+    char event[BUFFER_SIZE];
+    int len;
+
+    pthread_mutex_lock(&pc->stats.mutex);
+    stats = pc->stats;
+    pthread_mutex_unlock(&pc->stats.mutex);
+
+    len = sprintf(event, "%s", header);
+
+#define STATS_GAUGE(name) \
+    if(stats.name != last->name) \
+        len += sprintf(event + len, "%s\"" #name "\": %d", (len > (int)sizeof(header) - 1) ? ", " : "", stats.name);
+#define STATS_DELTA(name) \
+    if(stats.name != last->name) \
+        len += sprintf(event + len, "%s\"" #name "\": %lu", (len > (int)sizeof(header) - 1) ? ", " : "", stats.name - last->name);
+
+    STATS_GAUGE(clients);
+    STATS_GAUGE(streams);
+    STATS_DELTA(connections);
+    STATS_DELTA(requests);
+    STATS_DELTA(accept_errors);
+    STATS_DELTA(streams_refused);
+    STATS_DELTA(frames_skipped);
+    STATS_DELTA(bytes_sent);
+
+#undef STATS_GAUGE
+#undef STATS_DELTA
+
+    *last = stats;
+    if(len == (int)sizeof(header) - 1)
+        return 0;
+
+    len += sprintf(event + len, "}\n\n");
+    return write(context_fd->fd, event, len);
+}
+
+/******************************************************************************
+Description.: Check if the client of an event stream closed the connection,
+              it does not send anything after the request
+Input Value.: * context_fd: the connection
+              * timeout...: milliseconds to wait
+Return Value: 1 if the connection is closed, 0 otherwise
+******************************************************************************/
+static int events_closed(cfd *context_fd, int timeout)
+{
+    struct pollfd pfd = { context_fd->fd, POLLIN, 0 };
+    char buffer[256];
+
+    if(poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    return read(context_fd->fd, buffer, sizeof(buffer)) <= 0;
+}
+
+/******************************************************************************
+Description.: Send a stream of Server-Sent Events. Frame events describe the
+              frames of the input, including the metadata of the plugin,
+              stats events the changes of the counters of the server.
+              "topics" selects the events, "fps" and "every" thin out the
+              frame events and "interval" sets the seconds between stats.
+Input Value.: * context_fd..: the connection
+              * input_number: number of the input plugin
+              * query.......: the query string of the request
+Return Value: -
+******************************************************************************/
+void send_events(cfd *context_fd, int input_number, const char *query)
+{
+    frame_schedule *schedule = NULL;
+    shared_frame *frame;
+    server_stats last;
+    struct timespec deadline;
+    struct timeval now;
+    unsigned long seq = 0;
+    time_t next_stats, next_heartbeat;
+    int topics, interval, wait_ms;
+    char buffer[BUFFER_SIZE] = {0};
+
+    if((topics = parse_topics(query)) < 0) {
+        send_error(context_fd, 400, "topics must be a list of frame, metadata and stats");
+        return;
+    }
+    interval = MAX(query_int(query, "interval", 1), 1);
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            CLOSE_HEADER \
+            STD_HEADER \
+            "Content-Type: text/event-stream\r\n" \
+            "\r\n" \
+            "retry: 2000\n\n");
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0)
+        return;
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    if(topics & (TOPIC_FRAME | TOPIC_METADATA)) {
+        schedule = framehub_subscribe(input_number, query_int(query, "fps", 0),
+                                      MAX(query_int(query, "every", 1), 1), 0);
+        if(schedule == NULL)
+            return;
+        seq = schedule->seq;
+    }
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    memset(&last, 0, sizeof(last));
+    gettimeofday(&now, NULL);
+    next_stats = now.tv_sec;
+    next_heartbeat = now.tv_sec + EVENTS_HEARTBEAT;
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    DBG("sending events %d of input %d\n", topics, input_number);
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+    while(!pglobal->stop) {
+        gettimeofday(&now, NULL);
 
-            frame = tmp;
+        if((topics & TOPIC_STATS) && now.tv_sec >= next_stats) {
+            if(send_stats_event(context_fd, &last) < 0)
+                break;
+            next_stats = now.tv_sec + interval;
         }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+        if(now.tv_sec >= next_heartbeat) {
+            if(write(context_fd->fd, ": ping\n\n", 8) < 0)
+                break;
+            next_heartbeat = now.tv_sec + EVENTS_HEARTBEAT;
+        }
 
-        #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
-        #endif
+        /* wake up for the next frame or the next stats event */
+        deadline.tv_sec = (topics & TOPIC_STATS) ? MIN(next_stats, next_heartbeat) : next_heartbeat;
+        deadline.tv_nsec = 0;
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+        if(schedule == NULL) {
+            wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 - now.tv_usec / 1000;
+            if(events_closed(context_fd, MAX(wait_ms, 0)))
+                break;
+            continue;
+        }
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        if((frame = framehub_timedwait(input_number, schedule, 0, &seq, &deadline)) == NULL) {
+            if(framehub_refused(input_number) || events_closed(context_fd, 0))
+                break;
+            continue;
+        }
 
-        memset(buffer, 0, 50*sizeof(char));
-        sprintf(buffer, "mjpeg %07d12345", frame_size);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, 50) < 0) break;
+        if(!(topics & TOPIC_FRAME) && frame->metadata == NULL) {
+            framehub_release(input_number, frame);
+            if(events_closed(context_fd, 0))
+                break;
+            continue;
+        }
 
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        if(send_frame_event(context_fd, frame) < 0) {
+            framehub_release(input_number, frame);
+            break;
+        }
+        framehub_release(input_number, frame);
     }
 
-    free(frame);
+    if(schedule != NULL)
+        framehub_unsubscribe(input_number, schedule, 0);
 }
-#endif
 
 /******************************************************************************
 Description.: Send error messages and headers.
-Input Value.: * fd.....: is the filedescriptor to send the message to
-              * which..: HTTP error code, most popular is 404
-              * message: append this string to the displayed response
+Input Value.: * context_fd: is the connection to send the message to
+              * which.....: HTTP error code, most popular is 404
+              * message...: append this string to the displayed response
 Return Value: -
 ******************************************************************************/
-void send_error(int fd, int which, char *message)
+void send_error(cfd *context_fd, int which, char *message)
 {
     char buffer[BUFFER_SIZE] = {0};
+    char body[BUFFER_SIZE] = {0};
+    const char *status, *text, *extra = "";
 
     if(which == 401) {
-        sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
-                "\r\n" \
-                "401: Not Authenticated!\r\n" \
-                "%s", message);
+        status = "401 Unauthorized";
+        text = "401: Not Authenticated!";
+        extra = "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n";
     } else if(which == 404) {
-        sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "404: Not Found!\r\n" \
-                "%s", message);
+        status = "404 Not Found";
+        text = "404: Not Found!";
     } else if(which == 500) {
-        sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "500: Internal Server Error!\r\n" \
-                "%s", message);
+        status = "500 Internal Server Error";
+        text = "500: Internal Server Error!";
     } else if(which == 400) {
-        sprintf(buffer, "HTTP/1.0 400 Bad Request\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "400: Not Found!\r\n" \
-                "%s", message);
+        status = "400 Bad Request";
+        text = "400: Not Found!";
     } else if (which == 403) {
-        sprintf(buffer, "HTTP/1.0 403 Forbidden\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "403: Forbidden!\r\n" \
-                "%s", message);
+        status = "403 Forbidden";
+        text = "403: Forbidden!";
+    } else if(which == 503) {
+        status = "503 Service Unavailable";
+        text = "503: Service Unavailable!";
+    } else if(which == 431) {
+        status = "431 Request Header Fields Too Large";
+        text = "431: Request Header Fields Too Large!";
     } else {
-        sprintf(buffer, "HTTP/1.0 501 Not Implemented\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "501: Not Implemented!\r\n" \
-                "%s", message);
+        status = "501 Not Implemented";
+        text = "501: Not Implemented!";
+    }
+
+    snprintf(body, sizeof(body), "%s\r\n%s", text, message);
+
+    /* the Content-Length allows to keep persistent connections open after an error */
+    snprintf(buffer, sizeof(buffer), "%s %s\r\n" \
+             "Content-type: text/plain\r\n" \
+             "Content-Length: %d\r\n" \
+             "%s" \
+             STD_HEADER \
+             "%s" \
+             "\r\n", http_version(context_fd), status, (int)strlen(body),
+             connection_header(context_fd), extra);
+
+    if(write_response(context_fd->fd, buffer, body, strlen(body)) < 0) {
+        DBG("write failed, done anyway\n");
+        context_fd->keep_alive = 0;
     }
+}
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+/******************************************************************************
+Description.: Answer a request for a file of the cache. The file is sent in
+              the best encoding the client accepts, unchanged files are
+              answered with "304 Not Modified".
+Input Value.: * context_fd: connection to send the file to
+              * req.......: the request, for the conditional and encoding headers
+              * file......: the file
+Return Value: -
+******************************************************************************/
+static void send_cached_file(cfd *context_fd, request *req, cached_file *file)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    cached_variant *v = filecache_variant(file, req->accept_encoding);
+    int not_modified;
+
+    /* If-Modified-Since is only evaluated if the client did not send an ETag */
+    if(req->if_none_match != NULL)
+        not_modified = (strstr(req->if_none_match, v->etag) != NULL || strcmp(req->if_none_match, "*") == 0);
+    else
+        not_modified = (req->if_modified_since != NULL && strcmp(req->if_modified_since, file->last_modified) == 0);
+
+    snprintf(buffer, sizeof(buffer), "%s %s\r\n" \
+             "%s" \
+             "%s" \
+             "\r\n", http_version(context_fd), not_modified ? "304 Not Modified" : "200 OK",
+             connection_header(context_fd), v->header);
+
+    if(write_response(context_fd->fd, buffer, not_modified ? NULL : v->data, v->size) < 0) {
         DBG("write failed, done anyway\n");
+        context_fd->keep_alive = 0;
     }
 }
 
@@ -695,22 +2181,36 @@ Description.: Send HTTP header and copy the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
               If no parameter was given, the file "index.html" will be copied.
-Input Value.: * fd.......: filedescriptor to send data to
-              * id.......: specifies which server-context is the right one
-              * parameter: string that consists of the filename
+              Files are served from the cache of the server if possible, all
+              others are copied with sendfile().
+Input Value.: * context_fd: connection to send data to, also specifies which
+                            server-context is the right one
+              * req.......: the request, its parameter is the filename
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(cfd *context_fd, request *req)
 {
     char buffer[BUFFER_SIZE] = {0};
-    char *extension, *mimetype = NULL;
-    int i, lfd;
-    config conf = servers[id].conf;
+    char *extension, *mimetype = NULL, *parameter = req->parameter;
+    int i, lfd, fd = context_fd->fd;
+    config conf = context_fd->pc->conf;
+    cached_file *file;
+    struct stat st;
+    off_t offset = 0;
+    ssize_t rc;
 
     /* in case no parameter was given */
     if(parameter == NULL || strlen(parameter) == 0)
         parameter = "index.html";
 
+    if(context_fd->pc->cache_enabled &&
+       (file = filecache_get(&context_fd->pc->cache, parameter)) != NULL) {
+        DBG("serving cached file \"%s\"\n", parameter);
+        send_cached_file(context_fd, req, file);
+        filecache_put(&context_fd->pc->cache, file);
+        return;
+    }
+
     /* find file-extension */
     char * pch;
     pch = strchr(parameter, '.');
@@ -721,7 +2221,7 @@ void send_file(int id, int fd, char *parameter)
     }
 
     if(lastDot == 0) {
-        send_error(fd, 400, "No file extension found");
+        send_error(context_fd, 400, "No file extension found");
         return;
     } else {
         extension = parameter + lastDot;
@@ -738,7 +2238,7 @@ void send_file(int id, int fd, char *parameter)
 
     /* in case of unknown mimetype or extension leave */
     if(mimetype == NULL) {
-        send_error(fd, 404, "MIME-TYPE not known");
+        send_error(context_fd, 404, "MIME-TYPE not known");
         return;
     }
 
@@ -750,27 +2250,43 @@ void send_file(int id, int fd, char *parameter)
     strncat(buffer, parameter, sizeof(buffer) - strlen(buffer) - 1);
 
     /* try to open that file */
-    if((lfd = open(buffer, O_RDONLY)) < 0) {
+    if((lfd = open(buffer, O_RDONLY)) < 0 || fstat(lfd, &st) < 0) {
         DBG("file %s not accessible\n", buffer);
-        send_error(fd, 404, "Could not open file");
+        if(lfd >= 0)
+            close(lfd);
+        send_error(context_fd, 404, "Could not open file");
         return;
     }
     DBG("opened file: %s\n", buffer);
 
     /* prepare HTTP header */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+    sprintf(buffer, "%s 200 OK\r\n" \
             "Content-type: %s\r\n" \
+            "Content-Length: %ld\r\n" \
+            "%s" \
             STD_HEADER \
-            "\r\n", mimetype);
-    i = strlen(buffer);
+            "\r\n", http_version(context_fd), mimetype, (long)st.st_size,
+            connection_header(context_fd));
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    do {
-        if(write(fd, buffer, i) < 0) {
-            close(lfd);
-            return;
+    /* first transmit HTTP-header, it shares the first segment with the file */
+    if(send(fd, buffer, strlen(buffer), MSG_MORE) < 0) {
+        context_fd->keep_alive = 0;
+        close(lfd);
+        return;
+    }
+
+    /* afterwards transmit content of file, without copying it through a buffer */
+    while(offset < st.st_size) {
+        if((rc = sendfile(fd, lfd, &offset, st.st_size - offset)) <= 0) {
+            if(rc < 0 && errno == EINTR)
+                continue;
+            break;
         }
-    } while((i = read(lfd, buffer, sizeof(buffer))) > 0);
+    }
+
+    /* the announced length can not be kept if the file shrunk meanwhile */
+    if(offset != st.st_size)
+        context_fd->keep_alive = 0;
 
     /* close file, job done */
     close(lfd);
@@ -778,20 +2294,23 @@ void send_file(int id, int fd, char *parameter)
 
 /******************************************************************************
 Description.: Executes the specified CGI file if exists
-Input Value.: * fd...........: filedescriptor to send data to
-              * id...........: specifies which server-context is the right one
+Input Value.: * context_fd...: connection to send data to, also specifies which
+                              server-context is the right one
               * parameter....: the requested file name
               * query_string.: query parameters
 Return Value: -
 ******************************************************************************/
-void execute_cgi(int id, int fd, char *parameter, char *query_string)
+void execute_cgi(cfd *context_fd, char *parameter, char *query_string)
 {
-    int lfd = 0, i;
+    int lfd = 0, i, fd = context_fd->fd;
     int buffer_length = 0;
     char *buffer = NULL;
     char fn_buffer[BUFFER_SIZE] = {0};
     FILE *f = NULL;
-    config conf = servers[id].conf;
+    config conf = context_fd->pc->conf;
+
+    /* the script output has no known length, the connection ends with it */
+    context_fd->keep_alive = 0;
 
     /* build the absolute path to the file */
     strncat(fn_buffer, conf.www_folder, sizeof(fn_buffer) - 1);
@@ -799,7 +2318,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
     if((lfd = open(fn_buffer, O_RDONLY)) < 0) {
         DBG("file %s not accessible\n", fn_buffer);
-        send_error(fd, 404, "Could not open file");
+        send_error(context_fd, 404, "Could not open file");
         return;
     }
 
@@ -834,7 +2353,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
     f = popen(buffer, "r");
     if(f == NULL) {
         DBG("Unable to execute the requested CGI script\n");
-        send_error(fd, 403, "CGI script cannot be executed");
+        send_error(context_fd, 403, "CGI script cannot be executed");
         return;
     }
 
@@ -848,15 +2367,15 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
 
 /******************************************************************************
-Description.: Perform a command specified by parameter. Send response to fd.
-Input Value.: * fd.......: filedescriptor to send HTTP response to.
-              * parameter: contains the command and value as string.
-              * id.......: specifies which server-context to choose.
-Return Value: -
+Description.: Perform a command specified by parameter. The answer is the
+              same for HTTP requests and messages of WebSocket clients.
+Input Value.: * parameter: contains the command and value as string.
+              * answer...: receives "<command>: <result>" or an error message
+              * size.....: size of answer
+Return Value: HTTP status code, 200 if the command was executed
 ******************************************************************************/
-void command(int id, int fd, char *parameter)
+int execute_command(char *parameter, char *answer, size_t size)
 {
-    char buffer[BUFFER_SIZE] = {0};
     char *command = NULL, *svalue = NULL, *value, *command_id_string;
     int res = 0, ivalue = 0, command_id = -1,  len = 0;
 
@@ -865,8 +2384,8 @@ void command(int id, int fd, char *parameter)
     /* sanity check of parameter-string */
     if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
         DBG("parameter string looks bad\n");
-        send_error(fd, 400, "Parameter-string of command does not look valid.");
-        return;
+        snprintf(answer, size, "Parameter-string of command does not look valid.");
+        return 400;
     }
 
     /* command format:
@@ -882,17 +2401,17 @@ void command(int id, int fd, char *parameter)
     /* search for required variable "command" */
     if((command = strstr(parameter, "id=")) == NULL) {
         DBG("no command id specified\n");
-        send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
-        return;
+        snprintf(answer, size, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
+        return 400;
     }
 
     /* allocate and copy command string */
     command += strlen("id=");
     len = strspn(command, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_1234567890");
     if((command = strndup(command, len)) == NULL) {
-        send_error(fd, 500, "could not allocate memory");
+        snprintf(answer, size, "could not allocate memory");
         LOG("could not allocate memory\n");
-        return;
+        return 500;
     }
 
     /* convert the command to id */
@@ -900,9 +2419,9 @@ void command(int id, int fd, char *parameter)
     len = strspn(command_id_string, "-1234567890");
     if((svalue = strndup(command_id_string, len)) == NULL) {
         if(command != NULL) free(command);
-        send_error(fd, 500, "could not allocate memory");
+        snprintf(answer, size, "could not allocate memory");
         LOG("could not allocate memory\n");
-        return;
+        return 500;
     }
 
     command_id = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
@@ -914,9 +2433,9 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            snprintf(answer, size, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return 500;
         }
         ivalue = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The command value converted value form string %s to integer %d\n", svalue, ivalue);
@@ -928,9 +2447,9 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            snprintf(answer, size, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return 500;
         }
         group = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The command type value converted value form string %s to integer %d\n", svalue, group);
@@ -942,9 +2461,9 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            snprintf(answer, size, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return 500;
         }
         dest = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         #ifdef DEBUG
@@ -968,9 +2487,9 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            snprintf(answer, size, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return 500;
         }
         plugin_no = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The plugin number value converted value form string %s to integer %d\n", svalue, plugin_no);
@@ -980,14 +2499,14 @@ void command(int id, int fd, char *parameter)
 
     switch(dest) {
     case Dest_Input:
-        if(plugin_no < pglobal->incnt) {
+        if(plugin_no < pglobal->incnt && pglobal->in[plugin_no].cmd != NULL) {
             res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
         } else {
             DBG("Invalid plugin number: %d because only %d input plugins loaded", plugin_no,  pglobal->incnt-1);
         }
         break;
     case Dest_Output:
-        if(plugin_no < pglobal->outcnt) {
+        if(plugin_no < pglobal->outcnt && pglobal->out[plugin_no].cmd != NULL) {
             res = pglobal->out[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
         } else {
             DBG("Invalid plugin number: %d because only %d output plugins loaded", plugin_no,  pglobal->incnt-1);
@@ -999,19 +2518,86 @@ void command(int id, int fd, char *parameter)
         fprintf(stderr, "Illegal command destination: %d\n", dest);
     }
 
+    snprintf(answer, size, "%s: %d", command, res);
+
+    if(command != NULL) free(command);
+    if(svalue != NULL) free(svalue);
+
+    return 200;
+}
+
+/******************************************************************************
+Description.: Perform a command specified by parameter. Send response to fd.
+Input Value.: * context_fd: connection to send the HTTP response to.
+              * parameter.: contains the command and value as string.
+Return Value: -
+******************************************************************************/
+void command(cfd *context_fd, char *parameter)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    char body[BUFFER_SIZE] = {0};
+    int status;
+
+    if((status = execute_command(parameter, body, sizeof(body))) != 200) {
+        send_error(context_fd, status, body);
+        return;
+    }
+
     /* Send HTTP-response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+    sprintf(buffer, "%s 200 OK\r\n" \
             "Content-type: text/plain\r\n" \
+            "Content-Length: %d\r\n" \
+            "%s" \
             STD_HEADER \
-            "\r\n" \
-            "%s: %d", command, res);
+            "\r\n", http_version(context_fd), (int)strlen(body),
+            connection_header(context_fd));
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(write_response(context_fd->fd, buffer, body, strlen(body)) < 0) {
         DBG("write failed, done anyway\n");
+        context_fd->keep_alive = 0;
     }
+}
 
-    if(command != NULL) free(command);
-    if(svalue != NULL) free(svalue);
+/******************************************************************************
+Description.: Decides whether the connection is kept open after answering a
+              request. Only answers with a known length qualify, long-lived
+              streams and CGI output still end the connection.
+Input Value.: * lcfd: the connection, including the number of served requests
+              * req.: the parsed request
+Return Value: 1 if the connection stays open, 0 otherwise
+******************************************************************************/
+static int keepalive_allowed(cfd *lcfd, request *req)
+{
+    if(lcfd->pc->conf.keepalive_timeout <= 0 ||
+       lcfd->requests >= lcfd->pc->conf.keepalive_requests)
+        return 0;
+
+    switch(req->type) {
+    case A_SNAPSHOT:
+    case A_SNAPSHOT_WXP:
+    case A_TAKE:
+    case A_COMMAND:
+    case A_FILE:
+    case A_INPUT_JSON:
+    case A_OUTPUT_JSON:
+    case A_PROGRAM_JSON:
+    case A_STATS_JSON:
+    #ifdef MANAGMENT
+    case A_CLIENTS_JSON:
+    #endif
+        break;
+    default:
+        return 0;
+    }
+
+    if(req->connection == CONN_CLOSE)
+        return 0;
+
+    /* HTTP/1.0 clients have to ask for it explicitly */
+    if(req->http_minor == 0 && req->connection != CONN_KEEPALIVE)
+        return 0;
+
+    return 1;
 }
 
 /******************************************************************************
@@ -1027,12 +2613,11 @@ Return Value: always NULL
 /* thread for clients that connected to this server */
 void *client_thread(void *arg)
 {
-    int cnt;
-    char query_suffixed = 0;
+    int cnt, timeout, flags, streaming, invalid, nodelay = 0;
     int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
     iobuffer iobuf;
     request req;
+    stream_options stream;
     cfd lcfd; /* local-connected-file-descriptor */
 
     /* we really need the fildescriptor and it must be freeable by us */
@@ -1042,381 +2627,276 @@ void *client_thread(void *arg)
     } else
         return NULL;
 
+    lcfd.keep_alive = 0;
+    lcfd.requests = 0;
+
     /* initializes the structures */
     init_iobuffer(&iobuf);
-    init_request(&req);
-
-    /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
-        return NULL;
-    }
 
-    req.query_string = NULL;
-
-    /* determine what to deliver */
-    if(strstr(buffer, "GET /?action=snapshot") != NULL) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".jpg") != NULL)) {
-        req.type = A_SNAPSHOT_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #endif
-    } else if(strstr(buffer, "POST /stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    } else if(strstr(buffer, "GET /?action=stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".mjpg") != NULL)) {
-        req.type = A_STREAM_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+    /*
+     * serve requests until the client or the answer closes the connection,
+     * unread bytes of pipelined requests are kept in iobuf
+     */
+    do {
+        /* What does the client want to receive? Read the request header. */
+        timeout = (lcfd.requests == 0) ? 5 : lcfd.pc->conf.keepalive_timeout;
+        cnt = read_request(lcfd.fd, &iobuf, timeout);
+
+        /* everything up to the parsed headers is answered with "Connection: close" */
+        lcfd.keep_alive = 0;
+        if(cnt == -2) {
+            DBG("HTTP request header too large\n");
+            send_error(&lcfd, 431, "Request header too large");
+            break;
+        } else if(cnt < 0) {
+            break;
         }
-        #endif
-    #endif
-    } else if(strstr(buffer, "GET /?action=take") != NULL) {
-        int len;
-        req.type = A_TAKE;
-        query_suffixed = 255;
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=take")) == NULL) {
+        init_request(&req);
+        if(parse_request(iobuf.buffer, cnt, &req) < 0) {
             DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            query_suffixed = 0;
-            return NULL;
-        }
-        pb += strlen("GET /?action=take"); // a pb points to thestring after the first & after command
-
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
+            send_error(&lcfd, 400, "Malformed HTTP request");
+            free_request(&req);
+            break;
         }
-    } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_INPUT_JSON;
-        query_suffixed = 255;
-    } else if((strstr(buffer, "GET /output") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_OUTPUT_JSON;
-        query_suffixed = 255;
-    } else if(strstr(buffer, "GET /program.json") != NULL) {
-        req.type = A_PROGRAM_JSON;
-    #ifdef MANAGMENT
-    } else if(strstr(buffer, "GET /clients.json") != NULL) {
-        req.type = A_CLIENTS_JSON;
-    #endif
-    } else if(strstr(buffer, "GET /?action=command") != NULL) {
-        int len;
-        req.type = A_COMMAND;
+        consume_request(&iobuf, cnt);
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=command")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
+        /* determine what to deliver */
+        if((flags = route_request(&req, &input_number)) < 0) {
+            send_error(&lcfd, 500, "not enough memory");
+            free_request(&req);
+            break;
         }
-        pb += strlen("GET /?action=command"); // a pb points to thestring after the first & after command
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        if(req.type == A_UNKNOWN) {
+            send_error(&lcfd, 501, "Request method not supported");
+            free_request(&req);
+            break;
         }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
 
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
+        if((flags & ROUTE_PARAMETER) && unescape(req.parameter) == -1) {
+            send_error(&lcfd, 500, "could not properly unescape command parameter string");
             LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
+            free_request(&req);
+            break;
         }
 
-        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
-    } else {
-        int len;
-
-        DBG("try to serve a file\n");
-        req.type = A_FILE;
-
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
+        #ifdef MANAGMENT
+        if((flags & ROUTE_MANAGED) && check_client_status(lcfd.client)) {
+            req.type = A_UNKNOWN;
+            flags = 0;
+            __atomic_add_fetch(&lcfd.client->last_take_time, piggy_fine * 1000000LL, __ATOMIC_RELAXED);
+            send_error(&lcfd, 403, "frame already sent");
         }
+        #endif
 
-        pb += strlen("GET /");
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        /* decide if the connection stays open after this answer */
+        lcfd.requests++;
+        pthread_mutex_lock(&lcfd.pc->stats.mutex);
+        lcfd.pc->stats.requests++;
+        pthread_mutex_unlock(&lcfd.pc->stats.mutex);
+        lcfd.keep_alive = keepalive_allowed(&lcfd, &req);
+        if(lcfd.keep_alive && !nodelay) {
+            /* answers are small and written at once, there is nothing to coalesce */
+            nodelay = 1;
+            setsockopt(lcfd.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         }
 
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if (strstr(pb, ".cgi") != NULL) {
-            req.type = A_CGI;
-            pb = strchr(pb, '?');
-            if (pb != NULL) {
-                pb++; // skip the ?
-                len = strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&");
-                req.query_string = malloc(len + 1);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                strncpy(req.query_string, pb, len);
-            } else {
-                req.query_string = malloc(2);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                sprintf(req.query_string, " ");
+        /* check for username and password if parameter -c was given */
+        if(lcfd.pc->conf.credentials != NULL) {
+            if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
+                DBG("access denied\n");
+                send_error(&lcfd, 401, "username and password do not match to configuration");
+                free_request(&req);
+                continue;
             }
+            DBG("access granted\n");
         }
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
-    }
 
-    /*
-     * Since when we are working with multiple input plugins
-     * there are some url which could have a _[plugin number suffix]
-     * For compatibility reasons it could be left in that case the output will be
-     * generated from the 0. input plugin
-     */
-    if(query_suffixed) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
-
-            if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
-                input_number--;
+        /* streams are subject to the limits of the server */
+        streaming = 0;
+        if(req.type == A_STREAM || req.type == A_STREAM_WXP || req.type == A_WEBSOCKET) {
+            if(admit_stream(&lcfd) < 0) {
+                DBG("stream refused, limit of concurrent streams reached\n");
+                send_error(&lcfd, 503, "too many streams");
+                req.type = A_UNKNOWN;
+                flags = 0;
+            } else {
+                streaming = 1;
             }
         }
-        DBG("plugin_no: %d\n", input_number);
-    }
-
-    /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
-     */
-    do {
-        memset(buffer, 0, sizeof(buffer));
-
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
-        }
-
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
-        }
-
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
 
-    /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
-            DBG("access denied\n");
-            send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
+        /* now it's time to answer */
+        if(flags & ROUTE_INPUT) {
+            if (req.type == A_OUTPUT_JSON) {
+                if(!(input_number < pglobal->outcnt)) {
+                    DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
+                    send_error(&lcfd, 404, "Invalid output plugin number");
+                    req.type = A_UNKNOWN;
+                }
+            } else {
+                if(!(input_number < pglobal->incnt)) {
+                    DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
+                    send_error(&lcfd, 404, "Invalid input plugin number");
+                    req.type = A_UNKNOWN;
+                }
+            }
         }
-        DBG("access granted\n");
-    }
 
-    /* now it's time to answer */
-    if (query_suffixed) {
-        if (req.type == A_OUTPUT_JSON) {
-            if(!(input_number < pglobal->outcnt)) {
-                DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
-                send_error(lcfd.fd, 404, "Invalid output plugin number");
-                req.type = A_UNKNOWN;
+        switch(req.type) {
+        case A_SNAPSHOT_WXP:
+        case A_SNAPSHOT:
+            DBG("Request for snapshot from input: %d\n", input_number);
+            send_snapshot(&lcfd, input_number);
+            break;
+        case A_STREAM:
+            DBG("Request for stream from input: %d\n", input_number);
+            if((invalid = parse_stream_options(req.query_string, &stream)) < 0) {
+                stream_options_error(&lcfd, invalid);
+                break;
             }
-        } else {
-            if(!(input_number < pglobal->incnt)) {
-                DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
-                send_error(lcfd.fd, 404, "Invalid input plugin number");
-                req.type = A_UNKNOWN;
+            send_stream(&lcfd, input_number, &stream);
+            break;
+        #ifdef WXP_COMPAT
+        case A_STREAM_WXP:
+            DBG("Request for WXP compat stream from input: %d\n", input_number);
+            if((invalid = parse_stream_options(req.query_string, &stream)) < 0) {
+                stream_options_error(&lcfd, invalid);
+                break;
             }
-        }
-    }
-
-    switch(req.type) {
-    case A_SNAPSHOT_WXP:
-    case A_SNAPSHOT:
-        DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
-        break;
-    case A_STREAM:
-        DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
-        break;
-    #ifdef WXP_COMPAT
-    case A_STREAM_WXP:
-        DBG("Request for WXP compat stream from input: %d\n", input_number);
-        send_stream_wxp(&lcfd, input_number);
-        break;
-    #endif
-    case A_COMMAND:
-        if(lcfd.pc->conf.nocommands) {
-            send_error(lcfd.fd, 501, "this server is configured to not accept commands");
+            send_stream_wxp(&lcfd, input_number, &stream);
             break;
-        }
-        command(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    case A_INPUT_JSON:
-        DBG("Request for the Input plugin descriptor JSON file\n");
-        send_input_JSON(lcfd.fd, input_number);
-        break;
-    case A_OUTPUT_JSON:
-        DBG("Request for the Output plugin descriptor JSON file\n");
-        send_output_JSON(lcfd.fd, input_number);
-        break;
-    case A_PROGRAM_JSON:
-        DBG("Request for the program descriptor JSON file\n");
-        send_program_JSON(lcfd.fd);
-        break;
-    #ifdef MANAGMENT
-    case A_CLIENTS_JSON:
-        DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
-        break;
-    #endif
-    case A_FILE:
-        if(lcfd.pc->conf.www_folder == NULL)
-            send_error(lcfd.fd, 501, "no www-folder configured");
-        else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    /*
-        With the take argument we try to save the current image to file before we transmit it to the user.
-        This is done trough the output_file plugin.
-        If it not loaded, or the file could not be saved then we won't transmit the frame.
-    */
-    case A_TAKE: {
-        int i, ret = 0, found = 0;
-        for (i = 0; i<pglobal->outcnt; i++) {
-            if (pglobal->out[i].name != NULL) {
-                if (strstr(pglobal->out[i].name, "FILE output plugin")) {
-                    found = 255;
-                    DBG("output_file found id: %d\n", i);
-                    char *filename = NULL;
-                    char *filenamearg = NULL;
-                    int len = 0;
-                    DBG("Buffer: %s \n", req.parameter);
-                    if((filename = strstr(req.parameter, "filename=")) != NULL) {
-                        filename += strlen("filename=");
-                        char *fn = strchr(filename, '&');
-                        if (fn == NULL)
-                            len = strlen(filename);
-                        else
-                            len = (int)(fn - filename);
-                        filenamearg = (char*)calloc(len, sizeof(char));
-                        memcpy(filenamearg, filename, len);
-                        DBG("Filename = %s\n", filenamearg);
-                        //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
-                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
-                    } else {
-                        DBG("filename is not specified int the URL\n");
-                        send_error(lcfd.fd, 404, "The &filename= must present for the take command in the URL");
+        #endif
+        case A_WEBSOCKET:
+            DBG("Request for WebSocket from input: %d\n", input_number);
+            if((invalid = parse_stream_options(req.query_string, &stream)) < 0) {
+                stream_options_error(&lcfd, invalid);
+                break;
+            }
+            send_websocket(&lcfd, input_number, &stream, &req, &iobuf);
+            break;
+        case A_EVENTS:
+            DBG("Request for events of input: %d\n", input_number);
+            send_events(&lcfd, input_number, req.query_string);
+            break;
+        case A_COMMAND:
+            if(lcfd.pc->conf.nocommands) {
+                send_error(&lcfd, 501, "this server is configured to not accept commands");
+                break;
+            }
+            command(&lcfd, req.parameter);
+            break;
+        case A_INPUT_JSON:
+            DBG("Request for the Input plugin descriptor JSON file\n");
+            send_plugin_JSON(&lcfd, &req, JSON_INPUT, input_number);
+            break;
+        case A_OUTPUT_JSON:
+            DBG("Request for the Output plugin descriptor JSON file\n");
+            send_plugin_JSON(&lcfd, &req, JSON_OUTPUT, input_number);
+            break;
+        case A_PROGRAM_JSON:
+            DBG("Request for the program descriptor JSON file\n");
+            send_plugin_JSON(&lcfd, &req, JSON_PROGRAM, 0);
+            break;
+        case A_STATS_JSON:
+            DBG("Request for the statistics JSON file\n");
+            send_stats_JSON(&lcfd);
+            break;
+        #ifdef MANAGMENT
+        case A_CLIENTS_JSON:
+            DBG("Request for the clients JSON file\n");
+            send_clients_JSON(&lcfd);
+            break;
+        #endif
+        case A_FILE:
+            if(lcfd.pc->conf.www_folder == NULL)
+                send_error(&lcfd, 501, "no www-folder configured");
+            else
+                send_file(&lcfd, &req);
+            break;
+        /*
+            With the take argument we try to save the current image to file before we transmit it to the user.
+            This is done trough the output_file plugin.
+            If it not loaded, or the file could not be saved then we won't transmit the frame.
+        */
+        case A_TAKE: {
+            int i, ret = 0, found = 0;
+            for (i = 0; i<pglobal->outcnt; i++) {
+                if (pglobal->out[i].name != NULL) {
+                    if (strstr(pglobal->out[i].name, "FILE output plugin")) {
+                        found = 255;
+                        DBG("output_file found id: %d\n", i);
+                        char *filename = NULL;
+                        char *filenamearg = NULL;
+                        int len = 0;
+                        DBG("Buffer: %s \n", req.parameter);
+                        if((filename = strstr(req.parameter, "filename=")) != NULL) {
+                            filename += strlen("filename=");
+                            char *fn = strchr(filename, '&');
+                            if (fn == NULL)
+                                len = strlen(filename);
+                            else
+                                len = (int)(fn - filename);
+                            if(pglobal->out[i].cmd == NULL ||
+                               (filenamearg = (char*)calloc(len + 1, sizeof(char))) == NULL) {
+                                ret = -1;
+                                break;
+                            }
+                            memcpy(filenamearg, filename, len);
+                            DBG("Filename = %s\n", filenamearg);
+                            //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
+                            ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
+                            free(filenamearg);
+                        } else {
+                            DBG("filename is not specified int the URL\n");
+                            ret = -2;
+                        }
+                        break;
                     }
-                    break;
                 }
             }
-        }
 
-        if (found == 0) {
-            LOG("FILE CHANGE TEST output plugin not loaded\n");
-            send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
-        } else {
-            if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
+            if (found == 0) {
+                LOG("FILE CHANGE TEST output plugin not loaded\n");
+                send_error(&lcfd, 404, "FILE output plugin not loaded, taking snapshot not possible");
             } else {
-                send_error(lcfd.fd, 404, "Taking snapshot failed!");
+                /* exactly one answer, the connection may serve further requests */
+                if (ret == 0) {
+                    send_snapshot(&lcfd, input_number);
+                } else if (ret == -2) {
+                    send_error(&lcfd, 404, "The &filename= must present for the take command in the URL");
+                } else {
+                    send_error(&lcfd, 404, "Taking snapshot failed!");
+                }
             }
+            } break;
+        case A_CGI:
+            DBG("cgi script: %s requested\n", req.parameter);
+            execute_cgi(&lcfd, req.parameter, req.query_string);
+            break;
+        default:
+            DBG("unknown request\n");
         }
-        } break;
-    case A_CGI:
-        DBG("cgi script: %s requested\n", req.parameter);
-        execute_cgi(lcfd.pc->id, lcfd.fd, req.parameter, req.query_string);
-        break;
-    default:
-        DBG("unknown request\n");
-    }
+
+        if(streaming)
+            release_stream(&lcfd);
+
+        free_request(&req);
+    } while(lcfd.keep_alive && !pglobal->stop);
 
     close(lcfd.fd);
-    free_request(&req);
+
+    #ifdef MANAGMENT
+    release_client(lcfd.client);
+    #endif
+
+    pthread_mutex_lock(&lcfd.pc->stats.mutex);
+    lcfd.pc->stats.clients--;
+    pthread_mutex_unlock(&lcfd.pc->stats.mutex);
 
     DBG("leaving HTTP client thread\n");
     return NULL;
 }
-
 /******************************************************************************
 Description.: This function cleans up resources allocated by the server_thread
 Input Value.: arg is not used
@@ -1425,643 +2905,554 @@ Return Value: -
 void server_cleanup(void *arg)
 {
     context *pcontext = arg;
-    int i;
+    int i, k;
 
     OPRINT("cleaning up resources allocated by server thread #%02d\n", pcontext->id);
 
-    for(i = 0; i < MAX_SD_LEN; i++)
-        close(pcontext->sd[i]);
-}
-
-/******************************************************************************
-Description.: Open a TCP socket and wait for clients to connect. If clients
-              connect, start a new thread for each accepted connection.
-Input Value.: arg is a pointer to the globals struct
-Return Value: always NULL, will only return on exit
-******************************************************************************/
-void *server_thread(void *arg)
-{
-    int on;
-    pthread_t client;
-    struct addrinfo *aip, *aip2;
-    struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    fd_set selectfds;
-    int max_fds = 0;
-    char name[NI_MAXHOST];
-    int err;
-    int i;
-
-    context *pcontext = arg;
-    pglobal = pcontext->pglobal;
-
-    /* set cleanup handler to cleanup resources */
-    pthread_cleanup_push(server_cleanup, pcontext);
-
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_socktype = SOCK_STREAM;
-
-    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
-    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
-        perror(gai_strerror(err));
-        exit(EXIT_FAILURE);
+    /* the first acceptor is the server thread itself */
+    for(i = 1; i < pcontext->conf.acceptors; i++) {
+        if(pcontext->acceptors[i].threadID) {
+            pthread_cancel(pcontext->acceptors[i].threadID);
+            pthread_join(pcontext->acceptors[i].threadID, NULL);
+            pcontext->acceptors[i].threadID = 0;
+        }
     }
 
-    for(i = 0; i < MAX_SD_LEN; i++)
-        pcontext->sd[i] = -1;
+    for(i = 0; i < MAX_ACCEPTORS; i++) {
+        for(k = 0; k < MAX_SD_LEN; k++) {
+            if(pcontext->acceptors[i].sd[k] != -1)
+                close(pcontext->acceptors[i].sd[k]);
+            pcontext->acceptors[i].sd[k] = -1;
+        }
+    }
 
-    #ifdef MANAGMENT
-    if (pthread_mutex_init(&client_infos.mutex, NULL)) {
-        perror("Mutex initialization failed");
-        exit(EXIT_FAILURE);
+    if(pcontext->cache_enabled) {
+        pcontext->cache_enabled = 0;
+        filecache_free(&pcontext->cache);
     }
+}
 
-    client_infos.client_count = 0;
-    client_infos.infos = NULL;
-    #endif
+/******************************************************************************
+Description.: Open the listening sockets of an acceptor, one per address
+              family. If the server runs several acceptors each of them binds
+              its own sockets to the same port with SO_REUSEPORT.
+Input Value.: * pcontext: the server
+              * a.......: the acceptor to open the sockets for
+              * aip.....: the addresses to listen to
+Return Value: number of sockets opened
+******************************************************************************/
+static int open_listeners(context *pcontext, acceptor *a, struct addrinfo *aip)
+{
+    struct addrinfo *aip2;
+    int on, sd, i = 0;
 
-    /* open sockets for server (1 socket / address family) */
-    i = 0;
     for(aip2 = aip; aip2 != NULL; aip2 = aip2->ai_next) {
-        if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
+        if((sd = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
             continue;
         }
 
         /* ignore "socket already in use" errors */
         on = 1;
-        if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
             perror("setsockopt(SO_REUSEADDR) failed\n");
         }
 
+        /* let the kernel balance new connections between the acceptors */
+        on = 1;
+        if(pcontext->conf.acceptors > 1 && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed\n");
+        }
+
         /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
         on = 1;
-        if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
+        if(aip2->ai_family == AF_INET6 && setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY,
                 (const void *)&on , sizeof(on)) < 0) {
             perror("setsockopt(IPV6_V6ONLY) failed\n");
         }
 
+        /* wake up the acceptor only after the client sent its request */
+        if(pcontext->conf.defer_accept > 0 && setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &pcontext->conf.defer_accept, sizeof(int)) < 0) {
+            perror("setsockopt(TCP_DEFER_ACCEPT) failed\n");
+        }
+
         /* perhaps we will use this keep-alive feature oneday */
         /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
 
-        if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
+        if(bind(sd, aip2->ai_addr, aip2->ai_addrlen) < 0) {
             perror("bind");
-            pcontext->sd[i] = -1;
+            close(sd);
             continue;
         }
 
-        if(listen(pcontext->sd[i], 10) < 0) {
+        if(listen(sd, pcontext->conf.backlog) < 0) {
             perror("listen");
-            pcontext->sd[i] = -1;
-        } else {
-            i++;
-            if(i >= MAX_SD_LEN) {
-                OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
-                i--;
-                break;
-            }
+            close(sd);
+            continue;
+        }
+
+        a->sd[i++] = sd;
+        if(i >= MAX_SD_LEN) {
+            OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
+            break;
         }
     }
 
-    pcontext->sd_len = i;
+    a->sd_len = i;
+    return i;
+}
+
+/******************************************************************************
+Description.: Accept a connection and start a new thread to serve it
+Input Value.: * pcontext: the server
+              * sd......: the listening socket with a pending connection
+Return Value: -
+******************************************************************************/
+static void accept_client(context *pcontext, int sd)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(struct sockaddr_storage);
+    char name[NI_MAXHOST];
+    pthread_t client;
+    cfd *pcfd = malloc(sizeof(cfd));
 
-    if(pcontext->sd_len < 1) {
-        OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
-        closelog();
+    if(pcfd == NULL) {
+        fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
         exit(EXIT_FAILURE);
     }
 
-    /* create a child for every client that connects */
-    while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        DBG("waiting for clients to connect\n");
+    if((pcfd->fd = accept(sd, (struct sockaddr *)&client_addr, &addr_len)) < 0) {
+        DBG("accept() failed: %s\n", strerror(errno));
+        pthread_mutex_lock(&pcontext->stats.mutex);
+        pcontext->stats.accept_errors++;
+        pthread_mutex_unlock(&pcontext->stats.mutex);
+        free(pcfd);
+        return;
+    }
+    pcfd->pc = pcontext;
 
-        do {
-            FD_ZERO(&selectfds);
+    /* start new thread that will handle this TCP connected client */
+    DBG("create thread to handle client that just established a connection\n");
 
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] != -1) {
-                    FD_SET(pcontext->sd[i], &selectfds);
+    if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
+        DBG("serving client: %s\n", name);
+    } else {
+        snprintf(name, sizeof(name), "unknown");
+    }
+    snprintf(pcfd->address, sizeof(pcfd->address), "%s", name);
 
-                    if(pcontext->sd[i] > max_fds)
-                        max_fds = pcontext->sd[i];
-                }
-            }
+    #if defined(MANAGMENT)
+    pcfd->client = add_client(name);
+    #endif
 
-            err = select(max_fds + 1, &selectfds, NULL, NULL, NULL);
+    pthread_mutex_lock(&pcontext->stats.mutex);
+    pcontext->stats.connections++;
+    pcontext->stats.clients++;
+    pthread_mutex_unlock(&pcontext->stats.mutex);
 
-            if(err < 0 && errno != EINTR) {
-                perror("select");
-                exit(EXIT_FAILURE);
-            }
-        } while(err <= 0);
+    if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
+        DBG("could not launch another client thread\n");
+        close(pcfd->fd);
+        #if defined(MANAGMENT)
+        release_client(pcfd->client);
+        #endif
+        free(pcfd);
+        pthread_mutex_lock(&pcontext->stats.mutex);
+        pcontext->stats.clients--;
+        pthread_mutex_unlock(&pcontext->stats.mutex);
+        return;
+    }
+    pthread_detach(client);
+}
 
-        for(i = 0; i < max_fds + 1; i++) {
-            if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
-                pcfd->pc = pcontext;
+/******************************************************************************
+Description.: Wait for clients to connect to the sockets of an acceptor and
+              start a new thread for each accepted connection. The server
+              thread runs the first acceptor, additional ones get their own
+              thread.
+Input Value.: arg is the acceptor
+Return Value: always NULL, will only return on exit
+******************************************************************************/
+static void *acceptor_thread(void *arg)
+{
+    acceptor *a = arg;
+    struct pollfd fds[MAX_SD_LEN];
+    int i;
 
-                /* start new thread that will handle this TCP connected client */
-                DBG("create thread to handle client that just established a connection\n");
+    for(i = 0; i < a->sd_len; i++) {
+        fds[i].fd = a->sd[i];
+        fds[i].events = POLLIN;
+    }
 
-                if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                    DBG("serving client: %s\n", name);
-                }
+    /* create a child for every client that connects */
+    while(!pglobal->stop) {
+        DBG("waiting for clients to connect\n");
 
-                #if defined(MANAGMENT)
-                pcfd->client = add_client(name);
-                #endif
+        if(poll(fds, a->sd_len, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
 
-                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
-                    DBG("could not launch another client thread\n");
-                    close(pcfd->fd);
-                    free(pcfd);
-                    continue;
-                }
-                pthread_detach(client);
-            }
+        for(i = 0; i < a->sd_len; i++) {
+            if(fds[i].revents & POLLIN)
+                accept_client(a->pc, fds[i].fd);
         }
     }
 
-    DBG("leaving server thread, calling cleanup function now\n");
-    pthread_cleanup_pop(1);
-
     return NULL;
 }
 
 /******************************************************************************
-Description.: Send a JSON file which is contains information about the input plugin's
-              acceptable parameters
-Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+Description.: Open a TCP socket and wait for clients to connect. If clients
+              connect, start a new thread for each accepted connection.
+Input Value.: arg is a pointer to the globals struct
+Return Value: always NULL, will only return on exit
 ******************************************************************************/
-void send_input_JSON(int fd, int input_number)
+void *server_thread(void *arg)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
-    DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
-
-
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->in[input_number].in_parameters != NULL) {
-        for(i = 0; i < pglobal->in[input_number].parametercount; i++) {
-
-            char *menuString = NULL;
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->in[input_number].in_parameters[i].menuitems != NULL) {
-                    int j, k = 1;
-                    for(j = pglobal->in[input_number].in_parameters[i].ctrl.minimum; j <= pglobal->in[input_number].in_parameters[i].ctrl.maximum; j++) {
-                        char *tempName = NULL; // temporary storage for name sanity checking
-
-                        int prevSize = 0;
-                        int itemLength = strlen((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name);
-                        tempName = (char*)calloc(itemLength + 1, sizeof(char));  // allocate space for the sanity checking
-                        if (tempName == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
-
-                        check_JSON_string((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name, tempName); // sanity check the string after non printable characters
-
-                        itemLength += strlen("\"\": \"\"");
+    struct addrinfo *aip;
+    struct addrinfo hints;
+    char name[NI_MAXHOST];
+    int err;
+    int i, k;
 
-                        if (menuString == NULL) {
-                            menuString = calloc(itemLength + 5, sizeof(char));
-                        } else {
-                            menuString = realloc(menuString, (strlen(menuString) + itemLength + 5) * (sizeof(char)));
-                        }
+    context *pcontext = arg;
+    pglobal = pcontext->pglobal;
 
-                        if (menuString == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
-                        prevSize = strlen(menuString);
+    for(i = 0; i < MAX_ACCEPTORS; i++) {
+        pcontext->acceptors[i].pc = pcontext;
+        pcontext->acceptors[i].sd_len = 0;
+        pcontext->acceptors[i].threadID = 0;
+        for(k = 0; k < MAX_SD_LEN; k++)
+            pcontext->acceptors[i].sd[k] = -1;
+    }
 
-                        if(j != pglobal->in[input_number].in_parameters[i].ctrl.maximum) {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , tempName);
-                        } else {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , tempName);
-                        }
-                        k++;
-                        free(tempName);
-                    }
-                }
-            }
+    /* set cleanup handler to cleanup resources */
+    pthread_cleanup_push(server_cleanup, pcontext);
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"0\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->in[input_number].in_parameters[i].ctrl.name,
-                    pglobal->in[input_number].in_parameters[i].ctrl.id,
-                    pglobal->in[input_number].in_parameters[i].ctrl.type,
-                    pglobal->in[input_number].in_parameters[i].ctrl.minimum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.maximum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.step,
-                    pglobal->in[input_number].in_parameters[i].ctrl.default_value,
-                    pglobal->in[input_number].in_parameters[i].value,
-                    // 0 is the code of the input plugin
-                    pglobal->in[input_number].in_parameters[i].ctrl.flags,
-                    pglobal->in[input_number].in_parameters[i].group
-                   );
-
-            // append the menu object to the menu typecontrols
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
-            } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
-            }
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
 
-            if(i != (pglobal->in[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
-            }
-            free(menuString);
-        }
-    } else {
-        DBG("The input plugin has no paramters\n");
-    }
-    sprintf(buffer + strlen(buffer),
-            "\n],\n"
-            /*"},\n"*/);
-
-    sprintf(buffer + strlen(buffer),
-            //"{\n"
-            "\"formats\": [\n");
-    if(pglobal->in[input_number].in_formats != NULL) {
-        for(i = 0; i < pglobal->in[input_number].formatCount; i++) {
-            char *resolutionsString = NULL;
-            int resolutionsStringLength = 0;
-            int j = 0;
-            for(j = 0; j < pglobal->in[input_number].in_formats[i].resolutionCount; j++) {
-                char buffer_num[6];
-                memset(buffer_num, '\0', 6);
-                // JSON format example:
-                // {"0": "320x240", "1": "640x480", "2": "960x720"}
-                sprintf(buffer_num, "%d", j);
-                resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].width);
-                resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                resolutionsStringLength += strlen(buffer_num);
-                if(j != (pglobal->in[input_number].in_formats[i].resolutionCount - 1)) {
-                    resolutionsStringLength += (strlen("\"\": \"x\", ") + 5);
-                    if (resolutionsString == NULL)
-                        resolutionsString = calloc(resolutionsStringLength, sizeof(char*));
-                    else
-                        resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
-                    if (resolutionsString == NULL) {
-                        DBG("Realloc/calloc failed\n");
-                        return;
-                    }
+    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
+    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
+        perror(gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
 
-                    sprintf(resolutionsString + strlen(resolutionsString),
-                            "\"%d\": \"%dx%d\", ",
-                            j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                } else {
-                    resolutionsStringLength += (strlen("\"\": \"x\"")+5);
-                    if (resolutionsString == NULL)
-                        resolutionsString = calloc(resolutionsStringLength, sizeof(char*));
-                    else
-                        resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
-                    if (resolutionsString == NULL) {
-                        DBG("Realloc/calloc failed\n");
-                        return;
-                    }
-                    sprintf(resolutionsString + strlen(resolutionsString),
-                            "\"%d\": \"%dx%d\"",
-                            j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                }
-            }
+    snprintf(pcontext->keepalive_header, sizeof(pcontext->keepalive_header),
+             "Connection: keep-alive\r\n" \
+             "Keep-Alive: timeout=%d, max=%d\r\n",
+             pcontext->conf.keepalive_timeout, pcontext->conf.keepalive_requests);
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"id\": \"%d\",\n"
-                    "\"name\": \"%s\",\n"
-#ifdef V4L2_FMT_FLAG_COMPRESSED
-                    "\"compressed\": \"%s\",\n"
-#endif
-#ifdef V4L2_FMT_FLAG_EMULATED
-                    "\"emulated\": \"%s\",\n"
-#endif
-                    "\"current\": \"%s\",\n"
-                    "\"resolutions\": {%s}\n"
-                    ,
-                    pglobal->in[input_number].in_formats[i].format.index,
-                    pglobal->in[input_number].in_formats[i].format.description,
-#ifdef V4L2_FMT_FLAG_COMPRESSED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_COMPRESSED ? "true" : "false",
-#endif
-#ifdef V4L2_FMT_FLAG_EMULATED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_EMULATED ? "true" : "false",
-#endif
-                    pglobal->in[input_number].in_formats[i].currentResolution != -1 ? "true" : "false",
-                    resolutionsString
-                   );
-
-            if(pglobal->in[input_number].in_formats[i].currentResolution != -1) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n\"currentResolution\": \"%d\"\n",
-                        pglobal->in[input_number].in_formats[i].currentResolution
-                       );
-            }
+    pthread_mutex_init(&pcontext->stats.mutex, NULL);
+    bucket_init(&pcontext->egress, pcontext->conf.egress_rate);
+    framehub_init(pglobal);
 
-            if(i != (pglobal->in[input_number].formatCount - 1)) {
-                sprintf(buffer + strlen(buffer), "},\n");
-            } else {
-                sprintf(buffer + strlen(buffer), "}\n");
-            }
+    /* keep the www-folder in memory, if that fails files are read for each request */
+    if(pcontext->conf.www_folder != NULL && !pcontext->conf.nocache) {
+        if(filecache_init(&pcontext->cache, pcontext->conf.www_folder) == 0) {
+            OPRINT("cached %d files of the www-folder (%lu bytes)\n", pcontext->cache.count, (unsigned long)pcontext->cache.total);
+            pcontext->cache_enabled = 1;
+        } else {
+            OPRINT("could not cache the www-folder, reading files for each request\n");
+        }
+    }
 
-            free(resolutionsString);
+    /* open sockets for server (1 socket / address family and acceptor) */
+    for(i = 0; i < pcontext->conf.acceptors; i++) {
+        if(open_listeners(pcontext, &pcontext->acceptors[i], aip) < 1) {
+            OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
+            closelog();
+            exit(EXIT_FAILURE);
         }
     }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            "}\n");
-    i = strlen(buffer);
+    freeaddrinfo(aip);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
+    for(i = 1; i < pcontext->conf.acceptors; i++) {
+        if(pthread_create(&pcontext->acceptors[i].threadID, NULL, acceptor_thread, &pcontext->acceptors[i]) != 0) {
+            OPRINT("%s(): could not start acceptor thread %d\n", __FUNCTION__, i);
+            exit(EXIT_FAILURE);
+        }
     }
-}
 
+    acceptor_thread(&pcontext->acceptors[0]);
 
-void send_program_JSON(int fd)
+    DBG("leaving server thread, calling cleanup function now\n");
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Send a JSON document along with the headers all JSON answers share
+Input Value.: * context_fd: connection to send the answer to
+              * body......: the complete JSON document
+Return Value: -
+******************************************************************************/
+static void send_JSON_document(cfd *context_fd, const char *body)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i, k;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+    char header[BUFFER_SIZE] = {0};
+    int length = strlen(body);
+
+    sprintf(header, "%s 200 OK\r\n" \
             "Content-type: %s\r\n" \
+            "Content-Length: %d\r\n" \
+            "%s" \
             STD_HEADER \
-            "\r\n", "application/x-javascript");
-
-    DBG("Serving the program descriptor JSON file\n");
-
-
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            /*"\"program\": [\n"
-            "{\n"*/
-            "\"inputs\":[\n");
-    for(k = 0; k < pglobal->incnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
-                "\"id\": \"%d\",\n"
-                "\"name\": \"%s\",\n"
-                "\"plugin\": \"%s\",\n"
-                "\"args\": \"%s\"\n"
-                "}",
-                pglobal->in[k].param.id,
-                pglobal->in[k].name,
-                pglobal->in[k].plugin,
-                pglobal->in[k].param.parameters);
-        if(k != (pglobal->incnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
-    }
-    sprintf(buffer + strlen(buffer),
-            /*"]\n"
-            "}\n"
-            "]\n"*/
-            "],\n");
-    sprintf(buffer + strlen(buffer),
-            "\"outputs\":[\n");
-    for(k = 0; k < pglobal->outcnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
-                "\"id\": \"%d\",\n"
-                "\"name\": \"%s\",\n"
-                "\"plugin\": \"%s\",\n"
-                "\"args\": \"%s\"\n"
-                "}",
-                pglobal->out[k].param.id,
-                pglobal->out[k].name,
-                pglobal->out[k].plugin,
-                pglobal->out[k].param.parameters);
-        if(k != (pglobal->outcnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
+            "\r\n", http_version(context_fd), "application/x-javascript", length,
+            connection_header(context_fd));
+
+    if(write_response(context_fd->fd, header, body, length) < 0) {
+        DBG("unable to serve the JSON file\n");
+        context_fd->keep_alive = 0;
+    }
+}
+
+/******************************************************************************
+Description.: Send a document describing the plugins. It is generated once and
+              only again when the data changed, clients that send the ETag
+              of the current document get "304 Not Modified".
+Input Value.: * context_fd: connection to send the document to
+              * req.......: the request, for If-None-Match
+              * type......: JSON_INPUT, JSON_OUTPUT or JSON_PROGRAM
+              * plugin....: number of the plugin
+Return Value: -
+******************************************************************************/
+void send_plugin_JSON(cfd *context_fd, request *req, int type, int plugin)
+{
+    char header[BUFFER_SIZE] = {0};
+    json_document *document;
+    int not_modified;
+
+    if((document = jsoncache_get(pglobal, type, plugin)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
     }
-    sprintf(buffer + strlen(buffer),
-            /*"]\n"
-            "}\n"
-            "]\n"*/
-            "]}\n");
-    i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the program JSON file\n");
+    not_modified = (req->if_none_match != NULL && strstr(req->if_none_match, document->etag) != NULL);
+
+    snprintf(header, sizeof(header), "%s %s\r\n" \
+             "Content-type: %s\r\n" \
+             "Content-Length: %lu\r\n" \
+             "ETag: %s\r\n" \
+             "%s" \
+             CACHED_HEADER \
+             "\r\n", http_version(context_fd), not_modified ? "304 Not Modified" : "200 OK",
+             "application/x-javascript", (unsigned long)document->size, document->etag,
+             connection_header(context_fd));
+
+    if(write_response(context_fd->fd, header, not_modified ? NULL : document->data, document->size) < 0) {
+        DBG("unable to serve the JSON file\n");
+        context_fd->keep_alive = 0;
     }
+
+    jsoncache_put(document);
 }
 
+
 /******************************************************************************
-Description.:   checks the source string for non printable characters and replaces them with space
-                the two arguments should be the same size allocated memory areas
-Input Value.:   source
-Return Value:   destination
+Description.: Read a counter of the "TcpExt" section of /proc/net/netstat
+Input Value.: name of the counter, e.g. "ListenOverflows"
+Return Value: value of the counter or 0 if it is not available
 ******************************************************************************/
-void check_JSON_string(char *source, char *destination)
+static unsigned long tcpext_counter(const char *name)
 {
-    int i = 0;
-    while (source[i] != '\0') {
-        if (isprint(source[i])) {
-            destination[i] = source [i];
-        } else {
-            destination[i] = ' ';
+    char names[4096], values[4096], *n, *v, *saven = NULL, *savev = NULL;
+    unsigned long result = 0;
+    FILE *f;
+
+    if((f = fopen("/proc/net/netstat", "r")) == NULL)
+        return 0;
+
+    /* the section consists of a line of names followed by a line of values */
+    while(fgets(names, sizeof(names), f) != NULL && fgets(values, sizeof(values), f) != NULL) {
+        if(strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+
+        n = strtok_r(names, " \n", &saven);
+        v = strtok_r(values, " \n", &savev);
+        while(n != NULL && v != NULL) {
+            if(strcmp(n, name) == 0) {
+                result = strtoul(v, NULL, 10);
+                break;
+            }
+            n = strtok_r(NULL, " \n", &saven);
+            v = strtok_r(NULL, " \n", &savev);
         }
-        i++;
+        break;
     }
+    fclose(f);
+
+    return result;
 }
 
 /******************************************************************************
-Description.: Send a JSON file which is contains information about the output plugin's
-              acceptable parameters
-Input Value.: fildescriptor fd to send the answer to
+Description.: Send the counters of this server and the state of its listening
+              sockets. "queued" is the current length of the accept queue,
+              "drops" counts connections the kernel dropped because the queue
+              was full. With TCP_DEFER_ACCEPT it also counts the handshakes
+              the kernel discarded while waiting for the request, then
+              "listen_overflows" (system wide) is the reliable number.
+Input Value.: context_fd: connection to send the document to
 Return Value: -
 ******************************************************************************/
-void send_output_JSON(int fd, int input_number)
+void send_stats_JSON(cfd *context_fd)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
-    DBG("Serving the output plugin %d descriptor JSON file\n", input_number);
-
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->out[input_number].out_parameters != NULL) {
-        for(i = 0; i < pglobal->out[input_number].parametercount; i++) {
-            char *menuString = calloc(0, 0);
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->out[input_number].out_parameters[i].menuitems != NULL) {
-                    int j, k = 1;
-                    for(j = pglobal->out[input_number].out_parameters[i].ctrl.minimum; j <= pglobal->out[input_number].out_parameters[i].ctrl.maximum; j++) {
-                        int prevSize = strlen(menuString);
-                        int itemLength = strlen((char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name)  + strlen("\"\": \"\"");
-                        if (menuString == NULL) {
-                            menuString = calloc(itemLength, sizeof(char));
-                        } else {
-                            menuString = realloc(menuString, (strlen(menuString) + itemLength) * (sizeof(char)));
-                        }
+    context *pc = context_fd->pc;
+    server_stats stats;
+    struct tcp_info info;
+    socklen_t len;
+    unsigned long drops, total_drops = 0;
+    variant_stats variants[FRAMEHUB_SCALES][FRAMEHUB_RUNGS];
+    int i, k, scale, rung, domain, size;
+    char *buffer;
+    #ifdef SO_MEMINFO
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    #endif
 
-                        if (menuString == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
+    DBG("Serving the statistics JSON file\n");
 
-                        if(j != pglobal->out[input_number].out_parameters[i].ctrl.maximum) {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
-                        } else {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
-                        }
-                        k++;
-                    }
-                }
-            }
+    pthread_mutex_lock(&pc->stats.mutex);
+    stats = pc->stats;
+    pthread_mutex_unlock(&pc->stats.mutex);
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"1\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->out[input_number].out_parameters[i].ctrl.name,
-                    pglobal->out[input_number].out_parameters[i].ctrl.id,
-                    pglobal->out[input_number].out_parameters[i].ctrl.type,
-                    pglobal->out[input_number].out_parameters[i].ctrl.minimum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.maximum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.step,
-                    pglobal->out[input_number].out_parameters[i].ctrl.default_value,
-                    pglobal->out[input_number].out_parameters[i].value,
-                    // 1 is the code of the output plugin
-                    pglobal->out[input_number].out_parameters[i].ctrl.flags,
-                    pglobal->out[input_number].out_parameters[i].group
-                   );
-
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
-            } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
-            }
+    size = 512 + pc->conf.acceptors * MAX_SD_LEN * 128 + pglobal->incnt * FRAMEHUB_SCALES * FRAMEHUB_RUNGS * 192;
+    if((buffer = malloc(size)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+
+    snprintf(buffer, size,
+             "{\n"
+             "\"connections\": %lu,\n"
+             "\"clients\": %d,\n"
+             "\"requests\": %lu,\n"
+             "\"accept_errors\": %lu,\n"
+             "\"streams\": %d,\n"
+             "\"streams_refused\": %lu,\n"
+             "\"frames_skipped\": %lu,\n"
+             "\"bytes_sent\": %lu,\n"
+             "\"listeners\": [",
+             stats.connections, stats.clients, stats.requests, stats.accept_errors,
+             stats.streams, stats.streams_refused, stats.frames_skipped, stats.bytes_sent);
+
+    for(i = 0; i < pc->conf.acceptors; i++) {
+        for(k = 0; k < pc->acceptors[i].sd_len; k++) {
+            int sd = pc->acceptors[i].sd[k];
+
+            len = sizeof(domain);
+            if(getsockopt(sd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+                domain = AF_UNSPEC;
+
+            /* for listening sockets the kernel reports the accept queue here */
+            len = sizeof(info);
+            memset(&info, 0, sizeof(info));
+            getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &len);
+
+            drops = 0;
+            #ifdef SO_MEMINFO
+            len = sizeof(meminfo);
+            if(getsockopt(sd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0)
+                drops = meminfo[SK_MEMINFO_DROPS];
+            #endif
+            total_drops += drops;
+
+            snprintf(buffer + strlen(buffer), size - strlen(buffer),
+                     "%s\n{\"acceptor\": %d, \"family\": \"%s\", \"queued\": %u, \"backlog\": %u, \"drops\": %lu}",
+                     (i == 0 && k == 0) ? "" : ",", i, (domain == AF_INET6) ? "IPv6" : "IPv4",
+                     info.tcpi_unacked, info.tcpi_sacked, drops);
+        }
+    }
 
-            if(i != (pglobal->out[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
+    snprintf(buffer + strlen(buffer), size - strlen(buffer),
+             "\n],\n"
+             "\"listen_drops\": %lu,\n"
+             "\"listen_overflows\": %lu,\n"
+             "\"variants\": [", total_drops, tcpext_counter("ListenOverflows"));
+
+    /* scaled and requantized streams, with the CPU time spent on producing them */
+    for(i = 0, k = 0; i < pglobal->incnt; i++) {
+        framehub_stats(i, variants);
+        for(scale = 0; scale < FRAMEHUB_SCALES; scale++) {
+            for(rung = 0; rung < FRAMEHUB_RUNGS; rung++) {
+                variant_stats *v = &variants[scale][rung];
+                if(v->frames == 0 && v->errors == 0 && v->clients == 0)
+                    continue;
+                snprintf(buffer + strlen(buffer), size - strlen(buffer),
+                         "%s\n{\"input\": %d, \"scale\": \"1/%d\", \"quality\": %d, \"clients\": %d, "
+                         "\"frames\": %lu, \"errors\": %lu, \"bytes\": %llu, \"cpu_ms\": %llu, \"cpu_us_per_frame\": %llu}",
+                         (k++ == 0) ? "" : ",", i, 1 << scale, framehub_quality[rung], v->clients,
+                         v->frames, v->errors, v->bytes, v->cpu_usec / 1000,
+                         v->cpu_usec / MAX(v->frames + v->errors, 1));
             }
-            free(menuString);
         }
-    } else {
-        DBG("The output plugin %d has no paramters\n", input_number);
     }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            /*"},\n"*/);
 
-    sprintf(buffer + strlen(buffer),
-            "}\n");
-    i = strlen(buffer);
+    snprintf(buffer + strlen(buffer), size - strlen(buffer), "\n]\n}\n");
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    send_JSON_document(context_fd, buffer);
+    free(buffer);
 }
 
+
+
 #ifdef MANAGMENT
-void send_clients_JSON(int fd)
+void send_clients_JSON(cfd *context_fd)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    unsigned long i = 0 ;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
+    client_info *client;
+    const char *separator = "";
+    char *buffer;
+    size_t size, len;
+    long long now, start;
+    unsigned long bytes;
+    double rate;
+    int i;
 
     DBG("Serving the clients JSON file\n");
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"clients\": [\n");
+    now = client_clock();
+    pthread_mutex_lock(&clients.mutex);
 
-    for (; i<client_infos.client_count; i++) {
-        sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"address\": \"%s\",\n"
-            "\"timestamp\": %ld\n"
-            "}\n",
-            client_infos.infos[i]->address,
-            (unsigned long)client_infos.infos[i]->last_take_time.tv_sec);
+    size = 64 + clients.count * (NI_MAXHOST + 64);
+    if((buffer = malloc(size)) == NULL) {
+        pthread_mutex_unlock(&clients.mutex);
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
 
-        if(i != (client_infos.client_count - 1)) {
-            sprintf(buffer + strlen(buffer), ",\n");
+    len = sprintf(buffer, "{\n\"clients\": [\n");
+
+    for(i = 0; i < CLIENT_BUCKETS; i++) {
+        for(client = clients.buckets[i]; client != NULL; client = client->next) {
+            /* a client that stopped receiving does not update its rate anymore */
+            start = __atomic_load_n(&client->rate_start, __ATOMIC_RELAXED);
+            bytes = __atomic_load_n(&client->bytes, __ATOMIC_RELAXED);
+            __atomic_load(&client->rate, &rate, __ATOMIC_RELAXED);
+            if(now - start > 2000000)
+                rate = bytes * 1000000.0 / (now - start);
+
+            len += snprintf(buffer + len, size - len,
+                            "%s{\n"
+                            "\"address\": \"%s\",\n"
+                            "\"timestamp\": %lld,\n"
+                            "\"rate\": %.0f\n"
+                            "}",
+                            separator,
+                            client->address,
+                            __atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED) / 1000000,
+                            rate);
+            separator = ",\n";
         }
     }
+    pthread_mutex_unlock(&clients.mutex);
 
-    sprintf(buffer + strlen(buffer),
-            "]");
-
-    sprintf(buffer + strlen(buffer),
-            "\n}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    snprintf(buffer + len, size - len, "\n]\n}\n");
+    send_JSON_document(context_fd, buffer);
+    free(buffer);
 }
 #endif
 
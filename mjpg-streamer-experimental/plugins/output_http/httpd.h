@@ -20,7 +20,15 @@
 #                                                                              #
 *******************************************************************************/
 
-#define IO_BUFFER 256
+#include <netdb.h>
+
+#include "filecache.h"
+
+/*
+ * size of the receive buffer of each connection, a complete request header
+ * has to fit into it, larger headers are rejected
+ */
+#define IO_BUFFER 8192
 #define BUFFER_SIZE 1024
 
 /* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
@@ -42,18 +50,36 @@
  * Using cached pictures would lead to showing old/outdated pictures
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
+ *
+ * The "Connection" header is not part of it, responses which may keep the
+ * connection open print it with connection_header(), all others use
+ * CLOSE_HEADER.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
+#define CLOSE_HEADER "Connection: close\r\n"
+#define STD_HEADER "Server: MJPG-Streamer/0.2\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
 
+/*
+ * Defaults for persistent (keep-alive) connections:
+ * idle timeout in seconds and the number of requests served per connection
+ */
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_REQUESTS 100
+
 /*
  * Maximum number of server sockets (i.e. protocol families) to listen.
  */
 #define MAX_SD_LEN 50
 
+/*
+ * Upper limit for acceptor threads of one server and the default length of
+ * the accept queue of each listening socket (capped by net.core.somaxconn)
+ */
+#define MAX_ACCEPTORS 16
+#define LISTEN_BACKLOG 128
+
 /*
  * Only the following fileypes are supported.
  *
@@ -94,27 +120,103 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_STATS_JSON,
+    A_WEBSOCKET,
+    A_EVENTS,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
 } answer_t;
 
+/* flags of the routing tables below */
+#define ROUTE_INPUT     1   /* the URL may carry a plugin number, e.g. "stream_1" */
+#define ROUTE_MANAGED   2   /* subject to the client checks of MANAGMENT */
+#define ROUTE_PARAMETER 4   /* the rest of the query is the parameter */
+
+/*
+ * values of the "action" parameter for requests to "/", e.g.
+ * "/?action=stream_1". The action is compared up to an optional "_" that
+ * separates the plugin number.
+ */
+static const struct {
+    const char *action;
+    answer_t type;
+    int flags;
+} actions[] = {
+    { "snapshot",  A_SNAPSHOT,  ROUTE_INPUT | ROUTE_MANAGED },
+    { "stream",    A_STREAM,    ROUTE_INPUT | ROUTE_MANAGED },
+    { "take",      A_TAKE,      ROUTE_INPUT | ROUTE_PARAMETER },
+    { "command",   A_COMMAND,   ROUTE_PARAMETER },
+    { "websocket", A_WEBSOCKET, ROUTE_INPUT | ROUTE_MANAGED },
+    { "events",    A_EVENTS,    ROUTE_INPUT }
+};
+
+/*
+ * fixed paths, matched by prefix and suffix, e.g. "/input_1.json"
+ * everything else is served from the www-folder
+ */
+static const struct {
+    const char *prefix;
+    const char *suffix;
+    answer_t type;
+    int flags;
+} paths[] = {
+    { "/input",        ".json", A_INPUT_JSON,   ROUTE_INPUT },
+    { "/output",       ".json", A_OUTPUT_JSON,  ROUTE_INPUT },
+    { "/program.json", "",      A_PROGRAM_JSON, 0 },
+    { "/stats.json",   "",      A_STATS_JSON,   0 },
+    #ifdef MANAGMENT
+    { "/clients.json", "",      A_CLIENTS_JSON, 0 },
+    #endif
+    #ifdef WXP_COMPAT
+    { "/cam",          ".jpg",  A_SNAPSHOT_WXP, ROUTE_INPUT | ROUTE_MANAGED },
+    { "/cam",          ".mjpg", A_STREAM_WXP,   ROUTE_INPUT | ROUTE_MANAGED },
+    #endif
+};
+
+/* request methods the server distinguishes */
+enum {
+    M_OTHER,
+    M_GET,
+    M_POST
+};
+
 /*
  * the client sends information with each request
  * this structure is used to store the important parts
  */
 typedef struct {
     answer_t type;
+    int method;             /* M_GET, M_POST or M_OTHER */
+    char *path;             /* requested path without the query */
     char *parameter;
     char *client;
     char *credentials;
     char *query_string;
+    int http_minor;         /* 0 for HTTP/1.0, 1 for HTTP/1.1 requests */
+    int connection;         /* value of the "Connection" header, see below */
+    int accept_encoding;    /* content codings of "Accept-Encoding", (1 << ENC_GZIP) etc. */
+    char *if_none_match;
+    char *if_modified_since;
+    int upgrade_websocket;  /* "Upgrade: websocket" was sent */
+    int websocket_version;
+    char *websocket_key;
 } request;
 
-/* the iobuffer structure is used to read from the HTTP-client */
+/* values of the "Connection" request header */
+enum {
+    CONN_DEFAULT,
+    CONN_CLOSE,
+    CONN_KEEPALIVE
+};
+
+/*
+ * the iobuffer structure is used to read from the HTTP-client, it keeps
+ * bytes of pipelined requests between two calls of read_request()
+ */
 typedef struct {
     int level;              /* how full is the buffer */
-    char buffer[IO_BUFFER]; /* the data */
+    char buffer[IO_BUFFER]; /* the data, starting at the first unparsed byte */
 } iobuffer;
 
 /* store configuration for each server instance */
@@ -124,35 +226,113 @@ typedef struct {
     char *credentials;
     char *www_folder;
     char nocommands;
+    char nocache;           /* read files of the www-folder for each request */
+    int keepalive_timeout;  /* idle timeout of persistent connections, 0 disables them */
+    int keepalive_requests; /* maximum number of requests per connection */
+    int acceptors;          /* number of acceptor threads, more than one uses SO_REUSEPORT */
+    int backlog;            /* length of the accept queue */
+    int defer_accept;       /* seconds for TCP_DEFER_ACCEPT, 0 disables it */
+    int max_streams;        /* concurrent streams of this server, 0 is unlimited */
+    int max_streams_ip;     /* concurrent streams per client address, 0 is unlimited */
+    double egress_rate;     /* bytes per second for all streams, 0 is unlimited */
+    double client_rate;     /* bytes per second for each stream, 0 is unlimited */
 } config;
 
-/* context of each server thread */
+/*
+ * token bucket to limit the bandwidth of streams, it is filled with "rate"
+ * bytes per second up to one second worth of data
+ */
 typedef struct {
+    double rate;
+    double tokens;
+    struct timeval last;
+} token_bucket;
+
+/* number of streams each client address receives */
+typedef struct _stream_address {
+    struct _stream_address *next;
+    char address[NI_MAXHOST];
+    int streams;
+} stream_address;
+
+struct _context;
+
+/*
+ * the listening sockets of one acceptor thread, each acceptor has its own
+ * sockets and the kernel distributes new connections between them
+ */
+typedef struct {
+    struct _context *pc;
     int sd[MAX_SD_LEN];
     int sd_len;
+    pthread_t threadID;
+} acceptor;
+
+/* counters of each server, reported by "/stats.json" */
+typedef struct {
+    pthread_mutex_t mutex;
+    unsigned long connections;   /* accepted connections */
+    unsigned long accept_errors;
+    unsigned long requests;
+    int clients;                 /* currently connected clients */
+    int streams;                 /* currently sent streams */
+    unsigned long streams_refused;
+    unsigned long frames_skipped; /* frames not sent to stay within the bandwidth limits */
+    unsigned long bytes_sent;    /* JPEG data sent by streams, added atomically */
+} server_stats;
+
+/* context of each server thread */
+typedef struct _context {
+    acceptor acceptors[MAX_ACCEPTORS];
     int id;
     globals *pglobal;
     pthread_t threadID;
 
     config conf;
+    char keepalive_header[80];
+    int cache_enabled;
+    filecache cache;        /* content of the www-folder */
+    server_stats stats;
+    token_bucket egress;        /* shared by all streams, protected by the mutex of stats */
+    stream_address *stream_addresses;
 } context;
 
 
 #if defined(MANAGMENT)
+/*
+ * The clients are kept in a hash table keyed by their address. Streams
+ * update the timestamps and rates of their client with atomic operations,
+ * only connecting and disconnecting takes the mutex of the registry.
+ * Clients without connections are expired in least recently used order.
+ */
+#define CLIENT_BUCKETS 4096     /* size of the hash table, a power of two */
+#define CLIENT_LIMIT 16384      /* entries kept at most, as far as they are unused */
+#define CLIENT_TTL 600          /* seconds an unused entry is kept */
+
 /*
  * this struct is used to hold information from the clients address, and last picture take time
  */
 typedef struct _client_info {
-    struct _client_info *next;
+    struct _client_info *next;  /* in the bucket of the hash table */
+    struct _client_info *newer; /* in the list of unused clients */
+    struct _client_info *older;
     char *address;
-    struct timeval last_take_time;
+    unsigned int hash;
+    int connections;            /* protected by the mutex of the registry */
+    time_t released;            /* when the last connection ended */
+    long long last_take_time;   /* microseconds, atomic */
+    unsigned long bytes;        /* sent since rate_start, atomic */
+    long long rate_start;       /* microseconds, atomic */
+    double rate;                /* bytes per second of the last measurement, atomic */
 } client_info;
 
-struct {
-    client_info **infos;
-    unsigned int client_count;
+typedef struct {
     pthread_mutex_t mutex;
-} client_infos;
+    client_info *buckets[CLIENT_BUCKETS];
+    client_info *newest;        /* unused clients, the oldest expires first */
+    client_info *oldest;
+    unsigned int count;
+} client_registry;
 
 #endif
 
@@ -163,26 +343,103 @@ struct {
 typedef struct {
     context *pc;
     int fd;
+    int keep_alive; /* the current response leaves the connection open */
+    int requests;   /* number of requests served on this connection */
+    char address[NI_MAXHOST];
+    token_bucket bucket;    /* bandwidth limit of a stream */
     #ifdef MANAGMENT
     client_info *client;
     #endif
 } cfd;
 
+/* a reply of the reader thread waiting for its turn on the connection */
+typedef struct _websocket_message websocket_message;
+struct _websocket_message {
+    websocket_message *next;
+    int opcode;
+    size_t size;
+    char data[];
+};
+
+/*
+ * a WebSocket connection, a second thread reads the messages of the client
+ * while the frames are sent. One thread at a time writes to the connection,
+ * the mutex is only held to take turns, not while writing. Replies queued
+ * meanwhile are sent by the thread that has the turn.
+ */
+typedef struct {
+    cfd *context_fd;
+    iobuffer *pending;          /* bytes that arrived with the handshake */
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;        /* signalled when sending ends */
+    int sending;                /* a thread writes to the connection */
+    websocket_message *queue, **tail;
+    int closing;                /* a close message was queued or the client is gone */
+    pthread_t reader;
+} websocket_session;
+
+/* options of a stream taken from the query string */
+typedef struct {
+    int fps;      /* limit the stream to this many frames per second, 0 for no limit */
+    int every;    /* send only every n-th frame of the input */
+    int scale;    /* scale the frames down to 1/2^scale */
+    int quality; /* rung of the quality ladder, -1 to adapt it to the connection */
+    int low_latency; /* send a frame only once the socket drained, then the newest one */
+} stream_options;
+
+/*
+ * Low latency streams keep at most LOW_LATENCY_LOWAT bytes in the socket
+ * that were not sent yet (TCP_NOTSENT_LOWAT), the send buffer holds
+ * LOW_LATENCY_FRAMES frames. A frame is taken from the hub only once the
+ * previous one left the socket, frames in between are passed over.
+ */
+#define LOW_LATENCY_LOWAT (16*1024)
+#define LOW_LATENCY_FRAMES 2
+#define LOW_LATENCY_RECHECK 2000 /* usec between checks if the kernel has no low-water mark */
+
+/*
+ * A client steps down the quality ladder if the send queue still holds more
+ * than half a frame, at most once every LADDER_COOLDOWN frames. It steps up
+ * after the queue was empty for LADDER_CALM frames in a row.
+ */
+#define LADDER_COOLDOWN 5
+#define LADDER_CALM 50
+
+/* position of a stream client on the quality ladder */
+typedef struct {
+    int rung;
+    int fixed;      /* the client asked for a quality */
+    int calm;       /* frames in a row that found the send queue empty */
+    int cooldown;   /* frames until the client may step down again */
+} quality_ladder;
+
+/*
+ * topics of "?action=events", a client subscribes with "topics=frame,stats".
+ * TOPIC_METADATA sends only the frames the input plugin described.
+ */
+#define TOPIC_FRAME     1
+#define TOPIC_METADATA  2
+#define TOPIC_STATS     4
+
+/* seconds between comments that keep idle event streams open */
+#define EVENTS_HEARTBEAT 15
+
 
 
 /* prototypes */
 void *server_thread(void *arg);
-void send_error(int fd, int which, char *message);
-void send_output_JSON(int fd, int plugin_number);
-void send_input_JSON(int fd, int plugin_number);
-void send_program_JSON(int fd);
-void check_JSON_string(char *source, char *destination);
+void send_error(cfd *context_fd, int which, char *message);
+void send_plugin_JSON(cfd *context_fd, request *req, int type, int plugin);
+void send_stats_JSON(cfd *context_fd);
+int execute_command(char *parameter, char *answer, size_t size);
 
 #ifdef MANAGMENT
 client_info *add_client(char *address);
+void release_client(client_info *client);
 int check_client_status(client_info *client);
 void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+void update_client_rate(client_info *client, int bytes);
+void send_clients_JSON(cfd *context_fd);
 #endif
 
 
@@ -0,0 +1,452 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "jsoncache.h"
+
+/* a document being generated, it grows as needed */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+    int failed;     /* out of memory */
+} json_buffer;
+
+/* one slot for each input, each output and the program */
+#define JSON_SLOTS (MAX_INPUT_PLUGINS + MAX_OUTPUT_PLUGINS + 1)
+
+static struct {
+    pthread_mutex_t mutex;
+    unsigned long version;
+    json_document *documents[JSON_SLOTS];
+} cache = { PTHREAD_MUTEX_INITIALIZER };
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/******************************************************************************
+Description.: Add bytes to a hash (FNV-1a)
+Input Value.: * hash: the hash so far
+              * data: the bytes
+              * size: number of bytes
+Return Value: the new hash
+******************************************************************************/
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    while(size-- > 0)
+        hash = (hash ^ *p++) * FNV_PRIME;
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: Add a string to a hash, including its end
+Input Value.: * hash..: the hash so far
+              * string: the string, may be NULL
+Return Value: the new hash
+******************************************************************************/
+static unsigned long long hash_string(unsigned long long hash, const char *string)
+{
+    return (string != NULL) ? hash_bytes(hash, string, strlen(string) + 1) : hash_bytes(hash, "", 1);
+}
+
+/******************************************************************************
+Description.: Hash the controls of a plugin, the menu items are only
+              represented by their pointer, plugins allocate them once
+Input Value.: * hash....: the hash so far
+              * controls: the controls, may be NULL
+              * count...: number of controls
+Return Value: the new hash
+******************************************************************************/
+static unsigned long long hash_controls(unsigned long long hash, control *controls, int count)
+{
+    int i;
+
+    hash = hash_bytes(hash, &controls, sizeof(controls));
+    hash = hash_bytes(hash, &count, sizeof(count));
+    for(i = 0; controls != NULL && i < count; i++) {
+        hash = hash_bytes(hash, &controls[i].ctrl, sizeof(controls[i].ctrl));
+        hash = hash_bytes(hash, &controls[i].value, sizeof(controls[i].value));
+        hash = hash_bytes(hash, &controls[i].menuitems, sizeof(controls[i].menuitems));
+        hash = hash_bytes(hash, &controls[i].group, sizeof(controls[i].group));
+    }
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: Fingerprint the data a document is made of. Checking it is much
+              cheaper than generating the document, so the cache notices all
+              changes, also those a plugin makes on its own.
+Input Value.: * pglobal: the global data
+              * type...: JSON_INPUT, JSON_OUTPUT or JSON_PROGRAM
+              * plugin.: number of the plugin
+Return Value: the fingerprint
+******************************************************************************/
+static unsigned long long fingerprint(globals *pglobal, int type, int plugin)
+{
+    unsigned long long hash = hash_bytes(FNV_OFFSET, &type, sizeof(type));
+    input *in;
+    int i;
+
+    switch(type) {
+    case JSON_INPUT:
+        in = &pglobal->in[plugin];
+        hash = hash_controls(hash, in->in_parameters, in->parametercount);
+        hash = hash_bytes(hash, &in->in_formats, sizeof(in->in_formats));
+        hash = hash_bytes(hash, &in->formatCount, sizeof(in->formatCount));
+        for(i = 0; in->in_formats != NULL && i < in->formatCount; i++) {
+            hash = hash_bytes(hash, &in->in_formats[i].format, sizeof(in->in_formats[i].format));
+            hash = hash_bytes(hash, &in->in_formats[i].supportedResolutions, sizeof(in->in_formats[i].supportedResolutions));
+            hash = hash_bytes(hash, &in->in_formats[i].resolutionCount, sizeof(in->in_formats[i].resolutionCount));
+            hash = hash_bytes(hash, &in->in_formats[i].currentResolution, sizeof(in->in_formats[i].currentResolution));
+        }
+        break;
+    case JSON_OUTPUT:
+        hash = hash_controls(hash, pglobal->out[plugin].out_parameters, pglobal->out[plugin].parametercount);
+        break;
+    case JSON_PROGRAM:
+        hash = hash_bytes(hash, &pglobal->incnt, sizeof(pglobal->incnt));
+        for(i = 0; i < pglobal->incnt; i++) {
+            hash = hash_string(hash, pglobal->in[i].name);
+            hash = hash_string(hash, pglobal->in[i].plugin);
+            hash = hash_string(hash, pglobal->in[i].param.parameters);
+        }
+        hash = hash_bytes(hash, &pglobal->outcnt, sizeof(pglobal->outcnt));
+        for(i = 0; i < pglobal->outcnt; i++) {
+            hash = hash_string(hash, pglobal->out[i].name);
+            hash = hash_string(hash, pglobal->out[i].plugin);
+            hash = hash_string(hash, pglobal->out[i].param.parameters);
+        }
+        break;
+    }
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: Append formatted text to a document
+Input Value.: * buffer: the document
+              * format: printf() format and arguments
+Return Value: -
+******************************************************************************/
+static void json_printf(json_buffer *buffer, const char *format, ...)
+{
+    va_list ap;
+    char *data;
+    int len;
+
+    while(!buffer->failed) {
+        va_start(ap, format);
+        len = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, ap);
+        va_end(ap);
+
+        if(len < 0) {
+            buffer->failed = 1;
+        } else if(buffer->len + len < buffer->size) {
+            buffer->len += len;
+            return;
+        } else if((data = realloc(buffer->data, MAX(buffer->size * 2, buffer->len + len + 1))) == NULL) {
+            buffer->failed = 1;
+        } else {
+            buffer->size = MAX(buffer->size * 2, buffer->len + len + 1);
+            buffer->data = data;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: Append a string, non printable characters are replaced by
+              spaces and quotes are escaped
+Input Value.: * buffer: the document
+              * string: the string, NULL is written as an empty string
+              * size..: the string ends at a '\0' or after size characters
+Return Value: -
+******************************************************************************/
+static void json_string(json_buffer *buffer, const char *string, size_t size)
+{
+    size_t i;
+
+    if(string == NULL)
+        return;
+
+    for(i = 0; i < size && string[i] != '\0'; i++) {
+        if(string[i] == '"' || string[i] == '\\')
+            json_printf(buffer, "\\%c", string[i]);
+        else
+            json_printf(buffer, "%c", isprint((unsigned char)string[i]) ? string[i] : ' ');
+    }
+}
+
+/******************************************************************************
+Description.: Append the "controls" array of a plugin
+Input Value.: * buffer..: the document
+              * controls: the controls, may be NULL
+              * count...: number of controls
+              * dest....: 0 for controls of inputs, 1 for outputs
+Return Value: -
+******************************************************************************/
+static void json_controls(json_buffer *buffer, control *controls, int count, int dest)
+{
+    int i, j;
+
+    json_printf(buffer, "{\n\"controls\": [\n");
+
+    for(i = 0; controls != NULL && i < count; i++) {
+        json_printf(buffer, "{\n\"name\": \"");
+        json_string(buffer, (char *)controls[i].ctrl.name, sizeof(controls[i].ctrl.name));
+        json_printf(buffer, "\",\n"
+                    "\"id\": \"%d\",\n"
+                    "\"type\": \"%d\",\n"
+                    "\"min\": \"%d\",\n"
+                    "\"max\": \"%d\",\n"
+                    "\"step\": \"%d\",\n"
+                    "\"default\": \"%d\",\n"
+                    "\"value\": \"%d\",\n"
+                    "\"dest\": \"%d\",\n"
+                    "\"flags\": \"%d\",\n"
+                    "\"group\": \"%d\"",
+                    controls[i].ctrl.id,
+                    controls[i].ctrl.type,
+                    controls[i].ctrl.minimum,
+                    controls[i].ctrl.maximum,
+                    controls[i].ctrl.step,
+                    controls[i].ctrl.default_value,
+                    controls[i].value,
+                    dest,
+                    controls[i].ctrl.flags,
+                    controls[i].group);
+
+        /* the menu items are indexed by their value */
+        if(controls[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
+            json_printf(buffer, ",\n\"menu\": {");
+            for(j = controls[i].ctrl.minimum; controls[i].menuitems != NULL && j <= controls[i].ctrl.maximum; j++) {
+                json_printf(buffer, "%s\"%d\": \"", (j != controls[i].ctrl.minimum) ? ", " : "", j);
+                json_string(buffer, (char *)controls[i].menuitems[j].name, sizeof(controls[i].menuitems[j].name));
+                json_printf(buffer, "\"");
+            }
+            json_printf(buffer, "}");
+        }
+
+        json_printf(buffer, "\n}%s", (i != count - 1) ? ",\n" : "");
+    }
+
+    json_printf(buffer, "\n]");
+}
+
+/******************************************************************************
+Description.: Generate the description of an input plugin, its controls and
+              the formats and resolutions of the device
+Input Value.: * buffer: the document
+              * in....: the input plugin
+Return Value: -
+******************************************************************************/
+static void json_input(json_buffer *buffer, input *in)
+{
+    input_format *format;
+    int i, j;
+
+    json_controls(buffer, in->in_parameters, in->parametercount, 0);
+    json_printf(buffer, ",\n\"formats\": [\n");
+
+    for(i = 0; in->in_formats != NULL && i < in->formatCount; i++) {
+        format = &in->in_formats[i];
+
+        json_printf(buffer, "{\n\"id\": \"%d\",\n\"name\": \"", format->format.index);
+        json_string(buffer, (char *)format->format.description, sizeof(format->format.description));
+        json_printf(buffer, "\",\n");
+        #ifdef V4L2_FMT_FLAG_COMPRESSED
+        json_printf(buffer, "\"compressed\": \"%s\",\n", (format->format.flags & V4L2_FMT_FLAG_COMPRESSED) ? "true" : "false");
+        #endif
+        #ifdef V4L2_FMT_FLAG_EMULATED
+        json_printf(buffer, "\"emulated\": \"%s\",\n", (format->format.flags & V4L2_FMT_FLAG_EMULATED) ? "true" : "false");
+        #endif
+        json_printf(buffer, "\"current\": \"%s\",\n\"resolutions\": {", (format->currentResolution != -1) ? "true" : "false");
+
+        /* e.g. {"0": "320x240", "1": "640x480", "2": "960x720"} */
+        for(j = 0; j < format->resolutionCount; j++) {
+            json_printf(buffer, "%s\"%d\": \"%dx%d\"", (j != 0) ? ", " : "", j,
+                        format->supportedResolutions[j].width, format->supportedResolutions[j].height);
+        }
+        json_printf(buffer, "}\n");
+
+        if(format->currentResolution != -1)
+            json_printf(buffer, ",\n\"currentResolution\": \"%d\"\n", format->currentResolution);
+
+        json_printf(buffer, "}%s", (i != in->formatCount - 1) ? ",\n" : "\n");
+    }
+
+    json_printf(buffer, "\n]\n}\n");
+}
+
+/******************************************************************************
+Description.: Generate the list of the loaded plugins
+Input Value.: * buffer.: the document
+              * pglobal: the global data
+Return Value: -
+******************************************************************************/
+static void json_program(json_buffer *buffer, globals *pglobal)
+{
+    int k;
+
+    json_printf(buffer, "{\n\"inputs\":[\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        json_printf(buffer, "{\n\"id\": \"%d\",\n\"name\": \"", pglobal->in[k].param.id);
+        json_string(buffer, pglobal->in[k].name, SIZE_MAX);
+        json_printf(buffer, "\",\n\"plugin\": \"");
+        json_string(buffer, pglobal->in[k].plugin, SIZE_MAX);
+        json_printf(buffer, "\",\n\"args\": \"");
+        json_string(buffer, pglobal->in[k].param.parameters, SIZE_MAX);
+        json_printf(buffer, "\"\n}%s", (k != pglobal->incnt - 1) ? ", \n" : "\n");
+    }
+
+    json_printf(buffer, "],\n\"outputs\":[\n");
+    for(k = 0; k < pglobal->outcnt; k++) {
+        json_printf(buffer, "{\n\"id\": \"%d\",\n\"name\": \"", pglobal->out[k].param.id);
+        json_string(buffer, pglobal->out[k].name, SIZE_MAX);
+        json_printf(buffer, "\",\n\"plugin\": \"");
+        json_string(buffer, pglobal->out[k].plugin, SIZE_MAX);
+        json_printf(buffer, "\",\n\"args\": \"");
+        json_string(buffer, pglobal->out[k].param.parameters, SIZE_MAX);
+        json_printf(buffer, "\"\n}%s", (k != pglobal->outcnt - 1) ? ", \n" : "\n");
+    }
+    json_printf(buffer, "]}\n");
+}
+
+/******************************************************************************
+Description.: Generate a document
+Input Value.: * pglobal....: the global data
+              * type.......: JSON_INPUT, JSON_OUTPUT or JSON_PROGRAM
+              * plugin.....: number of the plugin
+              * fingerprint: of the data, stored in the document
+Return Value: the document with a refcount of 1 or NULL if there is not
+              enough memory
+******************************************************************************/
+static json_document *generate(globals *pglobal, int type, int plugin, unsigned long long fingerprint)
+{
+    json_buffer buffer = { NULL, 0, 0, 0 };
+    json_document *document;
+
+    switch(type) {
+    case JSON_INPUT:
+        json_input(&buffer, &pglobal->in[plugin]);
+        break;
+    case JSON_OUTPUT:
+        json_controls(&buffer, pglobal->out[plugin].out_parameters, pglobal->out[plugin].parametercount, 1);
+        json_printf(&buffer, "\n}\n");
+        break;
+    case JSON_PROGRAM:
+        json_program(&buffer, pglobal);
+        break;
+    }
+
+    if(buffer.failed || (document = malloc(sizeof(json_document) + buffer.len + 1)) == NULL) {
+        free(buffer.data);
+        return NULL;
+    }
+
+    document->refcount = 1;
+    document->version = ++cache.version;
+    document->fingerprint = fingerprint;
+    document->size = buffer.len;
+    memcpy(document->data, buffer.data, buffer.len + 1);
+    snprintf(document->etag, sizeof(document->etag), "\"%llx\"", hash_bytes(FNV_OFFSET, buffer.data, buffer.len));
+    free(buffer.data);
+
+    DBG("generated JSON document %d of plugin %d, version %lu (%lu bytes)\n", type, plugin,
+        document->version, (unsigned long)document->size);
+    return document;
+}
+
+/******************************************************************************
+Description.: Look up a document and generate it if the data it describes
+              changed, the caller has to release it with jsoncache_put
+Input Value.: * pglobal: the global data
+              * type...: JSON_INPUT, JSON_OUTPUT or JSON_PROGRAM
+              * plugin.: number of the plugin, ignored for JSON_PROGRAM
+Return Value: the document or NULL if there is not enough memory
+******************************************************************************/
+json_document *jsoncache_get(globals *pglobal, int type, int plugin)
+{
+    json_document *document, *old = NULL;
+    unsigned long long hash = fingerprint(pglobal, type, plugin);
+    int slot;
+
+    switch(type) {
+    case JSON_INPUT:
+        slot = plugin;
+        break;
+    case JSON_OUTPUT:
+        slot = MAX_INPUT_PLUGINS + plugin;
+        break;
+    default:
+        slot = MAX_INPUT_PLUGINS + MAX_OUTPUT_PLUGINS;
+        plugin = 0;
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    document = cache.documents[slot];
+    if(document == NULL || document->fingerprint != hash) {
+        if((document = generate(pglobal, type, plugin, hash)) == NULL) {
+            pthread_mutex_unlock(&cache.mutex);
+            return NULL;
+        }
+        old = cache.documents[slot];
+        cache.documents[slot] = document;
+        if(old != NULL && --old->refcount > 0)
+            old = NULL;
+    }
+    document->refcount++;
+    pthread_mutex_unlock(&cache.mutex);
+
+    free(old);
+    return document;
+}
+
+/******************************************************************************
+Description.: Release a document returned by jsoncache_get
+Input Value.: document: the document
+Return Value: -
+******************************************************************************/
+void jsoncache_put(json_document *document)
+{
+    int unused;
+
+    pthread_mutex_lock(&cache.mutex);
+    unused = (--document->refcount == 0);
+    pthread_mutex_unlock(&cache.mutex);
+
+    if(unused)
+        free(document);
+}
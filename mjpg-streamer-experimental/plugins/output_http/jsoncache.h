@@ -0,0 +1,53 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef JSONCACHE_H
+#define JSONCACHE_H
+
+#include <stddef.h>
+
+/* the documents describing the plugins */
+enum {
+    JSON_INPUT,     /* "/input_N.json", controls and formats of an input */
+    JSON_OUTPUT,    /* "/output_N.json", controls of an output */
+    JSON_PROGRAM    /* "/program.json", the loaded plugins */
+};
+
+/*
+ * A generated document, shared by all clients that request it. It is
+ * generated again when the fingerprint of the data it describes changes,
+ * e.g. a control was set, and freed when the last client released it.
+ */
+typedef struct {
+    int refcount;                   /* protected by the mutex of the cache */
+    unsigned long version;          /* counts the generated documents */
+    unsigned long long fingerprint; /* of the plugin data the document was made of */
+    char etag[24];
+    size_t size;
+    char data[];
+} json_document;
+
+json_document *jsoncache_get(globals *pglobal, int type, int plugin);
+void jsoncache_put(json_document *document);
+
+#endif
@@ -64,7 +64,27 @@ void help(void)
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
-            " ---------------------------------------------------------------\n");
+            " [-k | --keepalive ].....: idle timeout in seconds of persistent\n"
+            "                           connections, 0 disables them (default %d)\n"
+            " [-kr | --keepalive_requests ]: requests served per persistent\n"
+            "                           connection (default %d)\n"
+            " [-nc | --nocache ]......: read files of the www-folder for\n"
+            "                           each request instead of caching them\n"
+            " [-a | --acceptors ].....: threads accepting connections, more\n"
+            "                           than one listen with SO_REUSEPORT\n"
+            "                           (default 1, at most %d)\n"
+            " [-b | --backlog ].......: length of the accept queue (default %d)\n"
+            " [-da | --defer_accept ].: accept connections only after the\n"
+            "                           request arrived, waiting at most the\n"
+            "                           given seconds (TCP_DEFER_ACCEPT)\n"
+            " [-ms | --max_streams ]..: concurrent streams of this server\n"
+            " [-msi | --max_streams_ip ]: concurrent streams per client address\n"
+            " [-bw | --bandwidth ]....: kB/s for all streams together\n"
+            " [-cbw | --client_bandwidth ]: kB/s for each stream\n"
+            "                           streams over the limit skip frames,\n"
+            "                           0 means unlimited for all four options\n"
+            " ---------------------------------------------------------------\n",
+            KEEPALIVE_TIMEOUT, KEEPALIVE_REQUESTS, MAX_ACCEPTORS, LISTEN_BACKLOG);
 }
 
 /*** plugin interface functions ***/
@@ -82,7 +102,11 @@ int output_init(output_parameter *param, int id)
     int i;
     int  port;
     char *credentials, *www_folder, *hostname = NULL;
-    char nocommands;
+    char nocommands, nocache = 0;
+    int keepalive_timeout = KEEPALIVE_TIMEOUT, keepalive_requests = KEEPALIVE_REQUESTS;
+    int acceptors = 1, backlog = LISTEN_BACKLOG, defer_accept = 0;
+    int max_streams = 0, max_streams_ip = 0;
+    double egress_rate = 0, client_rate = 0;
 
     DBG("output #%02d\n", param->id);
 
@@ -115,6 +139,26 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"kr", required_argument, 0, 0},
+            {"keepalive_requests", required_argument, 0, 0},
+            {"nc", no_argument, 0, 0},
+            {"nocache", no_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"acceptors", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"backlog", required_argument, 0, 0},
+            {"da", required_argument, 0, 0},
+            {"defer_accept", required_argument, 0, 0},
+            {"ms", required_argument, 0, 0},
+            {"max_streams", required_argument, 0, 0},
+            {"msi", required_argument, 0, 0},
+            {"max_streams_ip", required_argument, 0, 0},
+            {"bw", required_argument, 0, 0},
+            {"bandwidth", required_argument, 0, 0},
+            {"cbw", required_argument, 0, 0},
+            {"client_bandwidth", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -175,6 +219,76 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* k, keepalive */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            keepalive_timeout = MAX(atoi(optarg), 0);
+            break;
+
+            /* kr, keepalive_requests */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            keepalive_requests = MAX(atoi(optarg), 1);
+            break;
+
+            /* nc, nocache */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            nocache = 1;
+            break;
+
+            /* a, acceptors */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            acceptors = MIN(MAX(atoi(optarg), 1), MAX_ACCEPTORS);
+            break;
+
+            /* b, backlog */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            backlog = MAX(atoi(optarg), 1);
+            break;
+
+            /* da, defer_accept */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            defer_accept = MAX(atoi(optarg), 0);
+            break;
+
+            /* ms, max_streams */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            max_streams = MAX(atoi(optarg), 0);
+            break;
+
+            /* msi, max_streams_ip */
+        case 26:
+        case 27:
+            DBG("case 26,27\n");
+            max_streams_ip = MAX(atoi(optarg), 0);
+            break;
+
+            /* bw, bandwidth */
+        case 28:
+        case 29:
+            DBG("case 28,29\n");
+            egress_rate = MAX(atof(optarg), 0) * 1024;
+            break;
+
+            /* cbw, client_bandwidth */
+        case 30:
+        case 31:
+            DBG("case 30,31\n");
+            client_rate = MAX(atof(optarg), 0) * 1024;
+            break;
         }
     }
 
@@ -185,12 +299,38 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.nocache = nocache;
+    servers[param->id].conf.acceptors = acceptors;
+    servers[param->id].conf.backlog = backlog;
+    servers[param->id].conf.defer_accept = defer_accept;
+    servers[param->id].conf.max_streams = max_streams;
+    servers[param->id].conf.max_streams_ip = max_streams_ip;
+    servers[param->id].conf.egress_rate = egress_rate;
+    servers[param->id].conf.client_rate = client_rate;
+    servers[param->id].conf.keepalive_timeout = keepalive_timeout;
+    servers[param->id].conf.keepalive_requests = keepalive_requests;
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("www-folder cache.....: %s\n", (nocache || www_folder == NULL) ? "disabled" : "enabled");
+    OPRINT("acceptor threads.....: %d%s\n", acceptors, (acceptors > 1) ? " (SO_REUSEPORT)" : "");
+    OPRINT("listen backlog.......: %d\n", backlog);
+    if(defer_accept > 0) {
+        OPRINT("TCP_DEFER_ACCEPT.....: %d s\n", defer_accept);
+    } else {
+        OPRINT("TCP_DEFER_ACCEPT.....: disabled\n");
+    }
+    OPRINT("max. streams.........: %d total, %d per address (0 = unlimited)\n", max_streams, max_streams_ip);
+    OPRINT("bandwidth............: %.0f kB/s total, %.0f kB/s per stream (0 = unlimited)\n",
+           egress_rate / 1024, client_rate / 1024);
+    if(keepalive_timeout > 0) {
+        OPRINT("keep-alive...........: %d s, %d requests\n", keepalive_timeout, keepalive_requests);
+    } else {
+        OPRINT("keep-alive...........: disabled\n");
+    }
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
@@ -0,0 +1,281 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#ifndef NO_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "transcode.h"
+
+#ifndef NO_LIBJPEG
+
+/* libjpeg exits the program on errors by default, jump back to the caller instead */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} error_mgr;
+
+static void error_exit(j_common_ptr cinfo)
+{
+    error_mgr *err = (error_mgr *)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    DBG("libjpeg: %s\n", message);
+    longjmp(err->setjmp_buffer, 1);
+}
+
+/* corrupt frames are common with USB cameras, do not print the warnings */
+static void output_message(j_common_ptr cinfo)
+{
+}
+
+/******************************************************************************
+Description.: Scale a JPEG down. libjpeg decodes only the DCT coefficients
+              needed for the smaller size, the rows are passed directly to
+              the encoder, which uses the quantization tables of the source.
+Input Value.: * src.....: the JPEG
+              * size....: its size
+              * denom...: 2, 4 or 8 to scale to 1/2, 1/4 or 1/8
+              * dst.....: receives the scaled JPEG, to be released with free()
+              * dst_size: receives its size
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int transcode_scale(const unsigned char *src, int size, int denom, unsigned char **dst, unsigned long *dst_size)
+{
+    struct jpeg_decompress_struct in;
+    struct jpeg_compress_struct out;
+    error_mgr jerr;
+    JSAMPARRAY rows = NULL;
+
+    *dst = NULL;
+    *dst_size = 0;
+
+    in.err = jpeg_std_error(&jerr.pub);
+    out.err = &jerr.pub;
+    jerr.pub.error_exit = error_exit;
+    jerr.pub.output_message = output_message;
+
+    jpeg_create_decompress(&in);
+    jpeg_create_compress(&out);
+
+    if(setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&out);
+        jpeg_destroy_decompress(&in);
+        free(*dst);
+        *dst = NULL;
+        return -1;
+    }
+
+    jpeg_mem_src(&in, (unsigned char *)src, size);
+    jpeg_read_header(&in, TRUE);
+
+    /* stay in YCbCr, there is no need for a color conversion */
+    in.out_color_space = in.jpeg_color_space;
+    in.scale_num = 1;
+    in.scale_denom = denom;
+    in.dct_method = JDCT_IFAST;
+    in.do_fancy_upsampling = FALSE;
+    in.do_block_smoothing = FALSE;
+    jpeg_start_decompress(&in);
+
+    jpeg_mem_dest(&out, dst, dst_size);
+    jpeg_copy_critical_parameters(&in, &out);
+    out.image_width = in.output_width;
+    out.image_height = in.output_height;
+    out.dct_method = JDCT_IFAST;
+
+    rows = (*in.mem->alloc_sarray)((j_common_ptr)&in, JPOOL_IMAGE,
+                                   in.output_width * in.output_components, in.rec_outbuf_height);
+
+    jpeg_start_compress(&out, TRUE);
+    while(in.output_scanline < in.output_height) {
+        JDIMENSION lines = jpeg_read_scanlines(&in, rows, in.rec_outbuf_height);
+        jpeg_write_scanlines(&out, rows, lines);
+    }
+    jpeg_finish_compress(&out);
+    jpeg_finish_decompress(&in);
+
+    jpeg_destroy_compress(&out);
+    jpeg_destroy_decompress(&in);
+
+    return 0;
+}
+
+/* the luminance table of the JPEG standard, libjpeg scales it for the quality */
+static const unsigned int std_luminance[DCTSIZE2] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+/******************************************************************************
+Description.: Estimate the scaling libjpeg applied to the standard tables
+Input Value.: table: the luminance quantization table of a JPEG
+Return Value: the scaling in percent, as jpeg_quality_scaling() returns it
+******************************************************************************/
+static double table_scaling(JQUANT_TBL *table)
+{
+    double sum = 0;
+    int i;
+
+    for(i = 0; i < DCTSIZE2; i++)
+        sum += table->quantval[i] * 100.0 / std_luminance[i];
+
+    return sum / DCTSIZE2;
+}
+
+/******************************************************************************
+Description.: Reduce the quality of a JPEG without decoding it. The DCT
+              coefficients are divided by coarser quantization tables, which
+              leaves more zeros for the entropy coder.
+Input Value.: * src.....: the JPEG
+              * size....: its size
+              * percent.: the quality of the result in percent of the quality
+                          of the source, estimated from its luminance table
+              * dst.....: receives the JPEG, to be released with free()
+              * dst_size: receives its size
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int transcode_requantize(const unsigned char *src, int size, int percent, unsigned char **dst, unsigned long *dst_size)
+{
+    struct jpeg_decompress_struct in;
+    struct jpeg_compress_struct out;
+    error_mgr jerr;
+    jvirt_barray_ptr *coefs;
+    jpeg_component_info *comp;
+    JQUANT_TBL *old, *new;
+    JBLOCKARRAY blocks;
+    JCOEFPTR block;
+    double scaling, quality, ratio;
+    unsigned int q;
+    JDIMENSION row, col, rows, cols;
+    int c, i, k, value;
+
+    *dst = NULL;
+    *dst_size = 0;
+
+    in.err = jpeg_std_error(&jerr.pub);
+    out.err = &jerr.pub;
+    jerr.pub.error_exit = error_exit;
+    jerr.pub.output_message = output_message;
+
+    jpeg_create_decompress(&in);
+    jpeg_create_compress(&out);
+
+    if(setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&out);
+        jpeg_destroy_decompress(&in);
+        free(*dst);
+        *dst = NULL;
+        return -1;
+    }
+
+    jpeg_mem_src(&in, (unsigned char *)src, size);
+    jpeg_read_header(&in, TRUE);
+    coefs = jpeg_read_coefficients(&in);
+
+    if(in.quant_tbl_ptrs[0] == NULL)
+        longjmp(jerr.setjmp_buffer, 1);
+
+    /* the same steps libjpeg takes from the quality to the scaling of the tables */
+    scaling = table_scaling(in.quant_tbl_ptrs[0]);
+    quality = (scaling > 100) ? 5000 / scaling : (200 - scaling) / 2;
+    quality = MAX(quality * percent / 100, 1);
+    ratio = ((quality < 50) ? 5000 / quality : 200 - quality * 2) / MAX(scaling, 1);
+    ratio = MAX(ratio, 1);
+
+    jpeg_mem_dest(&out, dst, dst_size);
+    jpeg_copy_critical_parameters(&in, &out);
+
+    for(i = 0; i < NUM_QUANT_TBLS; i++) {
+        if(out.quant_tbl_ptrs[i] == NULL)
+            continue;
+        for(k = 0; k < DCTSIZE2; k++) {
+            q = (unsigned int)(out.quant_tbl_ptrs[i]->quantval[k] * ratio + 0.5);
+            out.quant_tbl_ptrs[i]->quantval[k] = MIN(MAX(q, 1), 255);
+        }
+    }
+
+    for(c = 0; c < in.num_components; c++) {
+        comp = &in.comp_info[c];
+        old = (comp->quant_table != NULL) ? comp->quant_table : in.quant_tbl_ptrs[comp->quant_tbl_no];
+        new = out.quant_tbl_ptrs[comp->quant_tbl_no];
+
+        /* the padding blocks of the last MCUs are coded as well */
+        rows = (comp->height_in_blocks + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor;
+        cols = (comp->width_in_blocks + comp->h_samp_factor - 1) / comp->h_samp_factor * comp->h_samp_factor;
+
+        for(row = 0; row < rows; row++) {
+            blocks = (*in.mem->access_virt_barray)((j_common_ptr)&in, coefs[c], row, 1, TRUE);
+            for(col = 0; col < cols; col++) {
+                block = blocks[0][col];
+                for(k = 0; k < DCTSIZE2; k++) {
+                    /* round to the nearest multiple of the new step */
+                    value = block[k] * (int)old->quantval[k];
+                    if(value >= 0)
+                        block[k] = (value + new->quantval[k] / 2) / new->quantval[k];
+                    else
+                        block[k] = -((-value + new->quantval[k] / 2) / new->quantval[k]);
+                }
+            }
+        }
+    }
+
+    /* the coefficients are at hand anyway, optimal Huffman tables are cheap */
+    out.optimize_coding = TRUE;
+    jpeg_write_coefficients(&out, coefs);
+    jpeg_finish_compress(&out);
+    jpeg_finish_decompress(&in);
+
+    jpeg_destroy_compress(&out);
+    jpeg_destroy_decompress(&in);
+
+    return 0;
+}
+
+#else
+
+int transcode_scale(const unsigned char *src, int size, int denom, unsigned char **dst, unsigned long *dst_size)
+{
+    return -1;
+}
+
+int transcode_requantize(const unsigned char *src, int size, int percent, unsigned char **dst, unsigned long *dst_size)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+/*
+ * Frames of the inputs converted in the compressed domain as far as libjpeg
+ * allows it. Without libjpeg all functions fail.
+ */
+int transcode_scale(const unsigned char *src, int size, int denom, unsigned char **dst, unsigned long *dst_size);
+int transcode_requantize(const unsigned char *src, int size, int percent, unsigned char **dst, unsigned long *dst_size);
+
+#endif
@@ -0,0 +1,294 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "httpd.h"
+#include "websocket.h"
+
+#define ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/******************************************************************************
+Description.: Calculate the SHA-1 digest of a short message, it is only used
+              for the handshake
+Input Value.: * data..: the message
+              * len...: its size
+              * digest: receives the 20 bytes of the digest
+Return Value: -
+******************************************************************************/
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint32_t w[80], a, b, c, d, e, f, k, tmp;
+    unsigned char block[64];
+    uint64_t bits = (uint64_t)len * 8;
+    size_t offset, n, total = ((len + 8) / 64 + 1) * 64;
+    int i;
+
+    for(offset = 0; offset < total; offset += 64) {
+        /* the message, a single 1 bit, zeros and the length in bits */
+        memset(block, 0, sizeof(block));
+        if(offset < len) {
+            n = MIN(len - offset, 64);
+            memcpy(block, data + offset, n);
+        }
+        if(len >= offset && len < offset + 64)
+            block[len - offset] = 0x80;
+        if(offset + 64 == total) {
+            for(i = 0; i < 8; i++)
+                block[63 - i] = (unsigned char)(bits >> (i * 8));
+        }
+
+        for(i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+                   (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        for(i = 16; i < 80; i++)
+            w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for(i = 0; i < 80; i++) {
+            if(i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if(i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            tmp = ROL(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROL(b, 30); b = a; a = tmp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for(i = 0; i < 20; i++)
+        digest[i] = (unsigned char)(h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/******************************************************************************
+Description.: Calculate the value of "Sec-WebSocket-Accept" for the key the
+              client sent
+Input Value.: * key...: value of "Sec-WebSocket-Key"
+              * accept: receives the base64 encoded answer
+              * size..: size of accept, at least 29 bytes
+Return Value: 0 on success, -1 if the key is not valid
+******************************************************************************/
+int websocket_accept_key(const char *key, char *accept, size_t size)
+{
+    static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char digest[20], input[128];
+    size_t len = strlen(key);
+    uint32_t triple;
+    int i, o = 0;
+
+    /* the key is 16 random bytes in base64 */
+    if(len != 24 || len + strlen(WS_GUID) >= sizeof(input) || size < 29)
+        return -1;
+
+    memcpy(input, key, len);
+    memcpy(input + len, WS_GUID, strlen(WS_GUID));
+    sha1(input, len + strlen(WS_GUID), digest);
+
+    for(i = 0; i < 20; i += 3) {
+        triple = digest[i] << 16 | ((i + 1 < 20) ? digest[i + 1] << 8 : 0) | ((i + 2 < 20) ? digest[i + 2] : 0);
+        accept[o++] = base64[(triple >> 18) & 0x3F];
+        accept[o++] = base64[(triple >> 12) & 0x3F];
+        accept[o++] = (i + 1 < 20) ? base64[(triple >> 6) & 0x3F] : '=';
+        accept[o++] = (i + 2 < 20) ? base64[triple & 0x3F] : '=';
+    }
+    accept[o] = '\0';
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Send a message in a single frame. The caller serializes the
+              messages of a connection. The payload is sent from where it
+              is, for frames that is the buffer shared by all clients.
+Input Value.: * fd.........: the connection
+              * opcode.....: WS_BINARY, WS_TEXT, ...
+              * prefix.....: first part of the payload, may be NULL
+              * prefix_size: its size
+              * data.......: second part of the payload, may be NULL
+              * size.......: its size
+Return Value: 0 on success, -1 in case of an error
+******************************************************************************/
+int websocket_send(int fd, int opcode, const void *prefix, size_t prefix_size, const void *data, size_t size)
+{
+    unsigned char header[10];
+    struct iovec iov[3];
+    size_t len = prefix_size + size, hlen;
+    ssize_t rc;
+    int i, cnt = 0;
+
+    header[0] = 0x80 | opcode;      /* FIN, servers never mask */
+    if(len < 126) {
+        header[1] = len;
+        hlen = 2;
+    } else if(len < 65536) {
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len & 0xFF;
+        hlen = 4;
+    } else {
+        header[1] = 127;
+        for(i = 0; i < 8; i++)
+            header[2 + i] = (unsigned char)((uint64_t)len >> ((7 - i) * 8));
+        hlen = 10;
+    }
+
+    iov[cnt].iov_base = header;
+    iov[cnt++].iov_len = hlen;
+    if(prefix_size > 0) {
+        iov[cnt].iov_base = (void *)prefix;
+        iov[cnt++].iov_len = prefix_size;
+    }
+    if(size > 0) {
+        iov[cnt].iov_base = (void *)data;
+        iov[cnt++].iov_len = size;
+    }
+
+    /* a blocking socket only returns early if a signal interrupted the call */
+    while(cnt > 0) {
+        if((rc = writev(fd, iov, cnt)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        while(cnt > 0 && (size_t)rc >= iov[0].iov_len) {
+            rc -= iov[0].iov_len;
+            memmove(iov, iov + 1, --cnt * sizeof(struct iovec));
+        }
+        if(cnt > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + rc;
+            iov[0].iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Read exactly n bytes, bytes that arrived with the request are
+              taken first
+Input Value.: * fd.....: the connection
+              * pending: bytes that were read with the handshake
+              * dst....: buffer to read to
+              * n......: number of bytes
+Return Value: 0 on success, -1 if the connection was closed or failed
+******************************************************************************/
+static int read_exact(int fd, iobuffer *pending, void *dst, size_t n)
+{
+    char *p = dst;
+    size_t take;
+    ssize_t rc;
+
+    if(pending->level > 0) {
+        take = MIN((size_t)pending->level, n);
+        memcpy(p, pending->buffer, take);
+        memmove(pending->buffer, pending->buffer + take, pending->level - take);
+        pending->level -= take;
+        p += take;
+        n -= take;
+    }
+
+    while(n > 0) {
+        if((rc = recv(fd, p, n, 0)) <= 0) {
+            if(rc < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rc;
+        n -= rc;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Read a message of the client. Fragmented messages are not
+              supported, control messages are short and sent at once.
+Input Value.: * fd.....: the connection
+              * pending: bytes that were read with the handshake
+              * opcode.: receives the opcode
+              * payload: receives the unmasked payload, terminated by '\0'
+              * size...: size of payload
+Return Value: size of the payload, -1 if the connection was closed or failed,
+              -WS_CLOSE_* if the client violated the protocol or the limits
+******************************************************************************/
+int websocket_read(int fd, iobuffer *pending, int *opcode, char *payload, size_t size)
+{
+    unsigned char header[2], ext[8], mask[4];
+    uint64_t len;
+    size_t i;
+
+    if(read_exact(fd, pending, header, 2) < 0)
+        return -1;
+
+    *opcode = header[0] & 0x0F;
+    len = header[1] & 0x7F;
+
+    /* the RFC requires clients to mask */
+    if(!(header[1] & 0x80))
+        return -WS_CLOSE_PROTOCOL;
+    if(!(header[0] & 0x80) || *opcode == WS_CONTINUATION)
+        return -WS_CLOSE_UNSUPPORTED;
+
+    if(len == 126) {
+        if(read_exact(fd, pending, ext, 2) < 0)
+            return -1;
+        len = ext[0] << 8 | ext[1];
+    } else if(len == 127) {
+        if(read_exact(fd, pending, ext, 8) < 0)
+            return -1;
+        for(len = 0, i = 0; i < 8; i++)
+            len = len << 8 | ext[i];
+    }
+
+    if(len >= size || len > WS_MAX_MESSAGE)
+        return -WS_CLOSE_TOO_BIG;
+
+    if(read_exact(fd, pending, mask, 4) < 0 || read_exact(fd, pending, payload, len) < 0)
+        return -1;
+
+    for(i = 0; i < len; i++)
+        payload[i] ^= mask[i % 4];
+    payload[len] = '\0';
+
+    return (int)len;
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* RFC 6455 */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+/* status codes of close messages */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_UNSUPPORTED 1003
+#define WS_CLOSE_TOO_BIG 1009
+
+/* the largest message a client may send, they only send commands */
+#define WS_MAX_MESSAGE 1024
+
+/*
+ * Each binary message starts with this prefix, the JPEG follows. All fields
+ * are in network byte order, JavaScript reads them with a DataView.
+ */
+#define WS_PREFIX_VERSION 1
+typedef struct {
+    uint8_t version;            /* WS_PREFIX_VERSION */
+    uint8_t length;             /* size of the prefix, the JPEG starts here */
+    uint8_t scale;              /* the frame has 1/2^scale of the input size */
+    uint8_t quality;            /* in percent of the quality of the input */
+    uint32_t seq;               /* number of the frame */
+    uint32_t size;              /* size of the JPEG */
+    uint32_t timestamp_sec;     /* time the input captured the frame */
+    uint32_t timestamp_usec;
+    uint32_t sent_sec;          /* time the server sent the frame */
+    uint32_t sent_usec;
+} ws_frame_prefix;
+
+int websocket_accept_key(const char *key, char *accept, size_t size);
+int websocket_send(int fd, int opcode, const void *prefix, size_t prefix_size, const void *data, size_t size);
+int websocket_read(int fd, iobuffer *pending, int *opcode, char *payload, size_t size);
+
+#endif
@@ -161,7 +161,7 @@ void *worker_thread(void *arg)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_frame_size(&pglobal->in[input_number]);
 
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -178,7 +178,7 @@ void *worker_thread(void *arg)
         }
 
         /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -0,0 +1,699 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Analyzer of the latency probe of input_testpicture. It receives the frames
+ * from output_http, output_file or output_udp, reads the capture time the
+ * input drew into each frame and reports how long the frames took from the
+ * input until they arrived here, including encoder, queues and network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <netdb.h>
+
+#include <jpeglib.h>
+
+#include "../../plugins/input_testpicture/probe.h"
+
+#define RECV_BUFFER (64*1024)
+#define MAX_FRAME (16*1024*1024)
+#define LINE_SIZE 1024
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *url;
+    const char *folder;
+    const char *udp_port;
+    const char *udp_file;
+    const char *csv;
+    long frames;
+    int duration;
+    int verbose;
+} conf = { "127.0.0.1", "8080", "/?action=stream", NULL, NULL, "/tmp/latency_probe.jpg", NULL, 0, 10, 0 };
+
+/* results of the run */
+static struct {
+    unsigned long frames;       /* frames received */
+    unsigned long undecodable;  /* frames libjpeg could not decode */
+    unsigned long unreadable;   /* frames without a valid probe pattern */
+    unsigned long missed;       /* gaps in the sequence numbers */
+    unsigned long repeated;     /* frames received more than once */
+    unsigned long failures;     /* refused connections, error responses, timeouts */
+    int have_seq;
+    unsigned int last_seq;
+    double *latencies;          /* milliseconds from capture to arrival */
+    size_t count;
+    size_t size;
+} result;
+
+static FILE *csv;
+static volatile int stop;
+
+/* libjpeg exits the program on errors by default, jump back to the caller instead */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} error_mgr;
+
+static void error_exit(j_common_ptr cinfo)
+{
+    longjmp(((error_mgr *)cinfo->err)->setjmp_buffer, 1);
+}
+
+static void output_message(j_common_ptr cinfo)
+{
+}
+
+/******************************************************************************
+Description.: print help message
+Input Value.: progname: name of the program
+Return Value: -
+******************************************************************************/
+static void help(const char *progname)
+{
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n" \
+            " [-H | --host ]..........: address of the server (default 127.0.0.1)\n" \
+            " [-p | --port ]..........: port of output_http (default 8080)\n" \
+            " [-u | --url ]...........: path of a stream or a snapshot, snapshots\n" \
+            "                           are requested again and again\n" \
+            "                           (default /?action=stream)\n" \
+            " [-f | --folder ]........: read the files output_file writes to this\n" \
+            "                           folder instead\n" \
+            " [-U | --udp ]...........: request the frames from output_udp on this\n" \
+            "                           port instead\n" \
+            " [-o | --output ]........: file output_udp writes the frames to\n" \
+            "                           (default /tmp/latency_probe.jpg)\n" \
+            " [-n | --frames ]........: stop after this many frames\n" \
+            " [-t | --time ]..........: seconds to run (default 10)\n" \
+            " [-c | --csv ]...........: write sequence number, capture time, arrival\n" \
+            "                           time and latency of each frame to this file\n" \
+            " [-v | --verbose ].......: print each frame\n");
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Example:\n" \
+            " latency of the HTTP stream of a probe on this machine:\n" \
+            "  mjpg_streamer -i \"input_testpicture.so -l -d 33\" -o \"output_http.so -p 8080\"\n" \
+            "  %s -t 30\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: Current time
+Input Value.: -
+Return Value: microseconds since the epoch, the same clock the probe uses
+******************************************************************************/
+static unsigned long long now_usec(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return (unsigned long long)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+/******************************************************************************
+Description.: Decode a frame, read its probe pattern and account it
+Input Value.: * jpeg...: the frame
+              * size...: its size
+              * arrival: time the last byte of the frame arrived, taken before
+                         decoding so the analyzer does not add to the latency
+Return Value: -
+******************************************************************************/
+static void analyze(const unsigned char *jpeg, size_t size, unsigned long long arrival)
+{
+    struct jpeg_decompress_struct cinfo;
+    error_mgr jerr;
+    unsigned char *luma = NULL;
+    JSAMPROW row;
+    probe_stamp stamp;
+    double latency, *latencies;
+    int rc;
+
+    result.frames++;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = error_exit;
+    jerr.pub.output_message = output_message;
+    jpeg_create_decompress(&cinfo);
+
+    if(setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(luma);
+        result.undecodable++;
+        return;
+    }
+
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /* the pattern is black and white, the luma is all we need */
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    if((luma = malloc(cinfo.output_width * cinfo.output_height)) == NULL)
+        longjmp(jerr.setjmp_buffer, 1);
+
+    while(cinfo.output_scanline < cinfo.output_height) {
+        row = luma + cinfo.output_scanline * cinfo.output_width;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+
+    rc = probe_read(luma, cinfo.output_width, cinfo.output_height, cinfo.output_width, &stamp);
+    jpeg_destroy_decompress(&cinfo);
+    free(luma);
+
+    if(rc < 0) {
+        result.unreadable++;
+        if(conf.verbose)
+            printf("frame without probe pattern, %lu bytes\n", (unsigned long)size);
+        return;
+    }
+
+    if(result.have_seq) {
+        if(stamp.seq == result.last_seq) {
+            result.repeated++;
+            return;
+        }
+        if(stamp.seq > result.last_seq + 1)
+            result.missed += stamp.seq - result.last_seq - 1;
+    }
+    result.have_seq = 1;
+    result.last_seq = stamp.seq;
+
+    latency = ((double)arrival - (double)stamp.usec) / 1000;
+
+    if(result.count == result.size) {
+        result.size = result.size ? result.size * 2 : 1024;
+        if((latencies = realloc(result.latencies, result.size * sizeof(double))) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        result.latencies = latencies;
+    }
+    result.latencies[result.count++] = latency;
+
+    if(conf.verbose)
+        printf("frame %u: %.2f ms\n", stamp.seq, latency);
+    if(csv != NULL)
+        fprintf(csv, "%u,%llu,%llu,%.3f\n", stamp.seq, stamp.usec, arrival, latency);
+}
+
+/******************************************************************************
+Description.: Connect to a server, reads time out after a second so the
+              loops notice the end of the run
+Input Value.: * port.....: port of the server
+              * socktype.: SOCK_STREAM or SOCK_DGRAM
+Return Value: the socket or -1
+******************************************************************************/
+static int open_connection(const char *port, int socktype)
+{
+    struct addrinfo hints, *server;
+    struct timeval timeout = { 1, 0 };
+    int fd = -1, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    if((rc = getaddrinfo(conf.host, port, &hints, &server)) != 0) {
+        fprintf(stderr, "%s:%s: %s\n", conf.host, port, gai_strerror(rc));
+        return -1;
+    }
+
+    if((fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol)) >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if(connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(server);
+    return fd;
+}
+
+/******************************************************************************
+Description.: Find the end of the next JPEG in a buffer. Inside the entropy
+              coded data 0xFF is always followed by 0x00, so the first EOI
+              marker after the SOI ends the frame.
+Input Value.: * data.: the buffer
+              * size.: bytes in the buffer
+              * start: receives the offset of the SOI marker, -1 if none
+Return Value: offset behind the EOI marker, -1 if the frame is not complete
+******************************************************************************/
+static long find_frame(const unsigned char *data, long size, long *start)
+{
+    const unsigned char *p;
+
+    *start = -1;
+    if(size < 2)
+        return -1;
+
+    for(p = data; (p = memchr(p, 0xFF, size - 1 - (p - data))) != NULL; p++) {
+        if(*start < 0 && p[1] == 0xD8)
+            *start = p - data;
+        else if(*start >= 0 && p[1] == 0xD9)
+            return p - data + 2;
+        if(p - data >= size - 2)
+            break;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: Receive frames from output_http. The frames are cut out of the
+              byte stream at their JPEG markers, so this works for
+              multipart streams as well as snapshots. When the server closes
+              the connection the request is sent again.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void http_source(void)
+{
+    char request[LINE_SIZE];
+    unsigned char *data, *tmp;
+    long size = 0, capacity = RECV_BUFFER, start, end;
+    int fd, len, rc, header;
+
+    if((data = malloc(capacity)) == NULL)
+        return;
+
+    while(!stop) {
+        if((fd = open_connection(conf.port, SOCK_STREAM)) < 0) {
+            result.failures++;
+            usleep(100 * 1000);
+            continue;
+        }
+
+        len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n" \
+                       "Host: %s\r\n" \
+                       "User-Agent: latency_probe\r\n" \
+                       "\r\n", conf.url, conf.host);
+        if(send(fd, request, len, MSG_NOSIGNAL) != len) {
+            close(fd);
+            result.failures++;
+            continue;
+        }
+
+        size = 0;
+        header = 1;
+        while(!stop) {
+            if(size == capacity) {
+                if(capacity >= MAX_FRAME || (tmp = realloc(data, capacity * 2)) == NULL)
+                    break;
+                data = tmp;
+                capacity *= 2;
+            }
+
+            rc = recv(fd, data + size, capacity - size, 0);
+            if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if(rc <= 0)
+                break;
+            size += rc;
+
+            /* the status line is in the first bytes of the response */
+            if(header && size >= 12) {
+                if(strncmp((char *)data, "HTTP/1.", 7) != 0 || atoi((char *)data + 9) != 200) {
+                    if(conf.verbose)
+                        fprintf(stderr, "server answered: %.12s\n", (char *)data);
+                    result.failures++;
+                    break;
+                }
+                header = 0;
+            }
+
+            while((end = find_frame(data, size, &start)) > 0) {
+                analyze(data + start, end - start, now_usec());
+                memmove(data, data + end, size - end);
+                size -= end;
+                if(conf.frames > 0 && result.count >= conf.frames)
+                    stop = 1;
+            }
+        }
+
+        close(fd);
+    }
+
+    free(data);
+}
+
+/******************************************************************************
+Description.: Read a whole file
+Input Value.: * path: name of the file
+              * size: receives the size
+Return Value: the content, to be freed by the caller, NULL on errors
+******************************************************************************/
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    struct stat st;
+    unsigned char *data = NULL;
+    ssize_t rc;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if(fstat(fd, &st) == 0 && st.st_size > 0 && (data = malloc(st.st_size)) != NULL) {
+        *size = 0;
+        while(*size < (size_t)st.st_size && (rc = read(fd, data + *size, st.st_size - *size)) > 0)
+            *size += rc;
+    }
+
+    close(fd);
+    return data;
+}
+
+/******************************************************************************
+Description.: Receive the files output_file writes, a file counts as arrived
+              when it is closed
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void folder_source(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[LINE_SIZE];
+    struct inotify_event *event;
+    struct pollfd pfd;
+    unsigned long long arrival;
+    unsigned char *data;
+    size_t size;
+    ssize_t len;
+    char *p;
+
+    if((pfd.fd = inotify_init1(IN_CLOEXEC)) < 0 || inotify_add_watch(pfd.fd, conf.folder, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(conf.folder);
+        stop = 1;
+        return;
+    }
+    pfd.events = POLLIN;
+
+    while(!stop) {
+        if(poll(&pfd, 1, 1000) <= 0)
+            continue;
+        if((len = read(pfd.fd, events, sizeof(events))) <= 0)
+            continue;
+        arrival = now_usec();
+
+        for(p = events; p < events + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)p;
+            if(event->len == 0 || strlen(event->name) < 4 || strcasecmp(event->name + strlen(event->name) - 4, ".jpg") != 0)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", conf.folder, event->name);
+            if((data = read_file(path, &size)) == NULL) {
+                result.failures++;
+                continue;
+            }
+            analyze(data, size, arrival);
+            free(data);
+
+            if(conf.frames > 0 && result.count >= conf.frames)
+                stop = 1;
+        }
+    }
+
+    close(pfd.fd);
+}
+
+/******************************************************************************
+Description.: Request frames from output_udp, it writes the next frame to the
+              file named in the datagram and sends the datagram back
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void udp_source(void)
+{
+    char answer[LINE_SIZE];
+    unsigned long long arrival;
+    unsigned char *data;
+    size_t size;
+    int fd, len = strlen(conf.udp_file);
+
+    if((fd = open_connection(conf.udp_port, SOCK_DGRAM)) < 0) {
+        stop = 1;
+        return;
+    }
+
+    while(!stop) {
+        if(send(fd, conf.udp_file, len, 0) != len || recv(fd, answer, sizeof(answer), 0) != len) {
+            if(!stop)
+                result.failures++;
+            continue;
+        }
+        arrival = now_usec();
+
+        if((data = read_file(conf.udp_file, &size)) == NULL) {
+            result.failures++;
+            continue;
+        }
+        analyze(data, size, arrival);
+        free(data);
+
+        if(conf.frames > 0 && result.count >= conf.frames)
+            stop = 1;
+    }
+
+    close(fd);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+Description.: Print the latency distribution
+Input Value.: elapsed: seconds the run took
+Return Value: -
+******************************************************************************/
+static void report(double elapsed)
+{
+    double *l = result.latencies, sum = 0;
+    size_t n = result.count, i;
+
+    printf("%lu frames in %.1f s, %lu undecodable, %lu without probe, %lu repeated, %lu missed, %lu failures\n",
+           result.frames, elapsed, result.undecodable, result.unreadable, result.repeated, result.missed, result.failures);
+
+    if(n == 0) {
+        printf("  latency...........: unknown, no frames with a probe pattern\n");
+        return;
+    }
+
+    qsort(l, n, sizeof(double), compare_doubles);
+    for(i = 0; i < n; i++)
+        sum += l[i];
+
+    printf("  latency...........: min %.2f ms, mean %.2f ms, max %.2f ms\n", l[0], sum / n, l[n - 1]);
+    printf("  percentiles.......: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms\n",
+           l[n / 2], l[(n * 90) / 100], l[(n * 99) / 100], l[(n * 999) / 1000]);
+}
+
+/******************************************************************************
+Description.: stop the run early with CTRL+C
+Input Value.: sig tells us which signal was received
+Return Value: -
+******************************************************************************/
+static void signal_handler(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec started, ended;
+    double elapsed;
+
+    while(1) {
+        int c = 0, option_index = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0},
+            {"help", no_argument, 0, 0},
+            {"H", required_argument, 0, 0},
+            {"host", required_argument, 0, 0},
+            {"p", required_argument, 0, 0},
+            {"port", required_argument, 0, 0},
+            {"u", required_argument, 0, 0},
+            {"url", required_argument, 0, 0},
+            {"f", required_argument, 0, 0},
+            {"folder", required_argument, 0, 0},
+            {"U", required_argument, 0, 0},
+            {"udp", required_argument, 0, 0},
+            {"o", required_argument, 0, 0},
+            {"output", required_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"frames", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"time", required_argument, 0, 0},
+            {"c", required_argument, 0, 0},
+            {"csv", required_argument, 0, 0},
+            {"v", no_argument, 0, 0},
+            {"verbose", no_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(argc, argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            help(argv[0]);
+            return EXIT_SUCCESS;
+
+            /* H, host */
+        case 2:
+        case 3:
+            conf.host = optarg;
+            break;
+
+            /* p, port */
+        case 4:
+        case 5:
+            conf.port = optarg;
+            break;
+
+            /* u, url */
+        case 6:
+        case 7:
+            conf.url = optarg;
+            break;
+
+            /* f, folder */
+        case 8:
+        case 9:
+            conf.folder = optarg;
+            break;
+
+            /* U, udp */
+        case 10:
+        case 11:
+            conf.udp_port = optarg;
+            break;
+
+            /* o, output */
+        case 12:
+        case 13:
+            conf.udp_file = optarg;
+            break;
+
+            /* n, frames */
+        case 14:
+        case 15:
+            conf.frames = atol(optarg);
+            break;
+
+            /* t, time */
+        case 16:
+        case 17:
+            conf.duration = atoi(optarg);
+            break;
+
+            /* c, csv */
+        case 18:
+        case 19:
+            conf.csv = optarg;
+            break;
+
+            /* v, verbose */
+        case 20:
+        case 21:
+            conf.verbose = 1;
+            break;
+        }
+    }
+
+    if(conf.duration <= 0 || conf.frames < 0 || (conf.folder != NULL && conf.udp_port != NULL)) {
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(conf.csv != NULL) {
+        if((csv = fopen(conf.csv, "w")) == NULL) {
+            perror(conf.csv);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "seq,capture_usec,arrival_usec,latency_ms\n");
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGALRM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+    alarm(conf.duration);
+
+    if(conf.folder != NULL)
+        printf("reading the frames written to %s for %d s\n", conf.folder, conf.duration);
+    else if(conf.udp_port != NULL)
+        printf("requesting frames from %s:%s (UDP) for %d s\n", conf.host, conf.udp_port, conf.duration);
+    else
+        printf("receiving http://%s:%s%s for %d s\n", conf.host, conf.port, conf.url, conf.duration);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if(conf.folder != NULL)
+        folder_source();
+    else if(conf.udp_port != NULL)
+        udp_source();
+    else
+        http_source();
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    elapsed = (ended.tv_sec - started.tv_sec) + (ended.tv_nsec - started.tv_nsec) / 1e9;
+
+    report(elapsed);
+
+    if(csv != NULL)
+        fclose(csv);
+    free(result.latencies);
+
+    return (result.count > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,700 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Load generator for output_http. It opens stream connections and snapshot
+ * pollers against a running server and reports how many frames each client
+ * received, how old they were and how many connections failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* the boundary output_http separates the frames of a stream with */
+#define BOUNDARY "boundarydonotcross"
+
+#define RECV_BUFFER (64*1024)
+#define LINE_SIZE 1024
+
+enum {
+    CLIENT_STREAM,
+    CLIENT_SNAPSHOT
+};
+
+/* a simulated viewer, one thread each */
+typedef struct {
+    int kind;
+    int id;
+    pthread_t thread;
+    unsigned long frames;       /* complete frames received */
+    unsigned long bad_frames;   /* frames that do not start like a JPEG */
+    unsigned long long bytes;   /* size of the received frames */
+    unsigned long failures;     /* refused connections, error responses, broken streams */
+    double *ages;               /* milliseconds between capture and reception of each frame */
+    size_t age_count;
+    size_t age_size;
+} client;
+
+/* buffered reading from a connection */
+typedef struct {
+    int fd;
+    int start;
+    int end;
+    char data[RECV_BUFFER];
+} reader;
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *stream_url;
+    const char *snapshot_url;
+    int streams;
+    int snapshots;
+    int rate;           /* snapshots per second of each poller, 0 for as fast as possible */
+    int keepalive;
+    int duration;
+    int verbose;
+} conf = { "127.0.0.1", "8080", "/?action=stream", "/?action=snapshot", 1, 0, 0, 0, 10, 0 };
+
+static struct addrinfo *server;
+static volatile int stop;
+
+/******************************************************************************
+Description.: print help message
+Input Value.: progname: name of the program
+Return Value: -
+******************************************************************************/
+static void help(const char *progname)
+{
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n" \
+            " [-H | --host ]..........: address of the server (default 127.0.0.1)\n" \
+            " [-p | --port ]..........: port of the server (default 8080)\n" \
+            " [-s | --streams ].......: number of stream clients (default 1)\n" \
+            " [-n | --snapshots ].....: number of snapshot pollers (default 0)\n" \
+            " [-r | --rate ]..........: snapshots per second of each poller,\n" \
+            "                           0 polls as fast as possible (default)\n" \
+            " [-k | --keepalive ].....: pollers reuse their connection\n" \
+            " [-t | --time ]..........: seconds to run (default 10)\n" \
+            " [-u | --url ]...........: path of the stream (default /?action=stream)\n" \
+            " [-su | --snapshot_url ].: path of the snapshots (default /?action=snapshot)\n" \
+            " [-v | --verbose ].......: report each client\n");
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Example:\n" \
+            " 100 viewers of a test picture stream on this machine:\n" \
+            "  mjpg_streamer -i \"input_testpicture.so -d 40\" -o \"output_http.so -p 8080\"\n" \
+            "  %s -s 100 -t 30\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: Current time
+Input Value.: clock: CLOCK_REALTIME to compare with the timestamps of the
+                     frames, CLOCK_MONOTONIC to measure intervals
+Return Value: seconds
+******************************************************************************/
+static double seconds(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+Description.: Connect to the server, reads time out after a second so the
+              threads notice the end of the run
+Input Value.: -
+Return Value: the socket or -1
+******************************************************************************/
+static int open_connection(void)
+{
+    struct timeval timeout = { 1, 0 };
+    int fd;
+
+    if((fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol)) < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if(connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/******************************************************************************
+Description.: Send a GET request
+Input Value.: * fd.......: the connection
+              * url......: the path and query
+              * keepalive: ask to keep the connection open
+Return Value: 0 if OK, -1 on errors
+******************************************************************************/
+static int send_request(int fd, const char *url, int keepalive)
+{
+    char request[LINE_SIZE];
+    int len;
+
+    len = snprintf(request, sizeof(request), "GET %s HTTP/1.%d\r\n" \
+                   "Host: %s\r\n" \
+                   "User-Agent: stream_bench\r\n" \
+                   "Connection: %s\r\n" \
+                   "\r\n", url, keepalive, conf.host, keepalive ? "keep-alive" : "close");
+
+    return (send(fd, request, len, MSG_NOSIGNAL) == len) ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: Read more data into the buffer of a reader
+Input Value.: r: the reader
+Return Value: number of new bytes, -1 at the end of the connection, on errors
+              or at the end of the run
+******************************************************************************/
+static int fill(reader *r)
+{
+    int rc;
+
+    if(r->start > 0) {
+        memmove(r->data, r->data + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+
+    while(1) {
+        if(stop)
+            return -1;
+        if(r->end == sizeof(r->data))
+            return -1;
+
+        rc = recv(r->fd, r->data + r->end, sizeof(r->data) - r->end, 0);
+        if(rc > 0) {
+            r->end += rc;
+            return rc;
+        }
+        if(rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return -1;
+    }
+}
+
+/******************************************************************************
+Description.: Read a line, without the CRLF
+Input Value.: * r...: the reader
+              * line: receives the line, truncated to LINE_SIZE
+Return Value: 0 if OK, -1 if the connection ended
+******************************************************************************/
+static int read_line(reader *r, char *line)
+{
+    char *end;
+    int len;
+
+    while((end = memchr(r->data + r->start, '\n', r->end - r->start)) == NULL) {
+        if(fill(r) < 0)
+            return -1;
+    }
+
+    len = end - (r->data + r->start);
+    if(len > 0 && end[-1] == '\r')
+        len--;
+    if(len >= LINE_SIZE)
+        len = LINE_SIZE - 1;
+
+    memcpy(line, r->data + r->start, len);
+    line[len] = '\0';
+    r->start = end - r->data + 1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Read header lines up to the empty line
+Input Value.: * r.............: the reader
+              * content_length: receives "Content-Length", -1 if missing
+              * timestamp.....: receives "X-Timestamp" in seconds, 0 if missing
+              * close.........: receives 1 if the server closes the connection
+Return Value: 0 if OK, -1 if the connection ended
+******************************************************************************/
+static int read_headers(reader *r, long *content_length, double *timestamp, int *close)
+{
+    char line[LINE_SIZE];
+
+    *content_length = -1;
+    *timestamp = 0;
+    if(close != NULL)
+        *close = 0;
+
+    while(1) {
+        if(read_line(r, line) < 0)
+            return -1;
+        if(line[0] == '\0')
+            return 0;
+
+        if(strncasecmp(line, "Content-Length:", 15) == 0)
+            *content_length = strtol(line + 15, NULL, 10);
+        else if(strncasecmp(line, "X-Timestamp:", 12) == 0)
+            *timestamp = strtod(line + 12, NULL);
+        else if(close != NULL && strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close") != NULL)
+            *close = 1;
+    }
+}
+
+/******************************************************************************
+Description.: Read a frame and account it to the client
+Input Value.: * c.........: the client
+              * r.........: the reader
+              * size......: size of the frame
+              * timestamp.: capture time of the frame, 0 if unknown
+Return Value: 0 if OK, -1 if the connection ended
+******************************************************************************/
+static int read_frame(client *c, reader *r, long size, double timestamp)
+{
+    long left = size;
+    int n, checked = 0;
+    double *ages;
+
+    while(left > 0) {
+        if(r->start == r->end && fill(r) < 0)
+            return -1;
+
+        /* a JPEG starts with the SOI marker */
+        if(!checked && r->end - r->start >= 2) {
+            if((unsigned char)r->data[r->start] != 0xFF || (unsigned char)r->data[r->start + 1] != 0xD8)
+                c->bad_frames++;
+            checked = 1;
+        }
+
+        n = (r->end - r->start < left) ? r->end - r->start : left;
+        r->start += n;
+        left -= n;
+    }
+
+    c->frames++;
+    c->bytes += size;
+
+    if(timestamp > 0) {
+        if(c->age_count == c->age_size) {
+            c->age_size = c->age_size ? c->age_size * 2 : 1024;
+            if((ages = realloc(c->ages, c->age_size * sizeof(double))) == NULL)
+                return 0;
+            c->ages = ages;
+        }
+        c->ages[c->age_count++] = (seconds(CLOCK_REALTIME) - timestamp) * 1000;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Check the status line of a response
+Input Value.: r: the reader
+Return Value: 0 for "200 OK", -1 otherwise
+******************************************************************************/
+static int read_status(reader *r)
+{
+    char line[LINE_SIZE];
+    char *status;
+
+    if(read_line(r, line) < 0 || (status = strchr(line, ' ')) == NULL)
+        return -1;
+
+    if(atoi(status + 1) != 200) {
+        if(conf.verbose)
+            fprintf(stderr, "server answered: %s\n", line);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Thread of a stream client, it receives the multipart stream and
+              connects again if the stream breaks
+Input Value.: arg is the client
+Return Value: NULL
+******************************************************************************/
+static void *stream_client(void *arg)
+{
+    client *c = arg;
+    reader *r;
+    char line[LINE_SIZE];
+    long size;
+    double timestamp;
+
+    if((r = malloc(sizeof(reader))) == NULL)
+        return NULL;
+
+    while(!stop) {
+        r->start = r->end = 0;
+        if((r->fd = open_connection()) < 0 || send_request(r->fd, conf.stream_url, 0) < 0 ||
+           read_status(r) < 0 || read_headers(r, &size, &timestamp, NULL) < 0) {
+            if(r->fd >= 0)
+                close(r->fd);
+            if(!stop) {
+                c->failures++;
+                sleep(1);
+            }
+            continue;
+        }
+
+        /* each part starts with the boundary and has its own headers */
+        while(read_line(r, line) == 0) {
+            if(strcmp(line, "--" BOUNDARY) != 0)
+                continue;
+            if(read_headers(r, &size, &timestamp, NULL) < 0 || size < 0 ||
+               read_frame(c, r, size, timestamp) < 0)
+                break;
+        }
+
+        close(r->fd);
+        if(!stop)
+            c->failures++;
+    }
+
+    free(r);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Thread of a snapshot poller
+Input Value.: arg is the client
+Return Value: NULL
+******************************************************************************/
+static void *snapshot_client(void *arg)
+{
+    client *c = arg;
+    reader *r;
+    long size;
+    double timestamp, next = seconds(CLOCK_MONOTONIC), now;
+    int close_after;
+
+    if((r = malloc(sizeof(reader))) == NULL)
+        return NULL;
+    r->fd = -1;
+
+    while(!stop) {
+        if(r->fd < 0) {
+            r->start = r->end = 0;
+            if((r->fd = open_connection()) < 0) {
+                c->failures++;
+                usleep(100 * 1000);
+                continue;
+            }
+        }
+
+        if(send_request(r->fd, conf.snapshot_url, conf.keepalive) < 0 || read_status(r) < 0 ||
+           read_headers(r, &size, &timestamp, &close_after) < 0 || size < 0 ||
+           read_frame(c, r, size, timestamp) < 0) {
+            if(!stop)
+                c->failures++;
+            close_after = 1;
+        }
+
+        if(!conf.keepalive || close_after) {
+            close(r->fd);
+            r->fd = -1;
+        }
+
+        if(conf.rate > 0) {
+            next += 1.0 / conf.rate;
+            if((now = seconds(CLOCK_MONOTONIC)) < next)
+                usleep((next - now) * 1e6);
+            else
+                next = now;
+        }
+    }
+
+    if(r->fd >= 0)
+        close(r->fd);
+    free(r);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+Description.: Print the results of one kind of clients
+Input Value.: * clients: all clients
+              * count..: number of clients
+              * kind...: CLIENT_STREAM or CLIENT_SNAPSHOT
+              * elapsed: seconds the run took
+Return Value: -
+******************************************************************************/
+static void report(client *clients, int count, int kind, double elapsed)
+{
+    double *fps, *ages;
+    size_t n = 0, age_count = 0;
+    unsigned long frames = 0, bad_frames = 0, failures = 0;
+    unsigned long long bytes = 0;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(clients[i].kind == kind) {
+            n++;
+            age_count += clients[i].age_count;
+        }
+    }
+    if(n == 0)
+        return;
+
+    if((fps = calloc(n, sizeof(double))) == NULL || (ages = calloc(age_count + 1, sizeof(double))) == NULL) {
+        free(fps);
+        return;
+    }
+
+    for(i = 0, n = 0, age_count = 0; i < count; i++) {
+        client *c = &clients[i];
+
+        if(c->kind != kind)
+            continue;
+
+        fps[n++] = c->frames / elapsed;
+        frames += c->frames;
+        bad_frames += c->bad_frames;
+        bytes += c->bytes;
+        failures += c->failures;
+        memcpy(ages + age_count, c->ages, c->age_count * sizeof(double));
+        age_count += c->age_count;
+
+        if(conf.verbose)
+            printf("%s %3d: %6.1f fps, %8.1f kB/s, %lu failures\n", (kind == CLIENT_STREAM) ? "stream  " : "snapshot",
+                   c->id, c->frames / elapsed, c->bytes / elapsed / 1024, c->failures);
+    }
+
+    qsort(fps, n, sizeof(double), compare_doubles);
+    qsort(ages, age_count, sizeof(double), compare_doubles);
+
+    printf("%s: %lu clients, %lu frames, %lu connection failures, %lu bad frames\n",
+           (kind == CLIENT_STREAM) ? "streams" : "snapshots", (unsigned long)n, frames, failures, bad_frames);
+    printf("  fps per client....: min %.1f, p50 %.1f, max %.1f\n", fps[0], fps[n / 2], fps[n - 1]);
+    printf("  throughput........: %.1f kB/s, %.1f kB/s per client\n", bytes / elapsed / 1024, bytes / elapsed / 1024 / n);
+    if(age_count > 0)
+        printf("  frame age.........: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+               ages[age_count / 2], ages[(age_count * 99) / 100], ages[age_count - 1]);
+    else
+        printf("  frame age.........: unknown, no frames with X-Timestamp\n");
+
+    free(fps);
+    free(ages);
+}
+
+/******************************************************************************
+Description.: stop the run early with CTRL+C
+Input Value.: sig tells us which signal was received
+Return Value: -
+******************************************************************************/
+static void signal_handler(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    pthread_attr_t attr;
+    client *clients;
+    double started, elapsed;
+    int i, count, rc;
+
+    while(1) {
+        int c = 0, option_index = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0},
+            {"help", no_argument, 0, 0},
+            {"H", required_argument, 0, 0},
+            {"host", required_argument, 0, 0},
+            {"p", required_argument, 0, 0},
+            {"port", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"streams", required_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"snapshots", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"rate", required_argument, 0, 0},
+            {"k", no_argument, 0, 0},
+            {"keepalive", no_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"time", required_argument, 0, 0},
+            {"u", required_argument, 0, 0},
+            {"url", required_argument, 0, 0},
+            {"su", required_argument, 0, 0},
+            {"snapshot_url", required_argument, 0, 0},
+            {"v", no_argument, 0, 0},
+            {"verbose", no_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(argc, argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            help(argv[0]);
+            return EXIT_SUCCESS;
+
+            /* H, host */
+        case 2:
+        case 3:
+            conf.host = optarg;
+            break;
+
+            /* p, port */
+        case 4:
+        case 5:
+            conf.port = optarg;
+            break;
+
+            /* s, streams */
+        case 6:
+        case 7:
+            conf.streams = atoi(optarg);
+            break;
+
+            /* n, snapshots */
+        case 8:
+        case 9:
+            conf.snapshots = atoi(optarg);
+            break;
+
+            /* r, rate */
+        case 10:
+        case 11:
+            conf.rate = atoi(optarg);
+            break;
+
+            /* k, keepalive */
+        case 12:
+        case 13:
+            conf.keepalive = 1;
+            break;
+
+            /* t, time */
+        case 14:
+        case 15:
+            conf.duration = atoi(optarg);
+            break;
+
+            /* u, url */
+        case 16:
+        case 17:
+            conf.stream_url = optarg;
+            break;
+
+            /* su, snapshot_url */
+        case 18:
+        case 19:
+            conf.snapshot_url = optarg;
+            break;
+
+            /* v, verbose */
+        case 20:
+        case 21:
+            conf.verbose = 1;
+            break;
+        }
+    }
+
+    count = conf.streams + conf.snapshots;
+    if(conf.streams < 0 || conf.snapshots < 0 || count == 0 || conf.duration <= 0 || conf.rate < 0) {
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((rc = getaddrinfo(conf.host, conf.port, &hints, &server)) != 0) {
+        fprintf(stderr, "%s:%s: %s\n", conf.host, conf.port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    if((clients = calloc(count, sizeof(client))) == NULL) {
+        fprintf(stderr, "could not allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the threads only need room for a few local variables */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+
+    printf("%d stream clients and %d snapshot pollers against %s:%s for %d s\n",
+           conf.streams, conf.snapshots, conf.host, conf.port, conf.duration);
+
+    started = seconds(CLOCK_MONOTONIC);
+    for(i = 0; i < count; i++) {
+        clients[i].kind = (i < conf.streams) ? CLIENT_STREAM : CLIENT_SNAPSHOT;
+        clients[i].id = (i < conf.streams) ? i : i - conf.streams;
+        if(pthread_create(&clients[i].thread, &attr, (clients[i].kind == CLIENT_STREAM) ? stream_client : snapshot_client, &clients[i]) != 0) {
+            fprintf(stderr, "could not start client thread %d\n", i);
+            count = i;
+            break;
+        }
+    }
+
+    while(!stop && seconds(CLOCK_MONOTONIC) - started < conf.duration)
+        usleep(100 * 1000);
+    stop = 1;
+    elapsed = seconds(CLOCK_MONOTONIC) - started;
+
+    for(i = 0; i < count; i++)
+        pthread_join(clients[i].thread, NULL);
+
+    report(clients, count, CLIENT_STREAM, elapsed);
+    report(clients, count, CLIENT_SNAPSHOT, elapsed);
+
+    for(i = 0; i < count; i++)
+        free(clients[i].ages);
+    free(clients);
+    freeaddrinfo(server);
+
+    return EXIT_SUCCESS;
+}